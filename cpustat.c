@@ -0,0 +1,397 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "cpustat.h"
+
+#define CPUSTAT_BUFSIZE     (32 * 1024)   // the cpu lines of /proc/stat
+#define CPUSTAT_TASKSIZE    512
+
+typedef struct {
+	gint          tid;
+	gint          fd;             // task stat, -1 until first sampled
+	guint         seen;           // generation it was last listed in
+	gchar         name[16];       // kernel thread name
+	gchar         *owner;         // media path or subsystem
+	gchar         *role;
+	unsigned long long ticks;     // utime + stime at the last sample
+	gdouble       usage;
+} CpuStatThread;
+
+typedef struct {
+	unsigned long long busy;
+	unsigned long long total;
+	gdouble       usage;
+} CpuStatCore;
+
+G_LOCK_DEFINE_STATIC (cpustat);
+static gint stat_fd = -1;
+static gchar stat_buf[CPUSTAT_BUFSIZE];
+static CpuStatCore cores[CPUSTAT_MAX_CORES];
+static guint ncores;
+static GHashTable *threads;           // tid -> CpuStatThread
+static DIR *task_dir;
+static guint generation;
+static gint64 last_sample;            // monotonic usec
+
+/* what the calling thread last registered as, so per-job calls from
+ * pool threads (shared between pools) skip the lock */
+typedef struct {
+	gchar         *owner;
+	gchar         *role;
+} CpuStatSelf;
+
+static GStaticPrivate self_key = G_STATIC_PRIVATE_INIT;
+
+static void
+cpustat_thread_free(gpointer data)
+{
+	CpuStatThread *t = (CpuStatThread *) data;
+
+	if (t->fd >= 0)
+		close(t->fd);
+	g_free(t->owner);
+	g_free(t->role);
+	g_free(t);
+}
+
+static void
+cpustat_self_free(gpointer data)
+{
+	CpuStatSelf *self = (CpuStatSelf *) data;
+
+	g_free(self->owner);
+	g_free(self->role);
+	g_free(self);
+}
+
+/* look up or add a thread (cpustat lock held) */
+static CpuStatThread *
+cpustat_thread(gint tid)
+{
+	CpuStatThread *t;
+
+	if (!threads)
+		threads = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+			cpustat_thread_free);
+	t = g_hash_table_lookup(threads, GINT_TO_POINTER(tid));
+	if (!t) {
+		t = g_new0(CpuStatThread, 1);
+		t->tid = tid;
+		t->fd = -1;
+		t->seen = generation;
+		g_hash_table_insert(threads, GINT_TO_POINTER(tid), t);
+	}
+	return t;
+}
+
+/** cpustat_thread_register - attribute the calling thread
+ * @param owner - media path or subsystem
+ * @param role - what the thread does for it
+ *
+ * Cheap to call per job: repeating the last registration of the thread
+ * with the same strings only checks a thread-local.
+ */
+void
+cpustat_thread_register(const gchar *owner, const gchar *role)
+{
+	CpuStatSelf *self = g_static_private_get(&self_key);
+	CpuStatThread *t;
+
+	if (!self) {
+		self = g_new0(CpuStatSelf, 1);
+		g_static_private_set(&self_key, self, cpustat_self_free);
+	} else if (self->owner && !g_strcmp0(self->owner, owner) &&
+	           !g_strcmp0(self->role, role))
+		return;
+	g_free(self->owner);
+	g_free(self->role);
+	self->owner = g_strdup(owner);
+	self->role = g_strdup(role);
+
+	G_LOCK (cpustat);
+	t = cpustat_thread(syscall(SYS_gettid));
+	if (g_strcmp0(t->owner, owner) || g_strcmp0(t->role, role)) {
+		g_free(t->owner);
+		g_free(t->role);
+		t->owner = g_strdup(owner);
+		t->role = g_strdup(role);
+	}
+	G_UNLOCK (cpustat);
+}
+
+/** cpustat_thread_unregister - the calling thread no longer works for
+ * its owner
+ */
+void
+cpustat_thread_unregister(void)
+{
+	CpuStatSelf *self = g_static_private_get(&self_key);
+	CpuStatThread *t;
+
+	if (self) {
+		g_free(self->owner);
+		g_free(self->role);
+		self->owner = self->role = NULL;
+	}
+	G_LOCK (cpustat);
+	if (threads &&
+	    (t = g_hash_table_lookup(threads,
+	                             GINT_TO_POINTER(syscall(SYS_gettid))))) {
+		g_free(t->owner);
+		g_free(t->role);
+		t->owner = t->role = NULL;
+	}
+	G_UNLOCK (cpustat);
+}
+
+/* parse the cpu lines of /proc/stat: the aggregate into total, cpuN into
+ * cores */
+static gboolean
+cpustat_read_cores(unsigned long long total[CPUSTAT_FIELDS])
+{
+	gchar *line, *next, *end;
+	ssize_t len;
+
+	if (stat_fd < 0 && (stat_fd = open("/proc/stat", O_RDONLY)) < 0)
+		return FALSE;
+	len = pread(stat_fd, stat_buf, sizeof(stat_buf) - 1, 0);
+	if (len <= 0)
+		return FALSE;
+	stat_buf[len] = 0;
+
+	memset(total, 0, CPUSTAT_FIELDS * sizeof(total[0]));
+	for (line = stat_buf; strncmp(line, "cpu", 3) == 0; line = next) {
+		unsigned long long v[CPUSTAT_FIELDS] = { 0 }, sum, busy;
+		CpuStatCore *c;
+		gulong core;
+		gint i;
+
+		// a line cut off by the buffer is not used
+		if (!(next = strchr(line, '\n')))
+			break;
+		*next++ = 0;
+		if (line[3] == ' ') {
+			sscanf(line + 3, "%llu %llu %llu %llu %llu %llu %llu %llu",
+				&total[0], &total[1], &total[2], &total[3], &total[4],
+				&total[5], &total[6], &total[7]);
+			continue;
+		}
+		core = strtoul(line + 3, &end, 10);
+		if (core >= CPUSTAT_MAX_CORES ||
+		    sscanf(end, "%llu %llu %llu %llu %llu %llu %llu %llu",
+		           &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6],
+		           &v[7]) < 4)
+			continue;
+		for (i = 0, sum = 0; i < CPUSTAT_FIELDS; i++)
+			sum += v[i];
+		busy = sum - v[3] - v[4];     // not idle or waiting on io
+		c = &cores[core];
+		if (c->total && sum > c->total)
+			c->usage = (busy - c->busy) * 100.0 / (sum - c->total);
+		c->busy = busy;
+		c->total = sum;
+		ncores = MAX(ncores, core + 1);
+	}
+
+	return TRUE;
+}
+
+/* re-read a thread's utime and stime, FALSE if it is gone */
+static gboolean
+cpustat_read_thread(CpuStatThread *t, gdouble ticks_per_period)
+{
+	gchar buf[CPUSTAT_TASKSIZE];
+	unsigned long long utime, stime;
+	gboolean first = FALSE;
+	gchar *p, *q;
+	ssize_t len;
+	gint i;
+
+	if (t->fd < 0) {
+		gchar path[64];
+
+		g_snprintf(path, sizeof(path), "/proc/self/task/%d/stat", t->tid);
+		if ((t->fd = open(path, O_RDONLY)) < 0)
+			return FALSE;
+		first = TRUE;
+	}
+	// fails once the thread has exited, even if the tid is reused
+	len = pread(t->fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return FALSE;
+	buf[len] = 0;
+
+	// "tid (name) state ppid ..." where name may hold spaces and parens
+	p = strchr(buf, '(');
+	q = strrchr(buf, ')');
+	if (!p || !q || q < p)
+		return FALSE;
+	g_strlcpy(t->name, p + 1, MIN(sizeof(t->name), (gsize) (q - p)));
+	// q + 2 is field 3, utime and stime are fields 14 and 15
+	for (p = q + 2, i = 3; i < 14 && p; i++)
+		if ((p = strchr(p, ' ')))
+			p++;
+	if (!p || sscanf(p, "%llu %llu", &utime, &stime) != 2)
+		return FALSE;
+
+	if (!first && ticks_per_period > 0)
+		t->usage = (utime + stime - t->ticks) * 100.0 / ticks_per_period;
+	t->ticks = utime + stime;
+
+	return TRUE;
+}
+
+static gboolean
+cpustat_thread_gone(gpointer key, gpointer value, gpointer data)
+{
+	return ((CpuStatThread *) value)->seen != generation;
+}
+
+/** cpustat_sample - take the per-core and per-thread sample
+ * @param total - filled with the aggregate cpu counters
+ * @return FALSE if /proc/stat could not be read
+ *
+ * Called once a second from the main loop.
+ */
+gboolean
+cpustat_sample(unsigned long long total[CPUSTAT_FIELDS])
+{
+	gint64 now = g_get_monotonic_time();
+	gdouble ticks_per_period = 0;
+	struct dirent *d;
+	gboolean ret;
+
+	G_LOCK (cpustat);
+	ret = cpustat_read_cores(total);
+
+	if (last_sample)
+		ticks_per_period = sysconf(_SC_CLK_TCK) *
+			(gdouble) (now - last_sample) / G_USEC_PER_SEC;
+	last_sample = now;
+
+	if (!task_dir)
+		task_dir = opendir("/proc/self/task");
+	else
+		rewinddir(task_dir);
+	if (task_dir) {
+		generation++;
+		while ((d = readdir(task_dir))) {
+			CpuStatThread *t;
+			gint tid = atoi(d->d_name);
+
+			if (tid <= 0)
+				continue;
+			t = cpustat_thread(tid);
+			if (cpustat_read_thread(t, ticks_per_period))
+				t->seen = generation;
+		}
+		g_hash_table_foreach_remove(threads, cpustat_thread_gone, NULL);
+	}
+	G_UNLOCK (cpustat);
+
+	return ret;
+}
+
+static void
+cpustat_owner_add(gpointer key, gpointer value, gpointer data)
+{
+	CpuStatThread *t = (CpuStatThread *) value;
+	gpointer *args = (gpointer *) data;
+
+	if (t->owner && strcmp(t->owner, (const gchar *) args[0]) == 0)
+		*(gdouble *) args[1] += t->usage;
+}
+
+/** cpustat_owner - CPU used by the threads of an owner
+ * @param owner - media path or subsystem
+ * @return percent of one core
+ */
+gdouble
+cpustat_owner(const gchar *owner)
+{
+	gdouble usage = 0;
+	gpointer args[2] = { (gpointer) owner, &usage };
+
+	G_LOCK (cpustat);
+	if (threads)
+		g_hash_table_foreach(threads, cpustat_owner_add, args);
+	G_UNLOCK (cpustat);
+
+	return usage;
+}
+
+static gint
+cpustat_thread_cmp(gconstpointer a, gconstpointer b)
+{
+	gdouble ua = ((const CpuStatThread *) a)->usage;
+	gdouble ub = ((const CpuStatThread *) b)->usage;
+
+	return (ua < ub) - (ua > ub);
+}
+
+/** cpustat_render - add "cores" and "threads" (busiest first) arrays
+ * @param w - writer inside an object
+ */
+void
+cpustat_render(JsonWriter *w)
+{
+	GList *list = NULL, *walk;
+	guint i;
+
+	G_LOCK (cpustat);
+	json_begin_array(w, "cores");
+	for (i = 0; i < ncores; i++) {
+		json_begin_object(w, NULL);
+		json_stringf(w, "cpu", "cpu%u", i);
+		json_stringf(w, "busy", "%2.1f%%", cores[i].usage);
+		json_end_object(w);
+	}
+	json_end_array(w);
+
+	if (threads)
+		list = g_list_sort(g_hash_table_get_values(threads),
+			cpustat_thread_cmp);
+	json_begin_array(w, "threads");
+	for (walk = list; walk; walk = g_list_next (walk)) {
+		CpuStatThread *t = (CpuStatThread *) walk->data;
+
+		if (t->fd < 0)
+			continue;
+		json_begin_object(w, NULL);
+		json_stringf(w, "tid", "%d", t->tid);
+		json_string(w, "name", t->name);
+		if (t->owner) {
+			json_string(w, "owner", t->owner);
+			json_string(w, "role", t->role);
+		}
+		json_stringf(w, "cpu", "%2.1f%%", t->usage);
+		json_end_object(w);
+	}
+	json_end_array(w);
+	g_list_free(list);
+	G_UNLOCK (cpustat);
+}
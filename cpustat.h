@@ -0,0 +1,49 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _CPUSTAT_H_
+#define _CPUSTAT_H_
+
+#include <glib.h>
+
+#include "json.h"
+
+/*
+ * per-core and per-thread CPU accounting
+ *   - /proc/stat and /proc/self/task/<tid>/stat are kept open and re-read
+ *     with pread into fixed buffers, parsed in place
+ *   - threads name the stream (media path) or subsystem that owns them by
+ *     calling cpustat_thread_register from the thread itself; others are
+ *     reported by their kernel name only
+ *   - cpustat_sample runs on the 1Hz stats timer, usage is over the last
+ *     period in percent of one core
+ */
+#define CPUSTAT_MAX_CORES   256
+
+/* aggregate "cpu" line: usr nic sys idle io irq sirq steal */
+#define CPUSTAT_FIELDS      8
+
+void     cpustat_thread_register(const gchar *owner, const gchar *role);
+void     cpustat_thread_unregister(void);
+
+gboolean cpustat_sample(unsigned long long total[CPUSTAT_FIELDS]);
+gdouble  cpustat_owner(const gchar *owner);
+void     cpustat_render(JsonWriter *w);
+
+#endif /* _CPUSTAT_H_ */
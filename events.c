@@ -0,0 +1,258 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <gst/gst.h>
+
+#include "events.h"
+#include "json.h"
+
+GST_DEBUG_CATEGORY_STATIC (http_events_debug);
+#define GST_CAT_DEFAULT http_events_debug
+
+typedef struct {
+	GstHTTPClient *client;
+	gchar        **types;         // NULL = all
+	gchar         *path;          // NULL = all
+	GString       *queue;         // event text not yet sent
+	gboolean       dropped;       // too slow, connection being shut down
+} EventsSubscriber;
+
+/* subscribers and their queues; only memory is touched under the lock
+ * outside events_flush, whose writes do not block */
+G_LOCK_DEFINE_STATIC (events);
+static GList *subscribers;
+static guint64 last_id;
+static guint keepalive;
+static guint flush_source;
+
+static void
+events_subscriber_free (EventsSubscriber *sub)
+{
+	g_strfreev(sub->types);
+	g_free(sub->path);
+	g_string_free(sub->queue, TRUE);
+	g_free(sub);
+}
+
+static void
+events_client_closed (GstHTTPClient *client, gpointer data)
+{
+	GList *walk;
+
+	G_LOCK (events);
+	for (walk = subscribers; walk; walk = g_list_next (walk)) {
+		EventsSubscriber *sub = (EventsSubscriber *) walk->data;
+
+		if (sub->client == client) {
+			subscribers = g_list_delete_link (subscribers, walk);
+			events_subscriber_free (sub);
+			break;
+		}
+	}
+	G_UNLOCK (events);
+}
+
+static gboolean
+events_wanted (EventsSubscriber *sub, const gchar *type, const gchar *path)
+{
+	gchar **t;
+
+	if (sub->dropped)
+		return FALSE;
+	if (sub->path && (!path || strcmp(sub->path, path) != 0))
+		return FALSE;
+	if (!sub->types)
+		return TRUE;
+	for (t = sub->types; *t; t++) {
+		if (strcmp(*t, type) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* write what the subscriber sockets take without blocking
+ * (runs on the main loop) */
+static gboolean
+events_flush (gpointer data)
+{
+	gboolean pending = FALSE;
+	GList *walk;
+
+	G_LOCK (events);
+	flush_source = 0;
+	for (walk = subscribers; walk; walk = g_list_next (walk)) {
+		EventsSubscriber *sub = (EventsSubscriber *) walk->data;
+		ssize_t n;
+
+		if (sub->dropped || !sub->queue->len)
+			continue;
+		n = send(sub->client->sock, sub->queue->str, sub->queue->len,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n > 0)
+			g_string_erase(sub->queue, 0, n);
+		else if (n < 0 && errno != EAGAIN && errno != EINTR)
+			g_string_truncate(sub->queue, 0);
+		if (sub->queue->len > EVENTS_MAX_QUEUE) {
+			/* the main loop sees the hangup and closes the client */
+			GST_WARNING ("%s:%d: dropping slow event subscriber (%"
+				G_GSIZE_FORMAT " bytes queued)", sub->client->peer_ip,
+				sub->client->port, sub->queue->len);
+			sub->dropped = TRUE;
+			g_string_truncate(sub->queue, 0);
+			shutdown(sub->client->sock, SHUT_RDWR);
+		}
+		if (sub->queue->len)
+			pending = TRUE;
+	}
+	if (pending)
+		flush_source = g_timeout_add(EVENTS_RETRY_MS, events_flush, NULL);
+	G_UNLOCK (events);
+
+	return FALSE;
+}
+
+/* (call with the events lock held) */
+static void
+events_schedule_flush (void)
+{
+	if (!flush_source)
+		flush_source = g_idle_add(events_flush, NULL);
+}
+
+/* keeps idle streams open through proxies (runs on the main loop) */
+static gboolean
+events_keepalive (gpointer data)
+{
+	GList *walk;
+
+	G_LOCK (events);
+	for (walk = subscribers; walk; walk = g_list_next (walk)) {
+		EventsSubscriber *sub = (EventsSubscriber *) walk->data;
+
+		if (!sub->dropped)
+			g_string_append(sub->queue, ": keepalive\n\n");
+	}
+	events_schedule_flush();
+	G_UNLOCK (events);
+
+	return TRUE;
+}
+
+/** events_init - set up event publishing (call once at startup)
+ */
+void
+events_init(void)
+{
+	GST_DEBUG_CATEGORY_INIT (http_events_debug, "httpevents", 0,
+		"gst-httpd events");
+}
+
+/** events_publish - queue an event for the interested subscribers
+ * @param type - event name
+ * @param path - media the event is about (NULL for none)
+ * @param fmt - printf format of the JSON fields after time and path
+ *   (without braces, NULL for none)
+ *
+ * Does no I/O: the event is sent from the main loop.
+ */
+void
+events_publish(const gchar *type, const gchar *path, const gchar *fmt, ...)
+{
+	GString *data = g_string_new(NULL);
+	GList *walk;
+	gint64 now = g_get_real_time();
+	guint64 id;
+	va_list ap;
+
+	g_string_append_printf(data, "{\"time\": %" G_GINT64_FORMAT ".%06d",
+		now / G_USEC_PER_SEC, (int) (now % G_USEC_PER_SEC));
+	if (path) {
+		g_string_append(data, ", \"path\": ");
+		json_escape(data, path);
+	}
+	if (fmt) {
+		g_string_append(data, ", ");
+		va_start(ap, fmt);
+		g_string_append_vprintf(data, fmt, ap);
+		va_end(ap);
+	}
+	g_string_append_c(data, '}');
+
+	G_LOCK (events);
+	id = ++last_id;
+	GST_DEBUG ("event %" G_GUINT64_FORMAT " %s: %s", id, type, data->str);
+	for (walk = subscribers; walk; walk = g_list_next (walk)) {
+		EventsSubscriber *sub = (EventsSubscriber *) walk->data;
+
+		if (events_wanted(sub, type, path))
+			g_string_append_printf(sub->queue,
+				"id: %" G_GUINT64_FORMAT "\nevent: %s\ndata: %s\n\n",
+				id, type, data->str);
+	}
+	events_schedule_flush();
+	G_UNLOCK (events);
+
+	g_string_free(data, TRUE);
+}
+
+/** events_handler - subscribe a client to the event stream
+ * @param url - ?types=<type>,... and ?path=<media> filters
+ * @param client - client connection
+ * @param data - unused
+ *
+ * Returns FALSE to keep the connection open
+ */
+gboolean
+events_handler(MediaURL *url, GstHTTPClient *client, gpointer data)
+{
+	EventsSubscriber *sub = g_new0(EventsSubscriber, 1);
+	gchar *types = get_query_field(url, "types=");
+
+	sub->client = client;
+	sub->queue = g_string_new(NULL);
+	sub->path = get_query_field(url, "path=");
+	if (types) {
+		sub->types = g_strsplit(types, ",", 0);
+		g_free(types);
+	}
+
+	GST_INFO ("Subscribing %s:%d to events", client->peer_ip, client->port);
+
+	gst_http_client_writeln(client, "Content-Type: text/event-stream");
+	gst_http_client_writeln(client, "Cache-Control: no-cache");
+	gst_http_client_write(client, "\r\n");
+	/* reconnect quickly after a server restart */
+	gst_http_client_write(client, "retry: 1000\n\n");
+
+	G_LOCK (events);
+	subscribers = g_list_append (subscribers, sub);
+	if (!keepalive)
+		keepalive = g_timeout_add_seconds (EVENTS_KEEPALIVE, events_keepalive,
+			NULL);
+	G_UNLOCK (events);
+	g_signal_connect (client, "closed", G_CALLBACK (events_client_closed),
+		NULL);
+
+	return FALSE;
+}
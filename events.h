@@ -0,0 +1,53 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+#include <glib.h>
+
+#include "http-client.h"
+#include "media-mapping.h"
+
+/*
+ * server-sent event stream (text/event-stream)
+ *   - clients stay connected to the events mapping and receive every
+ *     event published after they subscribed, optionally filtered with
+ *     ?types=<type>[,<type>...] and ?path=<media path>
+ *   - every event carries an increasing id and the server time; data is a
+ *     JSON object of "time", "path" and the fields given by fmt
+ *   - events_publish may be called from any thread, also with media or
+ *     device locks held: it only queues the event per subscriber, the
+ *     main loop sends it with non-blocking writes
+ *   - subscribers with more than EVENTS_MAX_QUEUE bytes unsent are
+ *     disconnected
+ *   - idle streams get a comment line every EVENTS_KEEPALIVE seconds
+ */
+#define EVENTS_KEEPALIVE    15
+#define EVENTS_MAX_QUEUE    (64 * 1024)
+#define EVENTS_RETRY_MS     100     // while a subscriber has unsent events
+
+void     events_init(void);
+void     events_publish(const gchar *type, const gchar *path,
+	const gchar *fmt, ...) __attribute__ ((format(printf,3,4)));
+gboolean events_handler(MediaURL *url, GstHTTPClient *client,
+	gpointer data);
+
+#endif /* _EVENTS_H_ */
@@ -0,0 +1,269 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <gst/gst.h>
+
+#include "flightrec.h"
+#include "cpustat.h"
+#include "http-client.h"
+#include "media-mapping.h"
+
+typedef struct {
+	volatile guint32 tid;         // owning thread, 0 once it exited
+	volatile guint32 head;        // records written (wraps)
+	struct flightrec_event ev[FLIGHTREC_EVENTS];
+} FlightRecRing;
+
+/* rings are only ever added, so a dump can walk them without locking */
+static FlightRecRing *rings[FLIGHTREC_THREADS];
+static volatile gint nrings;
+static GStaticPrivate ring_key = G_STATIC_PRIVATE_INIT;
+G_LOCK_DEFINE_STATIC (flightrec);    // ring assignment only
+
+static guint64
+flightrec_clock(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (guint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* thread exit: the ring keeps its records until another thread takes it */
+static void
+flightrec_ring_release(gpointer data)
+{
+	((FlightRecRing *) data)->tid = 0;
+}
+
+/* the calling thread's ring: a new one while there is room, else the
+ * ring of an exited thread (NULL if none) */
+static FlightRecRing *
+flightrec_ring(void)
+{
+	FlightRecRing *r = g_static_private_get(&ring_key);
+	gint i;
+
+	if (r)
+		return r;
+
+	G_LOCK (flightrec);
+	if (nrings < FLIGHTREC_THREADS) {
+		r = g_new0(FlightRecRing, 1);
+		rings[nrings] = r;
+		__sync_synchronize();
+		nrings++;
+	} else {
+		for (i = 0; i < nrings && !r; i++)
+			if (rings[i]->tid == 0)
+				r = rings[i];
+	}
+	if (r) {
+		r->head = 0;
+		r->tid = syscall(SYS_gettid);
+	}
+	G_UNLOCK (flightrec);
+
+	if (r)
+		g_static_private_set(&ring_key, r, flightrec_ring_release);
+	return r;
+}
+
+/** flightrec_log - record an event from the calling thread
+ * @param type - FR_*
+ * @param tag - media path or peer address (truncated), may be NULL
+ * @param arg, value - type specific
+ */
+void
+flightrec_log(uint16_t type, const char *tag, int32_t arg, int64_t value)
+{
+	FlightRecRing *r = flightrec_ring();
+	struct flightrec_event *e;
+
+	if (!r)
+		return;
+	e = &r->ev[r->head & (FLIGHTREC_EVENTS - 1)];
+	e->time = flightrec_clock(CLOCK_MONOTONIC);
+	e->tid = r->tid;
+	e->type = type;
+	e->arg = arg;
+	e->value = value;
+	strncpy(e->tag, tag ? tag : "", FLIGHTREC_TAG);
+	/* the record is complete before a dump can count it */
+	__sync_synchronize();
+	r->head++;
+}
+
+typedef int (*FlightRecSink)(void *ctx, const void *buf, size_t len);
+
+static int
+flightrec_write(void *ctx, const void *buf, size_t len)
+{
+	int fd = GPOINTER_TO_INT(ctx);
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+flightrec_append(void *ctx, const void *buf, size_t len)
+{
+	g_byte_array_append((GByteArray *) ctx, buf, len);
+	return 0;
+}
+
+/* header and every ring, oldest record first, to a sink */
+static int
+flightrec_emit(FlightRecSink out, void *ctx)
+{
+	struct flightrec_header h;
+	gint n = nrings;
+	gint i;
+
+	__sync_synchronize();
+	memset(&h, 0, sizeof(h));
+	h.magic = FLIGHTREC_MAGIC;
+	h.version = FLIGHTREC_VERSION;
+	h.event_size = sizeof(struct flightrec_event);
+	h.rings = n;
+	h.pid = getpid();
+	h.monotonic = flightrec_clock(CLOCK_MONOTONIC);
+	h.realtime = flightrec_clock(CLOCK_REALTIME);
+	if (out(ctx, &h, sizeof(h)) < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		FlightRecRing *r = rings[i];
+		struct flightrec_ring_header rh;
+		guint32 head = r->head;
+		guint32 first, part;
+
+		rh.tid = r->tid;
+		rh.count = MIN(head, FLIGHTREC_EVENTS);
+		first = (head - rh.count) & (FLIGHTREC_EVENTS - 1);
+		part = MIN(rh.count, FLIGHTREC_EVENTS - first);
+		if (out(ctx, &rh, sizeof(rh)) < 0 ||
+		    out(ctx, &r->ev[first], part * sizeof(r->ev[0])) < 0 ||
+		    out(ctx, &r->ev[0], (rh.count - part) * sizeof(r->ev[0])) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/** flightrec_dump - write every ring to a file descriptor
+ * @param fd
+ * @return 0, -1 on a write error
+ *
+ * Only uses write and clock_gettime so it can run in a signal handler.
+ */
+int
+flightrec_dump(int fd)
+{
+	return flightrec_emit(flightrec_write, GINT_TO_POINTER(fd));
+}
+
+/** flightrec_save - dump to FLIGHTREC_DUMP in the working directory
+ * (signal-safe)
+ */
+int
+flightrec_save(void)
+{
+	int fd = open(FLIGHTREC_DUMP, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int ret;
+
+	if (fd < 0)
+		return -1;
+	ret = flightrec_dump(fd);
+	close(fd);
+	return ret;
+}
+
+typedef struct {
+	GstHTTPClient *client;
+	GByteArray    *dump;
+} FlightRecSend;
+
+/* send a snapshot off the main loop: it is up to a few MB */
+static gpointer
+flightrec_send_thread(gpointer data)
+{
+	FlightRecSend *fs = (FlightRecSend *) data;
+
+	cpustat_thread_register("flightrec", "dump");
+	gst_http_client_writebuf(fs->client, (const char *) fs->dump->data,
+		fs->dump->len);
+	/* the main loop sees the hangup and releases the client */
+	shutdown(fs->client->sock, SHUT_RDWR);
+
+	g_byte_array_free(fs->dump, TRUE);
+	g_object_unref(fs->client);
+	g_free(fs);
+	return NULL;
+}
+
+/** flightrec_handler - serve a dump
+ * @param url - url mapping
+ * @param client - client connection
+ * @param data - unused
+ *
+ * The rings are copied on the main loop (a memcpy) and sent from a
+ * thread.  Returns FALSE: the thread closes the connection.
+ */
+int
+flightrec_handler(MediaURL *url, GstHTTPClient *client, void *data)
+{
+	FlightRecSend *fs = g_new0(FlightRecSend, 1);
+
+	GST_INFO("Serving flight recorder to %s:%d", client->peer_ip,
+		client->port);
+
+	fs->dump = g_byte_array_sized_new(sizeof(struct flightrec_header) +
+		nrings * (sizeof(struct flightrec_ring_header) +
+		          sizeof(((FlightRecRing *) 0)->ev)));
+	flightrec_emit(flightrec_append, fs->dump);
+
+	gst_http_client_writeln(client, "Content-Type: application/octet-stream");
+	gst_http_client_writeln(client, "Content-Disposition: attachment; "
+		"filename=\"%s\"", FLIGHTREC_DUMP);
+	gst_http_client_writeln(client, "Cache-Control: no-cache");
+	gst_http_client_writeln(client, "Content-Length: %u", fs->dump->len);
+	gst_http_client_write(client, "\r\n");
+
+	fs->client = g_object_ref(client);
+	g_thread_create(flightrec_send_thread, fs, FALSE, NULL);
+
+	return FALSE;
+}
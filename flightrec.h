@@ -0,0 +1,102 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _FLIGHTREC_H_
+#define _FLIGHTREC_H_
+
+#include <stdint.h>
+
+/*
+ * flight recorder: always-on binary event log for post-mortems
+ *   - each thread appends fixed size records to its own ring (no locks,
+ *     no formatting); rings of exited threads are reused
+ *   - dumped on SIGUSR1 (and on a crash) to FLIGHTREC_DUMP in the working
+ *     directory, or fetched over HTTP from the --flightrec path (off
+ *     unless given, like an admin endpoint)
+ *   - tools/flightrec-decode turns a dump into text, merged by time
+ *   - a dump taken while a thread is writing may show that one record
+ *     torn; everything else is consistent
+ *
+ * This header is also used by the decoder, so it does not need glib.
+ */
+#define FLIGHTREC_MAGIC     0x52464847  // "GHFR"
+#define FLIGHTREC_VERSION   1
+#define FLIGHTREC_EVENTS    1024        // records per thread (power of 2)
+#define FLIGHTREC_THREADS   128         // rings
+#define FLIGHTREC_TAG       20
+#define FLIGHTREC_DUMP      "flightrec.bin"
+
+enum {
+	FR_NONE,
+	FR_CONNECT,       // tag peer ip, arg port, value fd
+	FR_DISCONNECT,    // tag peer ip, arg port, value fd
+	FR_REQUEST,       // tag path, arg fd
+	FR_STATE,         // tag media, arg old, value new
+	FR_FRAME_LATE,    // tag media, value age usec
+	FR_FRAME_DROPPED, // tag media or recording dir, arg errno, value bytes
+	FR_SEND_STALL,    // unused while client sockets block, kept for old dumps
+	FR_SEND_ERROR,    // tag peer ip, arg fd, value errno
+	FR_ERROR,         // tag media, arg failures
+	FR_STALL,         // tag media, arg stalls, value usec without frames
+	FR_BREAKER,       // tag media, arg failures
+	FR_CONGESTED,     // tag peer ip, arg fd, value unsent bytes
+	FR_ADAPT,         // tag peer ip, arg new level, value bytes/s sent
+	FR_TYPES
+};
+
+/* one record: 48 bytes, native endian */
+struct flightrec_event {
+	uint64_t time;                // CLOCK_MONOTONIC usec
+	uint32_t tid;
+	uint16_t type;
+	uint16_t reserved;
+	int64_t  value;
+	int32_t  arg;
+	char     tag[FLIGHTREC_TAG];  // not terminated when full
+};
+
+/*
+ * dump: a header, then per ring a flightrec_ring_header followed by
+ * count records, oldest first
+ */
+struct flightrec_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t event_size;
+	uint32_t rings;
+	uint32_t pid;
+	uint64_t monotonic;           // usec, at the dump
+	uint64_t realtime;            // usec since the epoch, at the dump
+};
+
+struct flightrec_ring_header {
+	uint32_t tid;
+	uint32_t count;
+};
+
+struct _MediaURL;
+struct _GstHTTPClient;
+
+void flightrec_log(uint16_t type, const char *tag, int32_t arg, int64_t value);
+int  flightrec_dump(int fd);      // async-signal-safe
+int  flightrec_save(void);        // dump to FLIGHTREC_DUMP, signal-safe
+int  flightrec_handler(struct _MediaURL *url, struct _GstHTTPClient *client,
+	void *data);
+
+#endif /* _FLIGHTREC_H_ */
@@ -0,0 +1,222 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gst/gst.h>
+
+#include "history.h"
+#include "http-client.h"
+#include "media-mapping.h"
+#include "media.h"
+#include "json.h"
+
+typedef struct {
+	GstHTTPMedia  *media;
+	guint64       frames;         // counters at the previous sample
+	guint64       bytes;
+	guint16       *fps;           // frames from the pipeline per second
+	guint32       *bytes_out;     // bytes sent to clients per second
+	guint16       *clients;
+} HistoryMedia;
+
+G_LOCK_DEFINE_STATIC (history);
+static struct {
+	guint         head;           // next slot to write
+	guint         count;          // slots in use
+	guint32       *time;          // unix seconds
+	guint16       *cpu;           // busy permille (HISTORY_UNKNOWN)
+	guint32       *mem;           // KB used
+	guint16       *clients;
+	guint         nmedia;
+	HistoryMedia  *media;
+} history;
+
+/** history_init - allocate the ring for the configured streams
+ * @param mapping
+ */
+void
+history_init(GstHTTPMediaMapping *mapping)
+{
+	GList *walk;
+	guint i;
+
+	G_LOCK (history);
+	if (history.time) {
+		G_UNLOCK (history);
+		return;
+	}
+	history.time = g_new0(guint32, HISTORY_SLOTS);
+	history.cpu = g_new0(guint16, HISTORY_SLOTS);
+	history.mem = g_new0(guint32, HISTORY_SLOTS);
+	history.clients = g_new0(guint16, HISTORY_SLOTS);
+
+	GST_HTTP_MEDIA_MAPPING_LOCK(mapping);
+	for (walk = mapping->mappings; walk; walk = g_list_next (walk)) {
+		GstHTTPMedia *media = (GstHTTPMedia *) walk->data;
+		if (media->pipeline_desc)
+			history.nmedia++;
+	}
+	history.media = g_new0(HistoryMedia, history.nmedia);
+	for (walk = mapping->mappings, i = 0; walk; walk = g_list_next (walk)) {
+		GstHTTPMedia *media = (GstHTTPMedia *) walk->data;
+		HistoryMedia *h;
+		if (!media->pipeline_desc)
+			continue;
+		h = &history.media[i++];
+		h->media = g_object_ref(media);
+		h->frames = media->metrics.frames_in;
+		h->bytes = media->metrics.out.bytes;
+		h->fps = g_new0(guint16, HISTORY_SLOTS);
+		h->bytes_out = g_new0(guint32, HISTORY_SLOTS);
+		h->clients = g_new0(guint16, HISTORY_SLOTS);
+	}
+	GST_HTTP_MEDIA_MAPPING_UNLOCK(mapping);
+	G_UNLOCK (history);
+}
+
+/** history_sample - record one second
+ * @param cpu - busy permille or HISTORY_UNKNOWN
+ * @param mem_used - KB
+ * @param clients - connected clients
+ */
+void
+history_sample(guint cpu, guint64 mem_used, guint clients)
+{
+	guint idx, i;
+
+	G_LOCK (history);
+	if (!history.time) {
+		G_UNLOCK (history);
+		return;
+	}
+	idx = history.head;
+	history.time[idx] = time(NULL);
+	history.cpu[idx] = cpu;
+	history.mem[idx] = MIN(mem_used, G_MAXUINT32);
+	history.clients[idx] = MIN(clients, G_MAXUINT16);
+	for (i = 0; i < history.nmedia; i++) {
+		HistoryMedia *h = &history.media[i];
+		GstHTTPMedia *media = h->media;
+		guint64 frames = media->metrics.frames_in;
+		guint64 bytes = media->metrics.out.bytes;
+		guint n;
+
+		h->fps[idx] = MIN(frames - h->frames, G_MAXUINT16);
+		h->bytes_out[idx] = MIN(bytes - h->bytes, G_MAXUINT32);
+		h->frames = frames;
+		h->bytes = bytes;
+		GST_HTTP_MEDIA_LOCK (media);
+		n = g_list_length(media->clients) + g_list_length(media->replay);
+		GST_HTTP_MEDIA_UNLOCK (media);
+		h->clients[idx] = MIN(n, G_MAXUINT16);
+	}
+	history.head = (idx + 1) % HISTORY_SLOTS;
+	if (history.count < HISTORY_SLOTS)
+		history.count++;
+	G_UNLOCK (history);
+}
+
+/* one column of samples from slot first on */
+#define HISTORY_COLUMN(w, key, col, first, n, value) do { \
+	guint _k; \
+	json_begin_array(w, key); \
+	for (_k = 0; _k < (n); _k++) { \
+		guint _i = ((first) + _k) % HISTORY_SLOTS; \
+		value(w, (col)[_i]); \
+	} \
+	json_end_array(w); \
+} while (0)
+
+#define HISTORY_UINT(w, v)   json_uint(w, NULL, v)
+#define HISTORY_BITS(w, v)   json_uint(w, NULL, (guint64) (v) * 8)
+#define HISTORY_CPU(w, v)    json_double(w, NULL, \
+	(v) == HISTORY_UNKNOWN ? NAN : (v) / 10.0, 1)
+
+/** history_handler - serve the history ring as columnar JSON
+ * @param url - ?since=<unix time>
+ * @param client - client connection
+ * @param data - unused
+ *
+ * {"interval": 1, "time": [...], "cpu": [...], "mem": [...],
+ *  "clients": [...], "media": [{"path", "fps", "bps", "clients"}, ...]}
+ * with cpu in percent, mem in KB and bps in bits per second
+ *
+ * The body is sent off the main loop (see gst_http_client_send_last).
+ */
+gboolean
+history_handler(MediaURL *url, GstHTTPClient *client, gpointer data)
+{
+	gchar *str = get_query_field(url, "since=");
+	guint32 since = str ? strtoul(str, NULL, 10) : 0;
+	GString *s = g_string_sized_new(64 * 1024);
+	JsonWriter w;
+	guint first, n, i;
+	gsize len;
+
+	g_free(str);
+	GST_INFO("Serving history to %s:%d", client->peer_ip, client->port);
+
+	G_LOCK (history);
+	first = (history.head + HISTORY_SLOTS - history.count) % HISTORY_SLOTS;
+	n = history.count;
+	while (n && history.time[first] <= since) {
+		first = (first + 1) % HISTORY_SLOTS;
+		n--;
+	}
+
+	json_init(&w, s);
+	json_begin_object(&w, NULL);
+	json_uint(&w, "interval", 1);
+	HISTORY_COLUMN(&w, "time", history.time, first, n, HISTORY_UINT);
+	HISTORY_COLUMN(&w, "cpu", history.cpu, first, n, HISTORY_CPU);
+	HISTORY_COLUMN(&w, "mem", history.mem, first, n, HISTORY_UINT);
+	HISTORY_COLUMN(&w, "clients", history.clients, first, n, HISTORY_UINT);
+	json_begin_array(&w, "media");
+	for (i = 0; i < history.nmedia; i++) {
+		HistoryMedia *h = &history.media[i];
+		const gchar *name = h->media->path;
+
+		if (*name == '/' && name[1]) name++;
+		json_begin_object(&w, NULL);
+		json_string(&w, "path", name);
+		HISTORY_COLUMN(&w, "fps", h->fps, first, n, HISTORY_UINT);
+		HISTORY_COLUMN(&w, "bps", h->bytes_out, first, n, HISTORY_BITS);
+		HISTORY_COLUMN(&w, "clients", h->clients, first, n, HISTORY_UINT);
+		json_end_object(&w);
+	}
+	json_end_array(&w);
+	json_end_object(&w);
+	G_UNLOCK (history);
+	g_string_append(s, "\r\n");
+
+	gst_http_client_status(client, "200 OK");
+	gst_http_client_writeln(client, "Content-Type: application/json");
+	gst_http_client_writeln(client, "Cache-Control: no-cache");
+	gst_http_client_writeln(client, "Content-Length: %" G_GSIZE_FORMAT,
+		s->len);
+	gst_http_client_write(client, "\r\n");
+	len = s->len;
+	gst_http_client_send_last(client, g_string_free(s, FALSE), len);
+
+	return FALSE;
+}
@@ -0,0 +1,45 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <glib.h>
+
+#include "http-client.h"
+#include "media-mapping.h"
+
+/*
+ * per-second history of the last hour for trend graphs
+ *   - columnar ring (one array per series) allocated once by history_init
+ *     after the streams are configured; streams added later are not kept
+ *   - history_sample is called by the 1Hz stats timer, media counters are
+ *     stored as per-second deltas
+ *   - served as columnar JSON, oldest sample first; ?since=<unix time>
+ *     returns only newer samples so a chart can poll for the tail
+ */
+#define HISTORY_SLOTS       3600
+#define HISTORY_UNKNOWN     0xffff    // cpu not sampled
+
+void     history_init(GstHTTPMediaMapping *mapping);
+void     history_sample(guint cpu, guint64 mem_used, guint clients);
+gboolean history_handler(MediaURL *url, GstHTTPClient *client,
+	gpointer data);
+
+#endif /* _HISTORY_H_ */
@@ -0,0 +1,425 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "hls.h"
+#include "media.h"
+#include "cpustat.h"
+
+GST_DEBUG_CATEGORY_STATIC (http_hls_debug);
+#define GST_CAT_DEFAULT http_hls_debug
+
+#define PART_PREALLOC   (64 * 1024)
+
+static void
+hls_segment_free(GstHTTPHLSSegment *seg)
+{
+	guint i;
+
+	for (i = 0; i < seg->nparts; i++)
+		gst_buffer_unref(seg->parts[i]);
+	g_free(seg);
+}
+
+/** hls_new - create a segmenter
+ * @param segment_ms - target segment duration
+ * @param depth - complete segments kept in the ring
+ * @param part_ms - partial segment duration (0 = no partial segments)
+ */
+GstHTTPHLS *
+hls_new(guint segment_ms, guint depth, guint part_ms)
+{
+	GstHTTPHLS *hls = g_new0(GstHTTPHLS, 1);
+
+	if (!http_hls_debug)
+		GST_DEBUG_CATEGORY_INIT (http_hls_debug, "httphls", 0, "HLS segmenter");
+
+	hls->lock = g_mutex_new();
+	hls->target = (gint64) segment_ms * 1000;
+	hls->part_target = (part_ms < segment_ms) ? (gint64) part_ms * 1000 : 0;
+	hls->depth = CLAMP(depth, 2, HLS_MAX_DEPTH);
+	hls->last_delta = TRUE;
+	/* sequence numbers stay unique across restarts of the server, so
+	 * caching proxies never serve a stale segment */
+	hls->next_seq = (guint) time(NULL);
+
+	return hls;
+}
+
+/** hls_free - free a segmenter and its segments
+ */
+void
+hls_free(GstHTTPHLS *hls)
+{
+	guint i;
+
+	if (!hls)
+		return;
+	for (i = 0; i < hls->count; i++)
+		hls_segment_free(hls->ring[i]);
+	if (hls->cur)
+		hls_segment_free(hls->cur);
+	if (hls->part)
+		g_byte_array_free(hls->part, TRUE);
+	g_mutex_free(hls->lock);
+	g_free(hls);
+}
+
+/* finish the part being built (lock held) */
+static void
+hls_part_close(GstHTTPHLS *hls, gint64 now)
+{
+	GstHTTPHLSSegment *seg = hls->cur;
+	GstBuffer *buf;
+	guint len = hls->part->len;
+
+	if (len == 0)
+		return;
+
+	buf = gst_buffer_new();
+	GST_BUFFER_MALLOCDATA(buf) = g_byte_array_free(hls->part, FALSE);
+	GST_BUFFER_DATA(buf) = GST_BUFFER_MALLOCDATA(buf);
+	GST_BUFFER_SIZE(buf) = len;
+
+	seg->parts[seg->nparts] = buf;
+	seg->part_dur[seg->nparts] = now - hls->part_start;
+	seg->part_key[seg->nparts] = hls->part_keyframe;
+	seg->nparts++;
+	seg->size += len;
+
+	hls->part = g_byte_array_sized_new(PART_PREALLOC);
+	hls->part_start = now;
+	hls->part_keyframe = FALSE;
+}
+
+/* start a new segment at a keyframe (lock held) */
+static void
+hls_segment_open(GstHTTPHLS *hls, GList *streamheader, gint64 now)
+{
+	GList *walk;
+
+	hls->cur = g_new0(GstHTTPHLSSegment, 1);
+	hls->cur->seq = hls->next_seq++;
+	hls->cur->discont = hls->discont;
+	hls->discont = FALSE;
+	hls->seg_start = hls->part_start = now;
+	hls->part_keyframe = TRUE;
+	if (!hls->part)
+		hls->part = g_byte_array_sized_new(PART_PREALLOC);
+
+	/* every segment must be decodable on its own: PAT/PMT first */
+	for (walk = streamheader; walk; walk = g_list_next (walk)) {
+		GstBuffer *b = (GstBuffer *) walk->data;
+		g_byte_array_append(hls->part, b->data, b->size);
+	}
+}
+
+/* move the segment being built onto the ring (lock held) */
+static void
+hls_segment_close(GstHTTPHLS *hls, gint64 now)
+{
+	GstHTTPHLSSegment *seg = hls->cur;
+
+	hls_part_close(hls, now);
+	seg->duration = now - hls->seg_start;
+	hls->max_duration = MAX(hls->max_duration, seg->duration);
+
+	if (hls->count == hls->depth) {
+		if (hls->ring[0]->discont)
+			hls->disc_seq++;
+		hls_segment_free(hls->ring[0]);
+		memmove(hls->ring, hls->ring + 1, --hls->count * sizeof(hls->ring[0]));
+	}
+	hls->ring[hls->count++] = seg;
+	hls->cur = NULL;
+
+	GST_DEBUG ("segment %u: %" G_GSIZE_FORMAT " bytes %lldms %u parts",
+		seg->seq, seg->size, (long long) seg->duration / 1000, seg->nparts);
+}
+
+/** hls_push - add a buffer of the MPEG-TS stream
+ * @param hls
+ * @param streamheader - PAT/PMT buffers prepended to each segment
+ * @param buffer - stream buffer
+ */
+void
+hls_push(GstHTTPHLS *hls, GList *streamheader, GstBuffer *buffer)
+{
+	gboolean delta = GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	gboolean keyframe;
+	gint64 now;
+
+	if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_IN_CAPS))
+		return;
+
+	now = g_get_monotonic_time();
+	g_mutex_lock(hls->lock);
+	/* all buffers of a keyframe are non-delta: it starts at the first one */
+	keyframe = !delta && hls->last_delta;
+	hls->last_delta = delta;
+
+	if (keyframe && hls->cur && now - hls->seg_start >= hls->target)
+		hls_segment_close(hls, now);
+	if (!hls->cur) {
+		if (!keyframe)
+			goto out; // segments start at a keyframe
+		hls_segment_open(hls, streamheader, now);
+	} else if (hls->part_target && now - hls->part_start >= hls->part_target &&
+	           hls->cur->nparts < HLS_MAX_PARTS - 1)
+	{
+		hls_part_close(hls, now);
+		hls->part_keyframe = keyframe;
+	}
+	g_byte_array_append(hls->part, buffer->data, buffer->size);
+
+out:
+	g_mutex_unlock(hls->lock);
+}
+
+/** hls_reset - the stream stopped: drop the segment in progress
+ *
+ * Complete segments stay available; the next one is marked as a
+ * discontinuity.
+ */
+void
+hls_reset(GstHTTPHLS *hls)
+{
+	g_mutex_lock(hls->lock);
+	if (hls->cur) {
+		hls_segment_free(hls->cur);
+		hls->cur = NULL;
+	}
+	if (hls->part)
+		g_byte_array_set_size(hls->part, 0);
+	hls->last_delta = TRUE;
+	hls->discont = TRUE;
+	g_mutex_unlock(hls->lock);
+}
+
+/* list the parts of a segment (lock held) */
+static void
+hls_playlist_parts(GstHTTPHLS *hls, GString *s, GstHTTPHLSSegment *seg)
+{
+	guint i;
+
+	for (i = 0; i < seg->nparts; i++) {
+		g_string_append_printf(s, "#EXT-X-PART:DURATION=%.3f,"
+			"URI=\"seg%u.%u.ts\"%s\n", seg->part_dur[i] / 1e6, seg->seq, i,
+			seg->part_key[i] ? ",INDEPENDENT=YES" : "");
+	}
+}
+
+/* render the media playlist (lock held) */
+static GString *
+hls_playlist(GstHTTPHLS *hls)
+{
+	GString *s = g_string_new("#EXTM3U\n");
+	gint64 target = MAX(hls->max_duration, hls->target);
+	guint i;
+
+	g_string_append_printf(s, "#EXT-X-VERSION:%d\n", hls->part_target ? 6 : 3);
+	g_string_append_printf(s, "#EXT-X-TARGETDURATION:%u\n",
+		(guint) ((target + 999999) / 1000000));
+	if (hls->part_target) {
+		g_string_append_printf(s, "#EXT-X-PART-INF:PART-TARGET=%.3f\n",
+			hls->part_target / 1e6);
+		g_string_append_printf(s, "#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=%.3f\n",
+			3 * hls->part_target / 1e6);
+	}
+	g_string_append_printf(s, "#EXT-X-MEDIA-SEQUENCE:%u\n",
+		hls->count ? hls->ring[0]->seq : hls->cur->seq);
+	g_string_append_printf(s, "#EXT-X-DISCONTINUITY-SEQUENCE:%u\n",
+		hls->disc_seq);
+
+	for (i = 0; i < hls->count; i++) {
+		GstHTTPHLSSegment *seg = hls->ring[i];
+
+		if (seg->discont)
+			g_string_append(s, "#EXT-X-DISCONTINUITY\n");
+		/* parts are only listed close to the live edge */
+		if (hls->part_target && i + 2 >= hls->count)
+			hls_playlist_parts(hls, s, seg);
+		g_string_append_printf(s, "#EXTINF:%.3f,\nseg%u.ts\n",
+			seg->duration / 1e6, seg->seq);
+	}
+	if (hls->part_target && hls->cur && hls->cur->nparts) {
+		if (hls->cur->discont)
+			g_string_append(s, "#EXT-X-DISCONTINUITY\n");
+		hls_playlist_parts(hls, s, hls->cur);
+	}
+
+	return s;
+}
+
+/* find a complete segment or a part by sequence number (lock held) */
+static GstHTTPHLSSegment *
+hls_find(GstHTTPHLS *hls, guint seq)
+{
+	guint i;
+
+	for (i = 0; i < hls->count; i++) {
+		if (hls->ring[i]->seq == seq)
+			return hls->ring[i];
+	}
+	if (hls->cur && hls->cur->seq == seq)
+		return hls->cur;
+	return NULL;
+}
+
+/* a response body being sent off the main loop */
+typedef struct {
+	GstHTTPClient *client;
+	GString       *playlist;      // or
+	GstBuffer     *bufs[HLS_MAX_PARTS];
+	guint          n;
+} HLSSend;
+
+static gpointer
+hls_send_thread(gpointer data)
+{
+	HLSSend *hs = (HLSSend *) data;
+	guint i;
+
+	cpustat_thread_register("hls", "send");
+	if (hs->playlist) {
+		gst_http_client_writebuf(hs->client, hs->playlist->str,
+			hs->playlist->len);
+		g_string_free(hs->playlist, TRUE);
+	}
+	for (i = 0; i < hs->n; i++) {
+		gst_http_client_writebuf(hs->client, (char *) hs->bufs[i]->data,
+			hs->bufs[i]->size);
+		gst_buffer_unref(hs->bufs[i]);
+	}
+	/* the main loop sees the hangup and releases the client */
+	shutdown(hs->client->sock, SHUT_RDWR);
+
+	g_object_unref(hs->client);
+	g_free(hs);
+	return NULL;
+}
+
+/* hand the body to a thread: a slow client must not hold the main loop */
+static gboolean
+hls_send(GstHTTPClient *client, HLSSend *hs)
+{
+	hs->client = g_object_ref(client);
+	g_thread_create(hls_send_thread, hs, FALSE, NULL);
+	return FALSE;
+}
+
+/** hls_handler - serve the playlist, segments and parts of a media
+ * @param url - url mapping (<media path>/<name>)
+ * @param client - client connection
+ * @param data - the #GstHTTPMedia
+ *
+ * Requests keep the media pipeline running (see gst_http_media_hold).
+ * Bodies are sent from a thread, which closes the connection.
+ */
+gboolean
+hls_handler(MediaURL *url, GstHTTPClient *client, gpointer data)
+{
+	GstHTTPMedia *media = (GstHTTPMedia *) data;
+	GstHTTPHLS *hls = media->hls;
+	GstBuffer *bufs[HLS_MAX_PARTS];
+	GstHTTPHLSSegment *seg;
+	HLSSend *hs;
+	const gchar *name;
+	guint seq, part, n = 0, i;
+	gsize size = 0;
+
+	name = strrchr(url->path, '/');
+	name = name ? name + 1 : url->path;
+
+	gst_http_media_hold(media);
+
+	if (strcmp(name, "index.m3u8") == 0) {
+		GString *s;
+
+		g_mutex_lock(hls->lock);
+		if (!hls->count && !(hls->part_target && hls->cur &&
+		    hls->cur->nparts))
+		{
+			g_mutex_unlock(hls->lock);
+			gst_http_client_status(client, "503 Service Unavailable");
+			gst_http_client_writeln(client, "Retry-After: 1");
+			gst_http_client_write(client, "\r\n");
+			return TRUE;
+		}
+		s = hls_playlist(hls);
+		hls->playlist_hits++;
+		g_mutex_unlock(hls->lock);
+
+		gst_http_client_status(client, "200 OK");
+		gst_http_client_writeln(client,
+			"Content-Type: application/vnd.apple.mpegurl");
+		gst_http_client_writeln(client, "Cache-Control: max-age=%d",
+			hls->part_target ? 0 : 1);
+		gst_http_client_writeln(client, "Content-Length: %" G_GSIZE_FORMAT,
+			s->len);
+		gst_http_client_write(client, "\r\n");
+		hs = g_new0(HLSSend, 1);
+		hs->playlist = s;
+		return hls_send(client, hs);
+	}
+
+	g_mutex_lock(hls->lock);
+	if (sscanf(name, "seg%u.%u.ts", &seq, &part) == 2) {
+		if ((seg = hls_find(hls, seq)) && part < seg->nparts) {
+			bufs[n++] = gst_buffer_ref(seg->parts[part]);
+			hls->part_hits++;
+		}
+	} else if (sscanf(name, "seg%u.ts", &seq) == 1) {
+		if ((seg = hls_find(hls, seq)) && seg != hls->cur) {
+			for (n = 0; n < seg->nparts; n++)
+				bufs[n] = gst_buffer_ref(seg->parts[n]);
+			seg->hits++;
+			hls->segment_hits++;
+		}
+	}
+	if (!n)
+		hls->misses++;
+	g_mutex_unlock(hls->lock);
+
+	if (!n) {
+		gst_http_client_status(client, "404 Not Found");
+		gst_http_client_write(client, "\r\n");
+		return TRUE;
+	}
+
+	for (i = 0; i < n; i++)
+		size += bufs[i]->size;
+	gst_http_client_status(client, "200 OK");
+	gst_http_client_writeln(client, "Content-Type: video/mp2t");
+	/* segments never change and their names are never reused */
+	gst_http_client_writeln(client, "Cache-Control: max-age=%u",
+		(guint) MAX(10, hls->depth * hls->target / G_USEC_PER_SEC));
+	gst_http_client_writeln(client, "Content-Length: %" G_GSIZE_FORMAT, size);
+	gst_http_client_write(client, "\r\n");
+	hs = g_new0(HLSSend, 1);
+	memcpy(hs->bufs, bufs, n * sizeof(bufs[0]));
+	hs->n = n;
+
+	return hls_send(client, hs);
+}
@@ -0,0 +1,95 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef _HLS_H_
+#define _HLS_H_
+
+#include <gst/gst.h>
+
+#include "http-client.h"
+#include "media-mapping.h"
+
+/*
+ * in-memory HLS segmenter
+ *   - the MPEG-TS output of a media is cut into segments at keyframes
+ *     (once the target duration is reached) and kept in a ring of @depth
+ *     segments; segments are immutable once complete and served as
+ *     cacheable GETs
+ *   - with part_ms set, segments are built of low-latency partial segments
+ *     (EXT-X-PART) which can be fetched while the segment is in progress
+ *   - a segment is a list of part buffers: serving one takes a reference
+ *     under the lock and writes outside it
+ */
+#define HLS_MAX_DEPTH   32
+#define HLS_MAX_PARTS   64  // parts per segment
+
+typedef struct _GstHTTPHLSSegment GstHTTPHLSSegment;
+typedef struct _GstHTTPHLS GstHTTPHLS;
+
+struct _GstHTTPHLSSegment {
+	guint          seq;           // media sequence number
+	GstBuffer     *parts[HLS_MAX_PARTS];
+	gint64         part_dur[HLS_MAX_PARTS]; // usec
+	gboolean       part_key[HLS_MAX_PARTS]; // part starts with a keyframe
+	guint          nparts;
+	gint64         duration;      // usec (complete segments)
+	gsize          size;
+	gboolean       discont;       // first segment after a restart
+	guint          hits;          // segment GETs
+};
+
+struct _GstHTTPHLS {
+	GMutex        *lock;
+
+	/* configuration */
+	gint64         target;        // segment target duration (usec)
+	gint64         part_target;   // part target duration (usec, 0 = no parts)
+	guint          depth;         // complete segments kept
+
+	/* ring of complete segments, oldest first */
+	GstHTTPHLSSegment *ring[HLS_MAX_DEPTH];
+	guint          count;
+	guint          disc_seq;      // discontinuities dropped off the ring
+
+	/* segment being built */
+	GstHTTPHLSSegment *cur;
+	GByteArray    *part;          // bytes of the part being built
+	gboolean       part_keyframe;
+	gint64         seg_start;     // monotonic usec
+	gint64         part_start;
+	gboolean       last_delta;    // last buffer was a delta unit
+	gboolean       discont;       // next segment follows a restart
+	guint          next_seq;
+	gint64         max_duration;
+
+	/* stats */
+	guint          playlist_hits;
+	guint          segment_hits;
+	guint          part_hits;
+	guint          misses;
+};
+
+GstHTTPHLS *hls_new(guint segment_ms, guint depth, guint part_ms);
+void        hls_free(GstHTTPHLS *hls);
+void        hls_push(GstHTTPHLS *hls, GList *streamheader, GstBuffer *buffer);
+void        hls_reset(GstHTTPHLS *hls);
+gboolean    hls_handler(MediaURL *url, GstHTTPClient *client, gpointer data);
+
+#endif /* _HLS_H_ */
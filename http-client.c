@@ -25,8 +25,11 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
@@ -38,6 +41,9 @@
 #include "http-server.h"
 #include "media-mapping.h"
 #include "media.h"
+#include "trace.h"
+#include "flightrec.h"
+#include "cpustat.h"
 
 #define MAX_CLIENT_HEADERS 32
 
@@ -96,8 +102,8 @@ gst_http_client_class_init (GstHTTPClientClass * klass)
 static void
 gst_http_client_init (GstHTTPClient * client)
 {
-	memset(&client->avg_frames, 0, sizeof(client->avg_frames));	
-	memset(&client->avg_bytes, 0, sizeof(client->avg_bytes));	
+	memset(&client->rate_frames, 0, sizeof(client->rate_frames));	
+	memset(&client->rate_bytes, 0, sizeof(client->rate_bytes));	
 	GST_DEBUG_OBJECT (client, "create client %p", client);
 }
 
@@ -265,12 +271,98 @@ gst_http_client_get_media_mapping (GstHTTPClient * client)
   return result;
 }
 
+/* count a send syscall for the client and its media */
+static gint
+client_account(GstHTTPClient *client, gint ret)
+{
+	gint err = errno;
+
+	metrics_send_account(&client->metrics, ret, err);
+	if (ret > 0)
+		client->tcp.written += ret;
+	if (client->media)
+		metrics_send_account(&client->media->metrics.out, ret, err);
+	if (ret < 0)
+		flightrec_log(FR_SEND_ERROR, client->peer_ip, client->sock, err);
+	errno = err;
+	return ret;
+}
+
 gint
 gst_http_client_writebuf(GstHTTPClient *client, const char* buf, int size) 
 {
-	return send(client->sock, buf, size, MSG_NOSIGNAL);
+	return client_account(client, send(client->sock, buf, size, MSG_NOSIGNAL));
+}
+
+
+typedef struct {
+	GstHTTPClient *client;
+	gchar         *buf;
+	gsize          size;
+} ClientSendLast;
+
+static gpointer
+client_send_last_thread(gpointer data)
+{
+	ClientSendLast *sl = (ClientSendLast *) data;
+
+	cpustat_thread_register("client", "send");
+	gst_http_client_writebuf(sl->client, sl->buf, sl->size);
+	/* the main loop sees the hangup and releases the client */
+	shutdown(sl->client->sock, SHUT_RDWR);
+
+	g_object_unref(sl->client);
+	g_free(sl->buf);
+	g_free(sl);
+	return NULL;
 }
 
+/** gst_http_client_send_last - send the rest of a response off the main loop
+ * @param buf - body, freed once sent
+ *
+ * For bodies too large to write from the main loop: a thread sends @buf
+ * and then closes the connection, so the handler returns FALSE.
+ */
+void
+gst_http_client_send_last(GstHTTPClient *client, gchar *buf, gsize size)
+{
+	ClientSendLast *sl = g_new0(ClientSendLast, 1);
+
+	sl->client = g_object_ref(client);
+	sl->buf = buf;
+	sl->size = size;
+	g_thread_create(client_send_last_thread, sl, FALSE, NULL);
+}
+
+/** gst_http_client_writechunk - write part of a streamed response body
+ *
+ * Frames the data as one chunk (a single send) if the response uses
+ * chunked transfer encoding.
+ */
+gint
+gst_http_client_writechunk(GstHTTPClient *client, const char* buf, int size)
+{
+	char hdr[16];
+	struct iovec iov[3];
+	struct msghdr msg;
+
+	if (!client->chunked)
+		return gst_http_client_writebuf(client, buf, size);
+	if (size == 0)
+		return 0; // a zero length chunk terminates the body
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sprintf(hdr, "%x\r\n", size);
+	iov[1].iov_base = (void *) buf;
+	iov[1].iov_len = size;
+	iov[2].iov_base = "\r\n";
+	iov[2].iov_len = 2;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+
+	return client_account(client, sendmsg(client->sock, &msg, MSG_NOSIGNAL));
+}
 
 gint
 gst_http_client_write(GstHTTPClient *client, const char* fmt, ...)
@@ -299,6 +391,129 @@ gst_http_client_writeln(GstHTTPClient *client, const char* fmt, ...)
 	return gst_http_client_writebuf(client, buf, strlen(buf));
 }
 
+/* unsent bytes over which the client counts as congested */
+static guint32
+client_congestion_limit(GstHTTPClient *client)
+{
+	return MAX(CLIENT_CONGESTED_MIN,
+		CLIENT_CONGESTED_FRAMES * client->ewma_framesize);
+}
+
+/* bytes in the socket send queue: all unacked, and not yet sent */
+static gboolean
+client_outq(GstHTTPClient *client, guint32 *outq, guint32 *unsent)
+{
+	int val;
+
+	if (ioctl(client->sock, SIOCOUTQ, &val) < 0)
+		return FALSE;
+	*outq = val;
+#ifdef SIOCOUTQNSD
+	if (ioctl(client->sock, SIOCOUTQNSD, &val) < 0)
+		return FALSE;
+#endif
+	*unsent = val;
+	client->tcp.outq_read = g_get_monotonic_time();
+	client->tcp.written = 0;
+	return TRUE;
+}
+
+static void
+client_update_congestion(GstHTTPClient *client)
+{
+	struct client_tcp *t = &client->tcp;
+	guint32 limit = client_congestion_limit(client);
+
+	if (!t->congested && t->unsent > limit) {
+		GST_INFO ("%s:%d congested: %u bytes unsent, rtt %uus cwnd %u",
+			client->peer_ip, client->port, t->unsent, t->rtt, t->cwnd);
+		t->congested = TRUE;
+		flightrec_log(FR_CONGESTED, client->peer_ip, client->sock, t->unsent);
+	} else if (t->congested && t->unsent < limit / 2) {
+		GST_INFO ("%s:%d drained after skipping %" G_GUINT64_FORMAT
+			" frames", client->peer_ip, client->port, t->skipped);
+		t->congested = FALSE;
+	}
+}
+
+/** gst_http_client_sample_tcp - refresh the client's TCP state
+ * (call with the lock of the client's media held)
+ *
+ * Returns FALSE if the socket could not be queried
+ */
+gboolean
+gst_http_client_sample_tcp(GstHTTPClient *client)
+{
+	struct client_tcp *t = &client->tcp;
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	int sndbuf;
+	socklen_t sndlen = sizeof(sndbuf);
+
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(client->sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 ||
+	    getsockopt(client->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sndlen) < 0 ||
+	    !client_outq(client, &t->outq, &t->unsent))
+		return FALSE;
+	t->sndbuf = sndbuf;
+	t->rtt = info.tcpi_rtt;
+	t->rttvar = info.tcpi_rttvar;
+	t->cwnd = info.tcpi_snd_cwnd;
+	t->mss = info.tcpi_snd_mss;
+	t->retrans = info.tcpi_total_retrans;
+	t->lost = info.tcpi_lost;
+	t->sampled = g_get_monotonic_time();
+	client_update_congestion(client);
+
+	return TRUE;
+}
+
+/** gst_http_client_congested - check if a frame should be skipped
+ * @param size - frame size
+ * (call with the lock of the client's media held)
+ *
+ * The queue estimate (last reading plus bytes sent since, an upper
+ * bound) is checked for every frame; the socket is only queried when the
+ * reading is stale or the estimate nears a limit, so a client falling
+ * behind is still caught before its send buffer fills and a congested
+ * client resumes within CLIENT_OUTQ_INTERVAL of its queue draining.
+ */
+gboolean
+gst_http_client_congested(GstHTTPClient *client, gsize size)
+{
+	struct client_tcp *t = &client->tcp;
+	guint64 queued = (guint64) t->outq + t->written;
+
+	if (t->sndbuf &&
+	    g_get_monotonic_time() - t->outq_read < CLIENT_OUTQ_INTERVAL) {
+		if (t->congested)
+			return TRUE;
+		if ((!queued ||
+		     queued + size + CLIENT_FRAME_OVERHEAD <= t->sndbuf / 2) &&
+		    (guint64) t->unsent + t->written <=
+		    client_congestion_limit(client))
+			return FALSE;
+	}
+	if (!client_outq(client, &t->outq, &t->unsent))
+		return t->congested;
+	if (!t->sndbuf) {
+		int sndbuf;
+		socklen_t len = sizeof(sndbuf);
+
+		if (getsockopt(client->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+		               &len) == 0)
+			t->sndbuf = sndbuf;
+	}
+	client_update_congestion(client);
+	/* a frame that does not fit behind the queued data would block in
+	 * send(); one into an empty queue always goes so frames larger than
+	 * the buffer still get out (and the kernel grows the buffer) */
+	if (t->sndbuf && t->outq &&
+	    t->outq + size + CLIENT_FRAME_OVERHEAD > t->sndbuf / 2)
+		return TRUE;
+	return t->congested;
+}
+
 void
 gst_http_client_close(GstHTTPClient *client, const char *msg)
 {
@@ -325,15 +540,22 @@ parse_string(char **src) {
 
 
 // HTTP header - see http://www.w3.org/Protocols/HTTP/1.0/draft-ietf-http-spec.html#Message-Headers
-static void
-client_header(GstHTTPClient *client)
+void
+gst_http_client_status(GstHTTPClient *client, const char *status)
 {
 	gchar *name = gst_http_server_get_servername(client->server);
-	gst_http_client_writeln(client, "HTTP/1.0 200 OK");
+	gst_http_client_writeln(client, "HTTP/%s %s",
+		client->chunked ? "1.1" : "1.0", status);
 	gst_http_client_writeln(client, "Server: %s", name);
 	g_free(name);
 }
 
+static void
+client_header(GstHTTPClient *client)
+{
+	gst_http_client_status(client, "200 OK");
+}
+
 
 /** return a matching client header (case insenstivie) or NULL if not present
  */
@@ -367,13 +589,13 @@ static MediaURL *
 create_url(char *str)
 {
 	char *method, *page, *query = NULL, *p;
-	//char *http;
+	char *http;
 	p = str;
 	MediaURL *url = NULL;
 
 	method = parse_string(&p);
 	page = parse_string(&p);
-	//http = parse_string(&p);
+	http = parse_string(&p);
 	if (method && page) {
 		p = page;
 		while (*p && *p != '?') p++;
@@ -386,6 +608,7 @@ create_url(char *str)
 		memset(url, 0, sizeof(MediaURL));
 		url->method = g_strdup(method);
 		url->path = g_strdup(page);
+		url->version = g_strdup(http);
 		if (query) {
 			url->query = g_strdup(query);
 			url->querys = g_strsplit(query, "&", 0);
@@ -406,6 +629,7 @@ handle_request(GstHTTPClient *client)
 	gsize len;
 	gsize pos;
 	GIOStatus ret;
+	gint64 start = g_get_monotonic_time();
 	int i;
 
 	client->gio = g_io_channel_unix_new(client->sock);
@@ -446,6 +670,9 @@ handle_request(GstHTTPClient *client)
 		GST_DEBUG("request:%s\n", request);
 		url = create_url(request);
 		g_free(request);
+		TRACE_REQUEST(client->sock, url->method, url->path, url->query);
+		flightrec_log(FR_REQUEST, url->path, client->sock, 0);
+		metric_inc(&server_metrics.requests);
 		GST_INFO ("client=%s:%d path='%s' query='%s'", client->peer_ip,
 			client->port, url->path, url->query);
 
@@ -468,6 +695,11 @@ handle_request(GstHTTPClient *client)
 			gmt = time (NULL);
 			strftime (rfc1123, 64, "%a, %d %b %Y %H:%M:%S GMT", gmtime (&gmt));
 
+			/* HTTP/1.1 clients get streams chunked */
+			if (GST_HTTP_MEDIA_IS_TS(m) && url->version &&
+			    strcmp(url->version, "HTTP/1.1") == 0)
+				client->chunked = TRUE;
+
 			client_header(client);
 /*
 			if (m->stream) {
@@ -491,8 +723,18 @@ handle_request(GstHTTPClient *client)
 				gst_http_client_writeln(client, "Expires: %s", rfc1123);
 				gst_http_client_write(client, "\r\n");
 			}
+			else if (GST_HTTP_MEDIA_IS_TS(m))
+			{
+				gst_http_client_writeln(client, "Content-Type: %s", m->mimetype);
+				gst_http_client_writeln(client, "Cache-Control: no-cache");
+				if (client->chunked) {
+					gst_http_client_writeln(client, "Transfer-Encoding: chunked");
+					gst_http_client_writeln(client, "Connection: close");
+				}
+				gst_http_client_write(client, "\r\n");
+			}
 
-			if (gst_http_media_play (m, client)) {
+			if (gst_http_media_play (m, client, url)) {
 				gst_http_client_writeln(client, "415 Unsupported Media Type");
 				gst_http_client_close(client, "unsupported");
 			}
@@ -502,7 +744,8 @@ handle_request(GstHTTPClient *client)
 
 		else if (m->func) {
 			GST_DEBUG_OBJECT(client, "got function mapping");
-			client_header(client);
+			if (!m->raw_header)
+				client_header(client);
 			if (m->func(url, client, m->data)) {
 				gst_http_client_close(client, "complete");
 			}
@@ -511,12 +754,22 @@ handle_request(GstHTTPClient *client)
 		}
 	}
 
+	metric_inc(&server_metrics.not_found);
 	gst_http_client_writeln(client, "404 Not Found");
 	gst_http_client_close(client, "not found");
 
 out:
 	if (url) {
+		/* one clock read for the histogram and the probe operand */
+		gint64 elapsed = g_get_monotonic_time() - start;
+
+		if (client->media) {
+			metric_inc(&client->media->metrics.requests);
+			metric_observe(&client->media->metrics.request_latency, elapsed);
+		}
+		TRACE_REQUEST_DONE(client->sock, url->path, elapsed);
 		g_free(url->method);
+		g_free(url->version);
 		g_free(url->path);
 		g_free(url->query);
 		g_strfreev(url->querys);
@@ -560,6 +813,9 @@ client_watch_destroyed (GstHTTPClient * client)
 	GST_DEBUG_OBJECT (client, "source destroyed for %s:%d (%d)", client->peer_ip,
 		client->port, client->sock);
 	client->watch = NULL;
+	metric_inc(&server_metrics.closes);
+	TRACE_CLIENT_CLOSE(client->sock, client->peer_ip, client->port);
+	flightrec_log(FR_DISCONNECT, client->peer_ip, client->port, client->sock);
 	g_signal_emit (client, gst_http_client_signals[SIGNAL_CLOSED], 0, NULL);
 	g_object_unref (client);
 }
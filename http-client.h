@@ -31,6 +31,7 @@ typedef struct _GstHTTPClientClass GstHTTPClientClass;
 #include "media-mapping.h"
 #include "media.h"
 #include "rate.h"
+#include "metrics.h"
 
 #define GST_TYPE_HTTP_CLIENT              (gst_http_client_get_type ())
 #define GST_IS_HTTP_CLIENT(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_HTTP_CLIENT))
@@ -41,6 +42,76 @@ typedef struct _GstHTTPClientClass GstHTTPClientClass;
 #define GST_HTTP_CLIENT_CAST(obj)         ((GstHTTPClient*)(obj))
 #define GST_HTTP_CLIENT_CLASS_CAST(klass) ((GstHTTPClientClass*)(klass))
 
+/*
+ * TCP state of a streaming connection
+ *   - sampled about once a second (TCP_INFO, SIOCOUTQ and SIOCOUTQNSD)
+ *     from the media watchdog, three syscalls per client
+ *   - congested: more than CLIENT_CONGESTED_FRAMES frames (at least
+ *     CLIENT_CONGESTED_MIN bytes) are queued unsent in the socket; cleared
+ *     again below half of that so it does not flap.  Frames for a
+ *     congested client are skipped instead of blocking the fan-out
+ *   - a frame that would not fit behind the queued data in the send
+ *     buffer (half of SO_SNDBUF, the kernel doubles it for overhead) is
+ *     skipped as well, since the blocking send() would wait on the client
+ *     with the media lock held.  Before a frame the queue is estimated
+ *     from the last reading plus the bytes sent since; it is read again
+ *     (two ioctls) only when that is older than CLIENT_OUTQ_INTERVAL or
+ *     gets near either limit
+ */
+#define CLIENT_CONGESTED_FRAMES   2
+#define CLIENT_CONGESTED_MIN      (64 * 1024)
+#define CLIENT_FRAME_OVERHEAD     256  // multipart part headers
+#define CLIENT_OUTQ_INTERVAL      (50 * 1000) // usec
+
+struct client_tcp {
+	gint64         sampled;       // monotonic usec, 0 = never
+	guint32        rtt;           // usec
+	guint32        rttvar;        // usec
+	guint32        cwnd;          // segments
+	guint32        mss;
+	guint32        retrans;       // segments retransmitted (total)
+	guint32        lost;          // segments currently considered lost
+	guint32        outq;          // bytes queued, sent or not, unacked
+	guint32        unsent;        // bytes queued not yet sent
+	guint32        sndbuf;        // SO_SNDBUF (autotuned by the kernel)
+	gint64         outq_read;     // monotonic usec outq/unsent were read
+	guint32        written;       // bytes sent since then
+	gboolean       congested;
+	guint64        skipped;       // frames not sent while congested
+};
+
+/*
+ * adaptive quality: the client is moved along a ladder of variants
+ *   - level 0 is the stream the client asked for, each level above halves
+ *     the frame size at the media's adapt quality
+ *   - the client moves to the next level as soon as a sample finds it
+ *     congested or skipping frames, and back one level after hold seconds
+ *     without either, with the socket queue drained and cwnd/rtt leaving
+ *     CLIENT_ADAPT_HEADROOM times the achieved throughput
+ *   - congestion soon after moving back doubles hold (up to
+ *     CLIENT_ADAPT_HOLD_MAX) so a link at the edge does not oscillate
+ *   - for CLIENT_ADAPT_SETTLE seconds after a switch congestion is not
+ *     acted on: the socket still drains frames of the old level
+ */
+#define CLIENT_ADAPT_HOLD         10   // seconds
+#define CLIENT_ADAPT_SETTLE       2    // seconds
+#define CLIENT_ADAPT_HOLD_MAX     120  // seconds
+#define CLIENT_ADAPT_HEADROOM     2.0
+
+struct client_adapt {
+	guint          levels;        // ladder steps below level 0 (0 = off)
+	guint          level;         // current step
+	gint           width;         // level 0 parameters (0 = native)
+	gint           height;
+	gint           quality;
+	guint          stable;        // seconds without congestion
+	guint          hold;          // stable seconds needed to go back
+	gint64         switched;      // monotonic usec of the last switch
+	gint64         improved;      // monotonic usec of the last step back
+	guint64        skipped;       // tcp.skipped at the last evaluation
+	guint          switches;
+};
+
 /**
  * GstHTTPClient:
  *
@@ -70,11 +141,23 @@ struct _GstHTTPClient {
 	gchar         **headers;
 	GstHTTPMediaMapping  *media_mapping;
 	GstHTTPMedia  *media;
+	GstHTTPMediaVariant *variant; // NULL for the native stream
 	time_t         ev_press;
+	gboolean       chunked;       // response uses chunked transfer encoding
+	gboolean       synced;        // stream: got header and keyframe group
+	struct _MediaCatchUp *catchup; // stream: header and group being sent
+	gboolean       dead;          // stream: send failed, main loop drops it
+	gboolean       replaying;     // timeshift: being sent frames from the ring
+	guint64        replay_seq;    // timeshift: next frame to send
+	gint64         replay_clock;  // timeshift: playback position (usec)
+	gint64         replay_wall;   // timeshift: time of the last tick
 
 	/* counters */
-	struct avg avg_frames;
-	struct avg avg_bytes;
+	struct metrics_send metrics;
+	struct client_tcp tcp;
+	struct client_adapt adapt;
+	struct rate rate_frames;
+	struct rate rate_bytes;
 	unsigned long ewma_framesize;
 };
 
@@ -94,11 +177,17 @@ gboolean       gst_http_client_accept    (GstHTTPClient *client,
                                           GIOChannel *channel);
 void           gst_http_client_close     (GstHTTPClient *client,
                                           const char *msg);
+void           gst_http_client_status    (GstHTTPClient *client,
+                                          const char *status);
 gint           gst_http_client_write     (GstHTTPClient *client,
                                           const char *fmt, ...)
                                           __attribute__ ((format(printf,2,3))); 
 gint           gst_http_client_writebuf  (GstHTTPClient *client,
                                           const char *buf,int size); 
+gint           gst_http_client_writechunk(GstHTTPClient *client,
+                                          const char *buf,int size); 
+void           gst_http_client_send_last (GstHTTPClient *client,
+                                          gchar *buf, gsize size);
 gint           gst_http_client_writeln   (GstHTTPClient *client,
                                           const char *fmt, ...)
                                           __attribute__ ((format(printf,2,3))); 
@@ -106,6 +195,9 @@ void           gst_http_client_set_media_mapping (GstHTTPClient *client,
                                                   GstHTTPMediaMapping *mapping);
 GstHTTPMediaMapping * gst_http_client_get_media_mapping (GstHTTPClient *client);
 gchar					*gst_http_client_get_header(GstHTTPClient *client, const gchar *);
+gboolean       gst_http_client_sample_tcp(GstHTTPClient *client);
+gboolean       gst_http_client_congested (GstHTTPClient *client,
+	gsize size);
 
 G_END_DECLS
 
@@ -35,6 +35,7 @@
 
 #include "http-server.h"
 #include "http-client.h"
+#include "flightrec.h"
 
 #define DEFAULT_ADDRESS         "0.0.0.0"
 #define DEFAULT_SERVICE         "8080"
@@ -692,6 +693,8 @@ default_accept_client (GstHTTPServer * server, GstHTTPClient * client,
    * client asyncronously. */
   if (!gst_http_client_accept (client, channel))
     goto accept_failed;
+  metric_inc (&server_metrics.accepts);
+  flightrec_log (FR_CONNECT, client->peer_ip, client->port, client->sock);
 
   return TRUE;
 
@@ -0,0 +1,227 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <gst/gst.h>
+
+#include "input.h"
+
+GST_DEBUG_CATEGORY_STATIC (http_input_debug);
+#define GST_CAT_DEFAULT http_input_debug
+
+typedef struct {
+	gchar         *path;
+	int            fd;
+	GIOChannel    *channel;
+	guint          watch;
+	GList         *subscribers;   // InputSubscription
+	gboolean       closed;        // no longer read, not in the table
+	gboolean       destroyed;     // main loop source gone
+} InputDevice;
+
+struct _InputSubscription {
+	InputDevice   *dev;
+	InputEventFunc func;
+	gpointer       data;
+};
+
+/* open devices by path; the lock also serializes event dispatch against
+ * unsubscribe so a callback never runs after input_unsubscribe returns */
+G_LOCK_DEFINE_STATIC (input);
+static GHashTable *devices;
+
+static void
+input_device_free (InputDevice *dev)
+{
+	GST_DEBUG ("closing %s", dev->path);
+	g_io_channel_unref(dev->channel);
+	close(dev->fd);
+	g_free(dev->path);
+	g_free(dev);
+}
+
+/* source destroy notify: the device goes once its subscribers are gone */
+static void
+input_device_destroyed (gpointer data)
+{
+	InputDevice *dev = (InputDevice *) data;
+	gboolean unused;
+
+	G_LOCK (input);
+	dev->destroyed = TRUE;
+	unused = (dev->subscribers == NULL);
+	G_UNLOCK (input);
+
+	if (unused)
+		input_device_free(dev);
+}
+
+static gboolean
+input_device_read (GIOChannel *source, GIOCondition cond, gpointer data)
+{
+	InputDevice *dev = (InputDevice *) data;
+	struct input_event ev[64];
+	GList *walk;
+	int rd, i;
+
+	G_LOCK (input);
+	if (dev->closed) {
+		G_UNLOCK (input);
+		return FALSE;
+	}
+
+	while ((rd = read(dev->fd, ev, sizeof(ev))) > 0) {
+		for (i = 0; i < (int) (rd / sizeof(struct input_event)); i++) {
+			for (walk = dev->subscribers; walk; walk = g_list_next (walk)) {
+				InputSubscription *sub = (InputSubscription *) walk->data;
+
+				sub->func(&ev[i], sub->data);
+			}
+		}
+	}
+	if (rd == 0 || (rd < 0 && errno != EAGAIN && errno != EINTR) ||
+	    (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)))
+	{
+		/* unplugged: stay quiet until the subscribers resubscribe */
+		GST_ERROR ("%s: read failed: %s", dev->path,
+			rd < 0 ? strerror(errno) : "device gone");
+		g_hash_table_remove(devices, dev->path);
+		dev->closed = TRUE;
+		dev->watch = 0;
+		G_UNLOCK (input);
+		return FALSE;
+	}
+	G_UNLOCK (input);
+
+	return TRUE;
+}
+
+static InputDevice *
+input_device_open (const gchar *path)
+{
+	InputDevice *dev;
+	struct input_id device_info;
+	char name[256] = "Unknown";
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK)) < 0) {
+		GST_ERROR ("%s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) < 0)
+		GST_WARNING ("%s: EVIOCGNAME failed", path);
+	if (ioctl(fd, EVIOCGID, &device_info) == 0) {
+		GST_INFO ("opened %s: %04hx:%04hx version %04hx: %s", path,
+			device_info.vendor, device_info.product, device_info.version,
+			name);
+	}
+
+	dev = g_new0(InputDevice, 1);
+	dev->path = g_strdup(path);
+	dev->fd = fd;
+	dev->channel = g_io_channel_unix_new(fd);
+	dev->watch = g_io_add_watch_full(dev->channel, G_PRIORITY_DEFAULT,
+		G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP, input_device_read, dev,
+		input_device_destroyed);
+
+	return dev;
+}
+
+/** input_subscribe - receive the events of an input device
+ * @param dev - evdev device file
+ * @param func - called on the main loop for each event
+ * @param data - passed to func
+ *
+ * Returns a subscription for input_unsubscribe, NULL if the device can't
+ * be opened.  May be called from any thread.
+ */
+InputSubscription *
+input_subscribe(const gchar *path, InputEventFunc func, gpointer data)
+{
+	InputSubscription *sub;
+	InputDevice *dev;
+
+	G_LOCK (input);
+	if (!devices) {
+		GST_DEBUG_CATEGORY_INIT (http_input_debug, "httpinput", 0,
+			"gst-httpd input devices");
+		devices = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+	if (!(dev = g_hash_table_lookup(devices, path))) {
+		if (!(dev = input_device_open(path))) {
+			G_UNLOCK (input);
+			return NULL;
+		}
+		g_hash_table_insert(devices, dev->path, dev);
+	}
+
+	sub = g_new0(InputSubscription, 1);
+	sub->dev = dev;
+	sub->func = func;
+	sub->data = data;
+	dev->subscribers = g_list_append(dev->subscribers, sub);
+	GST_DEBUG ("%s: %d subscribers", path, g_list_length(dev->subscribers));
+	G_UNLOCK (input);
+
+	return sub;
+}
+
+/** input_unsubscribe - stop receiving events
+ * The device is closed with its last subscriber.  No callback for @sub
+ * runs once this returns.
+ */
+void
+input_unsubscribe(InputSubscription *sub)
+{
+	InputDevice *dev;
+	gboolean unused = FALSE;
+	guint watch = 0;
+
+	if (!sub)
+		return;
+
+	G_LOCK (input);
+	dev = sub->dev;
+	dev->subscribers = g_list_remove(dev->subscribers, sub);
+	if (!dev->subscribers) {
+		if (!dev->closed) {
+			g_hash_table_remove(devices, dev->path);
+			dev->closed = TRUE;
+			watch = dev->watch;
+			dev->watch = 0;
+		}
+		unused = dev->destroyed;
+	}
+	G_UNLOCK (input);
+
+	/* the destroy notify frees the device, possibly right here; a device
+	 * that failed may have no source left */
+	if (watch)
+		g_source_remove(watch);
+	else if (unused)
+		input_device_free(dev);
+	g_free(sub);
+}
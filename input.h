@@ -0,0 +1,45 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _INPUT_H_
+#define _INPUT_H_
+
+#include <glib.h>
+#include <linux/input.h>
+
+/*
+ * shared evdev input devices
+ *   - each device is opened once however many media subscribe to it, and
+ *     read non-blocking from a main loop source (no thread per device)
+ *   - events are passed to every subscriber with their kernel timestamp;
+ *     callbacks run on the main loop and must not block
+ *   - the device is closed when its last subscriber goes away
+ */
+typedef void (*InputEventFunc)(const struct input_event *ev, gpointer data);
+
+typedef struct _InputSubscription InputSubscription;
+
+InputSubscription *input_subscribe(const gchar *dev, InputEventFunc func,
+	gpointer data);
+void     input_unsubscribe(InputSubscription *sub);
+
+#define input_event_time(ev) \
+	((gint64) (ev)->time.tv_sec * G_USEC_PER_SEC + (ev)->time.tv_usec)
+
+#endif /* _INPUT_H_ */
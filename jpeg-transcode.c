@@ -0,0 +1,443 @@
+/* gst-httpd
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <math.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "jpeg-transcode.h"
+
+/* error handling: libjpeg calls error_exit on fatal errors, unwind to
+ * the transcode call instead of exiting the process */
+struct transcode_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+};
+
+static void
+transcode_error_exit(j_common_ptr cinfo)
+{
+	struct transcode_error *err = (struct transcode_error *) cinfo->err;
+
+	longjmp(err->jmp, 1);
+}
+
+static void
+transcode_output_message(j_common_ptr cinfo)
+{
+	/* corrupt-data warnings are common with MJPEG sources; stay quiet */
+}
+
+/* destination manager writing to a growing malloc'd buffer owned by us
+ * (so the error path can always release it) */
+struct transcode_dest {
+	struct jpeg_destination_mgr pub;
+	unsigned char *buf;
+	size_t size;
+};
+
+static void
+dest_init(j_compress_ptr cinfo)
+{
+	struct transcode_dest *dest = (struct transcode_dest *) cinfo->dest;
+
+	dest->pub.next_output_byte = dest->buf;
+	dest->pub.free_in_buffer = dest->size;
+}
+
+static boolean
+dest_empty(j_compress_ptr cinfo)
+{
+	struct transcode_dest *dest = (struct transcode_dest *) cinfo->dest;
+	unsigned char *buf = realloc(dest->buf, dest->size * 2);
+
+	if (!buf)
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+	dest->buf = buf;
+	dest->pub.next_output_byte = buf + dest->size;
+	dest->pub.free_in_buffer = dest->size;
+	dest->size *= 2;
+	return TRUE;
+}
+
+static void
+dest_term(j_compress_ptr cinfo)
+{
+}
+
+/* orthonormal DCT basis: basis[n][x][u] for n-point transforms,
+ * filled once by whichever streaming thread transcodes first */
+static float basis[TRANSCODE_MAX_SCALE + 1][DCTSIZE][DCTSIZE];
+static GOnce basis_once = G_ONCE_INIT;
+
+static gpointer
+init_basis(gpointer data)
+{
+	int n, x, u;
+
+	for (n = 1; n <= DCTSIZE; n <<= 1) {
+		for (x = 0; x < n; x++) {
+			for (u = 0; u < n; u++) {
+				double c = (u == 0) ? sqrt(1.0 / n) : sqrt(2.0 / n);
+				basis[n][x][u] = c * cos((2 * x + 1) * u * M_PI / (2.0 * n));
+			}
+		}
+	}
+	return NULL;
+}
+
+/** idct_truncated - n x n inverse DCT of the low frequencies of a block
+ * @param blk - quantized 8x8 coefficients
+ * @param qtbl - quantization table of @blk
+ * @param n - number of coefficients kept per dimension
+ * @param out - output pixels (level shifted), written with stride @stride
+ *
+ * The n-point coefficients of the 1/(8/n) scaled block are the truncated
+ * 8-point coefficients scaled by n/8 (sqrt(n/8) per dimension).
+ */
+static void
+idct_truncated(JCOEF *blk, const UINT16 *qtbl, int n, float *out, int stride)
+{
+	float coef[DCTSIZE][DCTSIZE];
+	float tmp[DCTSIZE][DCTSIZE];
+	float norm = (float) n / DCTSIZE;
+	int x, y, u, v;
+
+	for (v = 0; v < n; v++)
+		for (u = 0; u < n; u++)
+			coef[v][u] = blk[v * DCTSIZE + u] * qtbl[v * DCTSIZE + u] * norm;
+
+	/* rows then columns */
+	for (v = 0; v < n; v++) {
+		for (x = 0; x < n; x++) {
+			float sum = 0;
+			for (u = 0; u < n; u++)
+				sum += basis[n][x][u] * coef[v][u];
+			tmp[v][x] = sum;
+		}
+	}
+	for (y = 0; y < n; y++) {
+		for (x = 0; x < n; x++) {
+			float sum = 0;
+			for (v = 0; v < n; v++)
+				sum += basis[n][y][v] * tmp[v][x];
+			out[y * stride + x] = sum;
+		}
+	}
+}
+
+/** fdct_quantize - 8x8 forward DCT and quantization
+ * @param in - level shifted pixels with stride @stride
+ * @param qtbl - output quantization table
+ * @param blk - output coefficients
+ */
+static void
+fdct_quantize(const float *in, int stride, const UINT16 *qtbl, JCOEF *blk)
+{
+	float tmp[DCTSIZE][DCTSIZE];
+	int x, y, u, v;
+
+	for (y = 0; y < DCTSIZE; y++) {
+		for (u = 0; u < DCTSIZE; u++) {
+			float sum = 0;
+			for (x = 0; x < DCTSIZE; x++)
+				sum += basis[DCTSIZE][x][u] * in[y * stride + x];
+			tmp[y][u] = sum;
+		}
+	}
+	for (v = 0; v < DCTSIZE; v++) {
+		for (u = 0; u < DCTSIZE; u++) {
+			float sum = 0;
+			for (y = 0; y < DCTSIZE; y++)
+				sum += basis[DCTSIZE][y][v] * tmp[y][u];
+			blk[v * DCTSIZE + u] = (JCOEF) lrintf(sum / qtbl[v * DCTSIZE + u]);
+		}
+	}
+}
+
+/** requantize - rescale coefficients from one quantization table to another
+ */
+static void
+requantize(JCOEF *blk, const UINT16 *from, const UINT16 *to)
+{
+	int k;
+
+	for (k = 0; k < DCTSIZE2; k++)
+		blk[k] = (JCOEF) lrintf((float) blk[k] * from[k] / to[k]);
+}
+
+/** downscale_component - build the scaled coefficients of one component
+ * @param src - decompressor holding @in
+ * @param sc - source component
+ * @param in - source coefficients
+ * @param dst_q - output quantization table
+ * @param out - output coefficients
+ * @param w, h - output size in blocks (padded to whole iMCUs)
+ * @param scale - power of two divisor
+ */
+static void
+downscale_component(j_decompress_ptr src, jpeg_component_info *sc,
+	jvirt_barray_ptr in, const UINT16 *dst_q, jvirt_barray_ptr out,
+	JDIMENSION w, JDIMENSION h, int scale)
+{
+	const UINT16 *src_q = sc->quant_table->quantval;
+	int n = DCTSIZE / scale;
+	int stride = w * DCTSIZE;
+	/* from the image pool: released by jpeg_destroy, also on error */
+	float *ws = (*src->mem->alloc_large) ((j_common_ptr) src, JPOOL_IMAGE,
+		sizeof(float) * stride * DCTSIZE);
+	JDIMENSION bx, by, sx, sy;
+	int i, j;
+
+	for (by = 0; by < h; by++) {
+		JBLOCKROW drow;
+
+		/* gather the n x n low frequency pixels of the scale x scale
+		 * source blocks covering this output block row */
+		for (j = 0; j < scale; j++) {
+			JBLOCKROW srow;
+
+			sy = MIN(by * scale + j, sc->height_in_blocks - 1);
+			srow = (*src->mem->access_virt_barray)
+				((j_common_ptr) src, in, sy, 1, FALSE)[0];
+			for (bx = 0; bx < w; bx++) {
+				for (i = 0; i < scale; i++) {
+					sx = MIN(bx * scale + i, sc->width_in_blocks - 1);
+					idct_truncated(srow[sx], src_q, n,
+						ws + j * n * stride + bx * DCTSIZE + i * n, stride);
+				}
+			}
+		}
+
+		drow = (*src->mem->access_virt_barray)
+			((j_common_ptr) src, out, by, 1, TRUE)[0];
+		for (bx = 0; bx < w; bx++)
+			fdct_quantize(ws + bx * DCTSIZE, stride, dst_q, drow[bx]);
+	}
+}
+
+/** transcode_jpeg - scale and/or requantize a JPEG without decoding it
+ * @param data, size - source JPEG
+ * @param scale - power of two divisor (1 = no scaling)
+ * @param quality - output quality (0 = keep source tables)
+ * @param out, outsize - output JPEG, free with transcode_free()
+ *
+ * Returns TRUE on success
+ */
+gboolean
+transcode_jpeg(const guchar *data, gsize size, guint scale, gint quality,
+	guchar **out, gsize *outsize)
+{
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	struct transcode_error err;
+	struct transcode_dest dest;
+	jvirt_barray_ptr *src_coefs;
+	jvirt_barray_ptr dst_coefs[MAX_COMPONENTS];
+	JDIMENSION dst_w, dst_h, w_imcus, h_imcus;
+	int ci;
+
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+		return FALSE;
+	g_once(&basis_once, init_basis, NULL);
+
+	/* output is rarely larger than the input */
+	dest.size = size + 1024;
+	if (!(dest.buf = malloc(dest.size)))
+		return FALSE;
+	dest.pub.init_destination = dest_init;
+	dest.pub.empty_output_buffer = dest_empty;
+	dest.pub.term_destination = dest_term;
+
+	/* one error manager: an error in either codec unwinds here */
+	src.err = dst.err = jpeg_std_error(&err.pub);
+	err.pub.error_exit = transcode_error_exit;
+	err.pub.output_message = transcode_output_message;
+	jpeg_create_decompress(&src);
+	jpeg_create_compress(&dst);
+
+	if (setjmp(err.jmp)) {
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		free(dest.buf);
+		return FALSE;
+	}
+
+	jpeg_mem_src(&src, (unsigned char *) data, size);
+	jpeg_read_header(&src, TRUE);
+
+	dst_w = (src.image_width + scale - 1) / scale;
+	dst_h = (src.image_height + scale - 1) / scale;
+
+	/* output coefficient arrays must be requested before
+	 * jpeg_read_coefficients realizes the virtual arrays */
+	if (scale > 1) {
+		w_imcus = (dst_w + src.max_h_samp_factor * DCTSIZE - 1) /
+			(src.max_h_samp_factor * DCTSIZE);
+		h_imcus = (dst_h + src.max_v_samp_factor * DCTSIZE - 1) /
+			(src.max_v_samp_factor * DCTSIZE);
+		for (ci = 0; ci < src.num_components; ci++) {
+			jpeg_component_info *c = &src.comp_info[ci];
+			dst_coefs[ci] = (*src.mem->request_virt_barray)
+				((j_common_ptr) &src, JPOOL_IMAGE, TRUE,
+				 w_imcus * c->h_samp_factor, h_imcus * c->v_samp_factor,
+				 (JDIMENSION) c->v_samp_factor);
+		}
+	}
+
+	src_coefs = jpeg_read_coefficients(&src);
+
+	jpeg_copy_critical_parameters(&src, &dst);
+	dst.image_width = dst_w;
+	dst.image_height = dst_h;
+	if (quality > 0)
+		jpeg_set_quality(&dst, quality, TRUE);
+
+	for (ci = 0; ci < src.num_components; ci++) {
+		jpeg_component_info *sc = &src.comp_info[ci];
+		jpeg_component_info *dc = &dst.comp_info[ci];
+		const UINT16 *dst_q = dst.quant_tbl_ptrs[dc->quant_tbl_no]->quantval;
+
+		if (scale > 1) {
+			downscale_component(&src, sc, src_coefs[ci], dst_q, dst_coefs[ci],
+				w_imcus * dc->h_samp_factor, h_imcus * dc->v_samp_factor,
+				scale);
+		} else if (quality > 0) {
+			JDIMENSION bx, by;
+
+			for (by = 0; by < sc->height_in_blocks; by++) {
+				JBLOCKROW row = (*src.mem->access_virt_barray)
+					((j_common_ptr) &src, src_coefs[ci], by, 1, TRUE)[0];
+				for (bx = 0; bx < sc->width_in_blocks; bx++)
+					requantize(row[bx], sc->quant_table->quantval, dst_q);
+			}
+		}
+	}
+
+	dst.dest = &dest.pub;
+	jpeg_write_coefficients(&dst, (scale > 1) ? dst_coefs : src_coefs);
+	jpeg_finish_compress(&dst);
+	*outsize = dest.size - dest.pub.free_in_buffer;
+	jpeg_destroy_compress(&dst);
+
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_decompress(&src);
+
+	*out = dest.buf;
+	return TRUE;
+}
+
+/** transcode_free - free a buffer returned by transcode_jpeg()
+ */
+void
+transcode_free(guchar *out)
+{
+	free(out);
+}
+
+/** transcode_luma_thumbnail - extract a 1/8 scale luma image
+ * @param data, size - input JPEG
+ * @param thumb - one byte per luma block, free with transcode_free()
+ * @param width, height - thumbnail dimensions
+ *
+ * Returns TRUE on success
+ */
+gboolean
+transcode_luma_thumbnail(const guchar *data, gsize size, guchar **thumb,
+	guint *width, guint *height)
+{
+	struct jpeg_decompress_struct src;
+	struct transcode_error srcerr;
+	jvirt_barray_ptr *coefs;
+	jpeg_component_info *y;
+	guchar * volatile out = NULL;
+	JDIMENSION bx, by, w, h;
+	int dcq;
+
+	src.err = jpeg_std_error(&srcerr.pub);
+	srcerr.pub.error_exit = transcode_error_exit;
+	srcerr.pub.output_message = transcode_output_message;
+	jpeg_create_decompress(&src);
+
+	if (setjmp(srcerr.jmp)) {
+		jpeg_destroy_decompress(&src);
+		free(out);
+		return FALSE;
+	}
+
+	jpeg_mem_src(&src, (unsigned char *) data, size);
+	jpeg_read_header(&src, TRUE);
+	coefs = jpeg_read_coefficients(&src);
+
+	/* only blocks covering the image, not the MCU padding */
+	y = &src.comp_info[0];
+	w = (y->downsampled_width + DCTSIZE - 1) / DCTSIZE;
+	h = (y->downsampled_height + DCTSIZE - 1) / DCTSIZE;
+	dcq = y->quant_table->quantval[0];
+	if (!(out = malloc(w * h)))
+		ERREXIT1(&src, JERR_OUT_OF_MEMORY, 0);
+
+	for (by = 0; by < h; by++) {
+		JBLOCKROW row = (*src.mem->access_virt_barray)
+			((j_common_ptr) &src, coefs[0], by, 1, FALSE)[0];
+		for (bx = 0; bx < w; bx++) {
+			/* dequantized DC is 8x the mean of the level shifted block */
+			int v = row[bx][0] * dcq / DCTSIZE + CENTERJSAMPLE;
+			out[by * w + bx] = (v < 0) ? 0 : (v > MAXJSAMPLE) ? MAXJSAMPLE : v;
+		}
+	}
+
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_decompress(&src);
+
+	*thumb = out;
+	*width = w;
+	*height = h;
+	return TRUE;
+}
+
+/** transcode_entropy_hash - hash the scan data of a JPEG
+ * @param data, size - input JPEG
+ *
+ * Hashes everything from the first SOS marker on, or the whole buffer if
+ * there is none.
+ */
+guint32
+transcode_entropy_hash(const guchar *data, gsize size)
+{
+	guint32 hash = 2166136261u;
+	gsize i;
+
+	for (i = 0; i + 1 < size; i++) {
+		if (data[i] == 0xff && data[i + 1] == 0xda)
+			break;
+	}
+	if (i + 1 >= size)
+		i = 0;
+
+	for (; i < size; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
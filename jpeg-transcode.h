@@ -0,0 +1,53 @@
+/* gst-httpd
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _JPEG_TRANSCODE_H_
+#define _JPEG_TRANSCODE_H_
+
+#include <glib.h>
+
+/*
+ * JPEG to JPEG transcoding in the DCT coefficient domain
+ *   - the entropy coded coefficients are read with jpeg_read_coefficients
+ *     and written with jpeg_write_coefficients: no colour conversion,
+ *     upsampling or full resolution IDCT/FDCT is done
+ *   - scale: power of two divisor (1, 2, 4 or 8).  Each output block is
+ *     built from the low frequency coefficients of scale x scale input
+ *     blocks (coefficient truncation)
+ *   - quality: 1-100 requantizes with standard tables of that quality,
+ *     0 keeps the source quantization tables
+ */
+#define TRANSCODE_MAX_SCALE 8
+
+gboolean transcode_jpeg(const guchar *data, gsize size, guint scale,
+	gint quality, guchar **out, gsize *outsize);
+void     transcode_free(guchar *out);
+
+/*
+ * change detection helpers
+ *   - transcode_luma_thumbnail: 1/8 scale luma image taken from the DC
+ *     coefficients of the luma blocks (entropy decoding only, no IDCT)
+ *   - transcode_entropy_hash: FNV-1a hash of the scan data, ignoring the
+ *     headers (which may carry per-frame timestamps)
+ */
+gboolean transcode_luma_thumbnail(const guchar *data, gsize size,
+	guchar **thumb, guint *width, guint *height);
+guint32  transcode_entropy_hash(const guchar *data, gsize size);
+
+#endif /* _JPEG_TRANSCODE_H_ */
@@ -0,0 +1,208 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "json.h"
+
+/** json_init - start a document
+ * @param w - writer
+ * @param s - string to append to
+ */
+void
+json_init(JsonWriter *w, GString *s)
+{
+	memset(w, 0, sizeof(*w));
+	w->s = s;
+	w->first[0] = TRUE;
+}
+
+/** json_filter - only emit the listed keys of objects at depth
+ * @param w - writer
+ * @param fields - NULL terminated key list (not copied), NULL for all
+ * @param depth - nesting level of the objects to filter (1 = top level)
+ */
+void
+json_filter(JsonWriter *w, gchar **fields, gint depth)
+{
+	w->fields = fields;
+	w->filter_depth = depth;
+}
+
+/** json_escape - append a quoted, escaped string
+ * @param s
+ * @param str - UTF-8 (NULL writes "")
+ */
+void
+json_escape(GString *s, const gchar *str)
+{
+	const guchar *p;
+
+	g_string_append_c(s, '"');
+	for (p = (const guchar *) (str ? str : ""); *p; p++) {
+		switch (*p) {
+		case '"':  g_string_append(s, "\\\""); break;
+		case '\\': g_string_append(s, "\\\\"); break;
+		case '\n': g_string_append(s, "\\n"); break;
+		case '\r': g_string_append(s, "\\r"); break;
+		case '\t': g_string_append(s, "\\t"); break;
+		default:
+			if (*p < 0x20)
+				g_string_append_printf(s, "\\u%04x", *p);
+			else
+				g_string_append_c(s, *p);
+		}
+	}
+	g_string_append_c(s, '"');
+}
+
+static gboolean
+json_wanted(JsonWriter *w, const gchar *key)
+{
+	gint i;
+
+	if (!w->fields || !key || w->depth != w->filter_depth)
+		return TRUE;
+	for (i = 0; w->fields[i]; i++)
+		if (strcmp(w->fields[i], key) == 0)
+			return TRUE;
+	return FALSE;
+}
+
+/* separator and key for the next value, FALSE if it is being dropped */
+static gboolean
+json_member(JsonWriter *w, const gchar *key)
+{
+	if (w->skip || !json_wanted(w, key))
+		return FALSE;
+	if (!w->first[w->depth])
+		g_string_append_c(w->s, ',');
+	w->first[w->depth] = FALSE;
+	if (key) {
+		json_escape(w->s, key);
+		g_string_append_c(w->s, ':');
+	}
+	return TRUE;
+}
+
+static void
+json_begin(JsonWriter *w, const gchar *key, gchar open)
+{
+	g_return_if_fail(w->depth < JSON_MAX_DEPTH - 1);
+
+	if (json_member(w, key))
+		g_string_append_c(w->s, open);
+	else if (!w->skip)
+		w->skip = w->depth + 1;
+	w->depth++;
+	w->first[w->depth] = TRUE;
+}
+
+static void
+json_end(JsonWriter *w, gchar close)
+{
+	g_return_if_fail(w->depth > 0);
+
+	if (!w->skip)
+		g_string_append_c(w->s, close);
+	else if (w->skip == w->depth)
+		w->skip = 0;
+	w->depth--;
+}
+
+void
+json_begin_object(JsonWriter *w, const gchar *key)
+{
+	json_begin(w, key, '{');
+}
+
+void
+json_end_object(JsonWriter *w)
+{
+	json_end(w, '}');
+}
+
+void
+json_begin_array(JsonWriter *w, const gchar *key)
+{
+	json_begin(w, key, '[');
+}
+
+void
+json_end_array(JsonWriter *w)
+{
+	json_end(w, ']');
+}
+
+void
+json_string(JsonWriter *w, const gchar *key, const gchar *val)
+{
+	if (json_member(w, key))
+		json_escape(w->s, val);
+}
+
+void
+json_stringf(JsonWriter *w, const gchar *key, const gchar *fmt, ...)
+{
+	va_list args;
+	gchar *val;
+
+	if (!json_member(w, key))
+		return;
+	va_start(args, fmt);
+	val = g_strdup_vprintf(fmt, args);
+	va_end(args);
+	json_escape(w->s, val);
+	g_free(val);
+}
+
+void
+json_int(JsonWriter *w, const gchar *key, gint64 val)
+{
+	if (json_member(w, key))
+		g_string_append_printf(w->s, "%" G_GINT64_FORMAT, val);
+}
+
+void
+json_uint(JsonWriter *w, const gchar *key, guint64 val)
+{
+	if (json_member(w, key))
+		g_string_append_printf(w->s, "%" G_GUINT64_FORMAT, val);
+}
+
+/* NaN and infinities are not JSON: written as null */
+void
+json_double(JsonWriter *w, const gchar *key, gdouble val, gint prec)
+{
+	if (!json_member(w, key))
+		return;
+	if (isfinite(val))
+		g_string_append_printf(w->s, "%.*f", prec, val);
+	else
+		g_string_append(w->s, "null");
+}
+
+void
+json_bool(JsonWriter *w, const gchar *key, gboolean val)
+{
+	if (json_member(w, key))
+		g_string_append(w->s, val ? "true" : "false");
+}
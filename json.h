@@ -0,0 +1,64 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _JSON_H_
+#define _JSON_H_
+
+#include <glib.h>
+
+/*
+ * streaming JSON writer
+ *   - appends to a single GString: callers render a whole document and
+ *     send it in one write
+ *   - separators are tracked per nesting level, strings are escaped
+ *   - key is NULL for array elements and the top level value
+ *   - field selection: with fields set, members of objects at
+ *     filter_depth whose key is not listed are dropped (nested values
+ *     included), so one render path serves filtered and full documents
+ */
+#define JSON_MAX_DEPTH 16
+
+typedef struct {
+	GString       *s;
+	gint          depth;
+	gboolean      first[JSON_MAX_DEPTH];
+	gint          skip;          // depth being dropped (0 = none)
+	gchar         **fields;      // selected keys (NULL = all)
+	gint          filter_depth;  // object depth the selection applies to
+} JsonWriter;
+
+void json_init(JsonWriter *w, GString *s);
+void json_filter(JsonWriter *w, gchar **fields, gint depth);
+
+void json_begin_object(JsonWriter *w, const gchar *key);
+void json_end_object(JsonWriter *w);
+void json_begin_array(JsonWriter *w, const gchar *key);
+void json_end_array(JsonWriter *w);
+
+void json_string(JsonWriter *w, const gchar *key, const gchar *val);
+void json_stringf(JsonWriter *w, const gchar *key, const gchar *fmt, ...)
+	G_GNUC_PRINTF(3, 4);
+void json_int(JsonWriter *w, const gchar *key, gint64 val);
+void json_uint(JsonWriter *w, const gchar *key, guint64 val);
+void json_double(JsonWriter *w, const gchar *key, gdouble val, gint prec);
+void json_bool(JsonWriter *w, const gchar *key, gboolean val);
+
+void json_escape(GString *s, const gchar *str);
+
+#endif /* _JSON_H_ */
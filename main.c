@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <zlib.h>
 #include <gst/gst.h>
 
 #include "http-server.h"
@@ -35,6 +36,14 @@
 #include "media.h"
 #include "v4l2-ctl.h"
 #include "rate.h"
+#include "events.h"
+#include "hls.h"
+#include "recorder.h"
+#include "metrics.h"
+#include "json.h"
+#include "history.h"
+#include "cpustat.h"
+#include "flightrec.h"
 
 #define V4L2_CTLS    // JSON set/get not implemented yet
 #define LOCAL_PAGES  // useful if/when I have JSON support
@@ -67,16 +76,62 @@ struct sysstat {
 struct sysstat stats[2];
 struct sysstat *p_jif, *p_prev_jif;
 
-#define SHOW_STAT(xxx) WRITE(client, "\t\""#xxx"\": \"%2.1f%%\"", ((unsigned)(p_jif->xxx - p_prev_jif->xxx) >= total_diff)?100.0:(((unsigned)(p_jif->xxx - p_prev_jif->xxx) * 100.0) / total_diff))
+#define SHOW_STAT(xxx) json_stringf(&w, #xxx, "%2.1f%%", ((unsigned)(p_jif->xxx - p_prev_jif->xxx) >= total_diff)?100.0:(((unsigned)(p_jif->xxx - p_prev_jif->xxx) * 100.0) / total_diff))
+#endif //#ifdef SYS_STAT
+
+static void status_timer(GstHTTPServer *server);
+
+/* busy permille over the last timer period */
+static guint
+sysstat_cpu(void)
+{
+#ifdef SYS_STAT
+	unsigned long long total, busy;
+
+	if (!p_jif || !p_prev_jif || !p_prev_jif->total)
+		return HISTORY_UNKNOWN;
+	total = p_jif->total - p_prev_jif->total;
+	busy = p_jif->busy - p_prev_jif->busy;
+	if (total == 0 || busy > total)
+		return HISTORY_UNKNOWN;
+	return busy * 1000 / total;
+#else
+	return HISTORY_UNKNOWN;
+#endif //#ifdef SYS_STAT
+}
+
+/* KB of memory in use (as "used" in server.json) */
+static guint64
+sysstat_mem_used(void)
+{
+	unsigned long total = 0, mfree = 0;
+	gchar *contents;
+	gchar **lines;
+	int i;
+
+	if (!g_file_get_contents("/proc/meminfo", &contents, NULL, NULL))
+		return 0;
+	lines = g_strsplit(contents, "\n", 0);
+	g_free(contents);
+	for (i = 0; lines[i]; i++) {
+		sscanf(lines[i], "MemTotal: %lu", &total);
+		sscanf(lines[i], "MemFree: %lu", &mfree);
+	}
+	g_strfreev(lines);
+
+	return total - mfree;
+}
 
 /* called on 1Hz timer - udpate system stats */
 static gboolean
 sysstat_timer(gpointer data)
 {
-	gchar *contents;
+	GstHTTPServer *server = (GstHTTPServer *) data;
+	guint clients;
+#ifdef SYS_STAT
+	unsigned long long v[CPUSTAT_FIELDS];
 	static int idx = 0;
 	struct sysstat *s;
-	int i;
 
 	if (idx == 0) {
 		p_jif = &stats[0];
@@ -89,26 +144,23 @@ sysstat_timer(gpointer data)
 	}
 
 	s = p_jif;
-	if (g_file_get_contents("/proc/stat", &contents, NULL, NULL)) {
-		gchar **lines = g_strsplit(contents, "\n", 0);
-		g_free(contents);
-		for (i = 0; lines[i]; i++) {
-			int ret = sscanf(lines[i], "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
-				&s->usr, &s->nic, &s->sys, &s->idle,
-				&s->io, &s->irq, &s->sirq, &s->steal);
-			if (ret >= 4) {
-				s->total = s->usr + s->nic + s->sys + s->idle
-					 + s->io+ s->irq + s->sirq + s->steal;
-				s->busy = s->total - s->idle - s->io;
-				break;
-			}
-		}
-		g_strfreev(lines);
+	if (cpustat_sample(v)) {
+		s->usr = v[0]; s->nic = v[1]; s->sys = v[2]; s->idle = v[3];
+		s->io = v[4]; s->irq = v[5]; s->sirq = v[6]; s->steal = v[7];
+		s->total = s->usr + s->nic + s->sys + s->idle
+			 + s->io+ s->irq + s->sirq + s->steal;
+		s->busy = s->total - s->idle - s->io;
 	}
-	
+#endif //#ifdef SYS_STAT
+
+	GST_HTTP_SERVER_LOCK(server);
+	clients = g_list_length(server->clients);
+	GST_HTTP_SERVER_UNLOCK(server);
+	history_sample(sysstat_cpu(), sysstat_mem_used(), clients);
+	status_timer(server);
+
 	return TRUE; // keep calling	
 }
-#endif //#ifdef SYS_STAT
 
 int
 parse_config(GstHTTPServer *server, const gchar *configfile,
@@ -142,8 +194,165 @@ parse_config(GstHTTPServer *server, const gchar *configfile,
 			// options for previous mapping
 			if ((p = strchr(line, ':')) && media) {
 				*p++ = 0;
+				// capture: <fmt> [motion [preroll frames] [postroll ms]]
 				if (strcmp(line, "capture") == 0) {
-					media->capture = g_strdup(p);
+					gchar **args = g_strsplit(g_strstrip(p), " ", 0);
+					int preroll = 0, postroll = 0;
+
+					g_free(media->capture);
+					media->capture = g_strdup(args[0]);
+					if (args[0] && args[1] && strcmp(args[1], "motion") == 0) {
+						media->capture_motion = TRUE;
+						if (args[2]) {
+							preroll = atoi(args[2]);
+							if (args[3])
+								postroll = atoi(args[3]);
+						}
+						media->capture_preroll = preroll;
+						media->capture_postroll = (gint64) postroll * 1000;
+					}
+					g_strfreev(args);
+				}
+				// format: ts [encoder] - H.264 in MPEG-TS instead of MJPEG
+				else if (strcmp(line, "format") == 0) {
+					gchar **args = g_strsplit(g_strstrip(p), " ", 2);
+
+					if (args[0] && strcmp(args[0], "ts") == 0) {
+						g_free(media->mimetype);
+						media->mimetype = g_strdup(GST_HTTP_MEDIA_TS_MIMETYPE);
+						if (args[1]) {
+							g_free(media->encoder);
+							media->encoder = g_strdup(g_strstrip(args[1]));
+						}
+					} else {
+						GST_ERROR ("unknown format '%s'", p);
+					}
+					g_strfreev(args);
+				}
+				// hls: <segment ms> [ring depth] [part ms] - serve <path>/index.m3u8
+				else if (strcmp(line, "hls") == 0 && !media->hls) {
+					int segment = 0, depth = 6, part = 0;
+					GstHTTPMedia *handler;
+					gchar *hlspath;
+
+					if (sscanf(p, " %d %d %d", &segment, &depth, &part) < 1 ||
+					    segment <= 0)
+						continue;
+					if (!GST_HTTP_MEDIA_IS_TS(media)) {
+						g_free(media->mimetype);
+						media->mimetype = g_strdup(GST_HTTP_MEDIA_TS_MIMETYPE);
+					}
+					media->hls = hls_new(segment, depth, part);
+					handler = gst_http_media_new_handler ("HLS", hls_handler, media);
+					handler->raw_header = TRUE;
+					hlspath = g_strconcat(media->path, "/*", NULL);
+					gst_http_media_mapping_add (mapping, hlspath, handler);
+					g_free(hlspath);
+				}
+				// timeshift: <seconds> [arena MB] [catch-up speed]
+				else if (strcmp(line, "timeshift") == 0 && !media->timeshift &&
+				         !GST_HTTP_MEDIA_IS_TS(media)) {
+					int seconds = 0, mb = 32;
+					double speed = 2.0;
+
+					if (sscanf(p, " %d %d %lf", &seconds, &mb, &speed) < 1 ||
+					    seconds <= 0 || mb <= 0)
+						continue;
+					media->timeshift = timeshift_new(seconds,
+						(gsize) mb * 1024 * 1024);
+					media->catchup = (speed > 0) ? speed : 1.0;
+					/* the ring is only useful if it is always filled */
+					media->keep_running = TRUE;
+				}
+				// record: <dir> [segment seconds] [retention: <n>M|G size or <n>h|d age]
+				else if (strcmp(line, "record") == 0 && !media->recorder &&
+				         !GST_HTTP_MEDIA_IS_TS(media)) {
+					gchar **args = g_strsplit(g_strstrip(p), " ", 0);
+					guint64 keep_bytes = 0;
+					gint64 keep_time = 0;
+					int segment = 60;
+					GstHTTPMedia *handler;
+					gchar *recpath;
+
+					if (!args[0] || !*args[0]) {
+						g_strfreev(args);
+						continue;
+					}
+					if (args[1]) {
+						segment = atoi(args[1]);
+						if (args[2]) {
+							gchar *end;
+							gdouble val = g_ascii_strtod(args[2], &end);
+
+							switch (*end) {
+							case 'M': keep_bytes = val * 1024 * 1024; break;
+							case 'G': keep_bytes = val * 1024 * 1024 * 1024; break;
+							case 'h': keep_time = val * 3600 * G_USEC_PER_SEC; break;
+							case 'd': keep_time = val * 86400 * G_USEC_PER_SEC; break;
+							default:
+								GST_ERROR ("unknown retention '%s'", args[2]);
+							}
+						}
+					}
+					media->recorder = recorder_new(args[0], (segment > 0) ?
+						segment : 60, keep_bytes, keep_time);
+					g_strfreev(args);
+					if (!media->recorder)
+						continue;
+					handler = gst_http_media_new_handler ("Recording",
+						recorder_handler, media);
+					handler->raw_header = TRUE;
+					recpath = g_strconcat(media->path, "/recording", NULL);
+					gst_http_media_mapping_add (mapping, recpath, handler);
+					g_free(recpath);
+					/* record whether or not anyone is watching */
+					media->keep_running = TRUE;
+				}
+				// motion: <threshold> [min blocks]
+				else if (strcmp(line, "motion") == 0) {
+					int threshold = 0, blocks = 1;
+
+					sscanf(p, " %d %d", &threshold, &blocks);
+					media->motion_threshold = threshold;
+					media->motion_blocks = (blocks > 0) ? blocks : 1;
+				}
+				// latency: <ms> [leaky]
+				else if (strcmp(line, "latency") == 0) {
+					int ms = atoi(p);
+
+					if (ms < 0) {
+						GST_ERROR ("invalid latency budget %d ms", ms);
+						continue;
+					}
+					media->latency_budget = (GstClockTime) ms * GST_MSECOND;
+					media->leaky = (strstr(p, "leaky") != NULL);
+				}
+				// suppress: <hash|luma> [threshold] [keepalive ms]
+				else if (strcmp(line, "suppress") == 0) {
+					char mode[16];
+					int threshold = -1, keepalive = -1;
+
+					if (sscanf(p, " %15s %d %d", mode, &threshold, &keepalive) < 1)
+						continue;
+					if (strcmp(mode, "hash") == 0)
+						media->suppress = GST_HTTP_SUPPRESS_HASH;
+					else if (strcmp(mode, "luma") == 0)
+						media->suppress = GST_HTTP_SUPPRESS_LUMA;
+					else
+						GST_ERROR ("unknown suppress mode '%s'", mode);
+					if (threshold >= 0)
+						media->suppress_threshold = threshold;
+					if (keepalive > 0)
+						media->suppress_keepalive = (gint64) keepalive * 1000;
+				}
+				// adapt: <levels> [quality]
+				else if (strcmp(line, "adapt") == 0) {
+					int levels = 0, quality = 0;
+
+					sscanf(p, " %d %d", &levels, &quality);
+					media->adapt_levels = (levels > 0) ? levels : 0;
+					media->adapt_quality = (quality > 0 && quality <= 100) ?
+						quality : 0;
 				}
 				continue;
 			}
@@ -168,11 +377,30 @@ parse_config(GstHTTPServer *server, const gchar *configfile,
 }
 
 /** sighandler - signal handler for catching signal and exiting cleanly
+ *
+ * SIGUSR1 and SIGSEGV dump the flight recorder before anything else and
+ * only use async-signal-safe calls: after a crash stdio may be locked.
  */
 static void 
 sighandler(int sig)
 {
+	static const char saved[] = "flight recorder saved to " FLIGHTREC_DUMP "\n";
+	static const char failed[] = "flight recorder dump failed\n";
 	static int quit = 0;
+
+	if (sig == SIGUSR1 || sig == SIGSEGV) {
+		ssize_t n;
+
+		if (flightrec_save() == 0)
+			n = write(STDERR_FILENO, saved, sizeof(saved) - 1);
+		else
+			n = write(STDERR_FILENO, failed, sizeof(failed) - 1);
+		(void) n;
+		if (sig == SIGSEGV)
+			_exit(1);
+		return;
+	}
+
 	fprintf(stderr, "%s %s (%d)\n", __func__, strsignal(sig), sig);
 
 	switch (sig) {
@@ -195,79 +423,304 @@ sighandler(int sig)
 #define WRITE(x, args...)  gst_http_client_write(x, args)
 #define WRITELN(x, args...)  gst_http_client_writeln(x, args)
 
-/** server_status - return server status as JSON
- * @param url - url mapping
- * @param client - client connection
- * @param data - server
+#define STATUS_INTERVAL     G_USEC_PER_SEC        // snapshot refresh
+#define STATUS_IDLE         (10 * G_USEC_PER_SEC) // stop after no polls
+#define STATUS_PREALLOC     (16 * 1024)
+
+/*
+ * status filters (server.json?fields=a,b&media=a,b&offset=N&limit=N)
+ *   - fields: members kept in each media and client object ("path" is
+ *     always kept so records can be told apart)
+ *   - media: only these streams and their clients
+ *   - offset/limit: page through the clients list, "clients_total" gives
+ *     the number matching
  */
-gboolean
-server_status(MediaURL *url, GstHTTPClient *client, gpointer data)
+typedef struct {
+	gchar         **fields;
+	gchar         **media;
+	guint         offset;
+	guint         limit;          // 0 = no limit
+} StatusQuery;
+
+/* split a comma separated list, NULL if empty */
+static gchar **
+status_list(const gchar *str, const gchar *always)
+{
+	gchar **list;
+
+	if (!str || !*str)
+		return NULL;
+	if (always) {
+		gchar *all = g_strconcat(str, ",", always, NULL);
+		list = g_strsplit(all, ",", -1);
+		g_free(all);
+	} else
+		list = g_strsplit(str, ",", -1);
+
+	return list;
+}
+
+/** status_query - parse the filters of a request
+ * @param url
+ * @return query or NULL if there are none (the cached document applies)
+ */
+static StatusQuery *
+status_query(MediaURL *url)
+{
+	gchar *fields = get_query_field(url, "fields=");
+	gchar *media = get_query_field(url, "media=");
+	gchar *offset = get_query_field(url, "offset=");
+	gchar *limit = get_query_field(url, "limit=");
+	StatusQuery *q = NULL;
+
+	if (fields || media || offset || limit) {
+		q = g_new0(StatusQuery, 1);
+		q->fields = status_list(fields, "path");
+		q->media = status_list(media, NULL);
+		q->offset = offset ? strtoul(offset, NULL, 10) : 0;
+		q->limit = limit ? strtoul(limit, NULL, 10) : 0;
+	}
+	g_free(fields);
+	g_free(media);
+	g_free(offset);
+	g_free(limit);
+
+	return q;
+}
+
+static void
+status_query_free(StatusQuery *q)
+{
+	if (!q)
+		return;
+	g_strfreev(q->fields);
+	g_strfreev(q->media);
+	g_free(q);
+}
+
+/* TRUE if a stream passes the media filter */
+static gboolean
+status_media_wanted(StatusQuery *q, GstHTTPMedia *media)
+{
+	const gchar *name = media->path;
+	gint i;
+
+	if (!q || !q->media)
+		return TRUE;
+	if (*name == '/' && name[1])
+		name++;
+	for (i = 0; q->media[i]; i++) {
+		const gchar *want = q->media[i];
+		if (*want == '/' && want[1])
+			want++;
+		if (strcmp(name, want) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/** status_render - render the server status JSON document
+ * @param server
+ * @param q - filters (NULL for the full document)
+ */
+static GString *
+status_render(GstHTTPServer *server, StatusQuery *q)
 {
-	GstHTTPServer *server = (GstHTTPServer *) data;
 	GstHTTPMediaMapping *mapping = gst_http_server_get_media_mapping(server);
+	GString *s = g_string_sized_new(STATUS_PREALLOC);
+	JsonWriter w;
 	GError *err = NULL;
-	int i, j;
+	GList *walk;
+	guint j, k;
 	gchar *str;
 
-	GST_INFO("Serving server_status to %s:%d", client->peer_ip, client->port);
-
-	//WRITELN(client, "Last-Modified: %s", unix2date(time(NULL)));
-	//WRITELN(client, "Expires: %s", timestr);
-	WRITELN(client, "no-cache");
-	WRITELN(client, "Content-Type: application/json\r\n");
+	json_init(&w, s);
+	if (q)
+		json_filter(&w, q->fields, 3);
 
 	GST_HTTP_SERVER_LOCK(server);
-	WRITELN(client, "{");
-	WRITELN(client, "  \"media\": [");
-	for (i = 0, j = 0; i < g_list_length(mapping->mappings); i++) {
-		GstHTTPMedia *media = g_list_nth_data(mapping->mappings, i);
+	json_begin_object(&w, NULL);
+	json_begin_array(&w, "media");
+	GST_HTTP_MEDIA_MAPPING_LOCK(mapping);
+	for (walk = mapping->mappings; walk; walk = g_list_next (walk)) {
+		GstHTTPMedia *media = (GstHTTPMedia *) walk->data;
 		char *name;
 		if (!media->desc || !media->pipeline_desc)
 			continue;
+		if (!status_media_wanted(q, media))
+			continue;
  		name = media->path;
-		WRITE(client, (j++ > 0)?",\r\n\t":"\t");
 		if (*name == '/' && (strlen(name) > 1)) name++;
-		WRITELN(client, "{");
-		WRITELN(client, "\t\t\"path\": \"%s\",", name);
-		WRITELN(client, "\t\t\"desc\": \"%s\",", media->desc);
-		WRITELN(client, "\t\t\"pipeline\": \"%s\",", media->pipeline_desc);
-		WRITELN(client, "\t\t\"state\": \"%s\",",
-			media->starttime?"Playing":"Stopped");
-		WRITELN(client, "\t\t\"duration\": \"%ld\",",
+		json_begin_object(&w, NULL);
+		json_string(&w, "path", name);
+		json_string(&w, "desc", media->desc);
+		json_string(&w, "pipeline", media->pipeline_desc);
+		json_string(&w, "mimetype", media->mimetype);
+		json_string(&w, "state", gst_http_media_state_name(media->state));
+		json_stringf(&w, "duration", "%ld",
 			media->starttime?((long)(time(NULL) - media->starttime)):0);
-		WRITELN(client, "\t\t\"input\": \"%ld\",",
+		json_stringf(&w, "input", "%ld",
 			media->ev_press?((long)(media->ev_press - media->starttime)):0);
-		WRITELN(client, "\t\t\"width\": \"%d\",", media->width);
-		WRITELN(client, "\t\t\"height\": \"%d\",", media->height);
-		WRITELN(client, "\t\t\"dev\" : \"%s\"", media->v4l2srcdev?media->v4l2srcdev:"");
-		WRITE(client, "\t}");
-	}
-	WRITE(client, "\r\n  ]");
-
-	WRITELN(client, ",");
-	WRITELN(client, "  \"clients\": [");
-	for (i = 0, j = 0; i < g_list_length(server->clients); i++) {
-		GstHTTPClient *c = g_list_nth_data(server->clients, i);
-		if (client == c)
-			continue; // skip ourselves
-		if (c->media) {
-			WRITE(client, (j++ > 0)?",\r\n\t":"\t");
-			WRITELN(client, "{");
-			if (c->media->pipeline_desc) {
-				WRITELN(client, "\t\t\"path\": \"%s\",", c->media->path);
-				WRITELN(client, "\t\t\"framesize\": \"%ldK\",",
-					c->ewma_framesize / 1024);
-				WRITELN(client, "\t\t\"bitrate\": \"%2.0fkbps\",",
-					(float) avg_get_avg(&c->avg_bytes) * 8.0 / 1024);
-				WRITELN(client, "\t\t\"framerate\": \"%ld\",",
-					avg_get_avg(&c->avg_frames));
+		json_stringf(&w, "cpu", "%2.1f%%", cpustat_owner(media->path));
+		GST_HTTP_MEDIA_LOCK (media);
+		json_stringf(&w, "restarts", "%u", media->restarts);
+		json_stringf(&w, "failures", "%u", media->failures);
+		json_stringf(&w, "breaker_trips", "%u", media->breaker_trips);
+		json_stringf(&w, "breaker_open", "%d",
+			g_get_monotonic_time() < media->breaker_until);
+		json_string(&w, "last_error", media->last_error);
+		json_stringf(&w, "framerate", "%d/%d", media->fps_n, media->fps_d);
+		json_stringf(&w, "stalls", "%u", media->stalls);
+		json_stringf(&w, "stall_seconds", "%.1f", media->stall_time / 1e6);
+		json_stringf(&w, "last_stall_seconds", "%.1f",
+			media->last_stall / 1e6);
+		GST_HTTP_MEDIA_UNLOCK (media);
+		json_stringf(&w, "width", "%d", media->width);
+		json_stringf(&w, "height", "%d", media->height);
+		json_stringf(&w, "latency_budget", "%lu",
+			(unsigned long)(media->latency_budget / GST_MSECOND));
+		json_stringf(&w, "latency_p50", "%lu",
+			pctl_get(&media->latency, 50) / 1000);
+		json_stringf(&w, "latency_p99", "%lu",
+			pctl_get(&media->latency, 99) / 1000);
+		json_stringf(&w, "late_frames", "%" G_GUINT64_FORMAT,
+			media->late_frames);
+		json_stringf(&w, "suppressed_frames", "%llu",
+			(unsigned long long) media->suppressed_frames);
+		json_stringf(&w, "suppressed_bytes", "%llu",
+			(unsigned long long) media->suppressed_bytes);
+		if (media->hls) {
+			GstHTTPHLS *hls = media->hls;
+
+			g_mutex_lock(hls->lock);
+			json_stringf(&w, "hls_segments", "%u", hls->count);
+			json_stringf(&w, "hls_playlist_hits", "%u", hls->playlist_hits);
+			json_stringf(&w, "hls_segment_hits", "%u", hls->segment_hits);
+			json_stringf(&w, "hls_part_hits", "%u", hls->part_hits);
+			json_stringf(&w, "hls_misses", "%u", hls->misses);
+			json_begin_array(&w, "hls_hits");
+			for (k = 0; k < hls->count; k++) {
+				json_begin_object(&w, NULL);
+				json_uint(&w, "seq", hls->ring[k]->seq);
+				json_uint(&w, "hits", hls->ring[k]->hits);
+				json_end_object(&w);
+			}
+			json_end_array(&w);
+			g_mutex_unlock(hls->lock);
+		}
+		if (media->timeshift) {
+			GstHTTPTimeshift *ts = media->timeshift;
+			const GstHTTPTimeshiftFrame *f;
+
+			GST_HTTP_MEDIA_LOCK (media);
+			f = timeshift_get(ts, timeshift_oldest(ts));
+			json_stringf(&w, "timeshift_frames", "%u", ts->count);
+			json_stringf(&w, "timeshift_seconds", "%.1f",
+				f ? (g_get_monotonic_time() - f->ts) / 1e6 : 0.0);
+			json_stringf(&w, "replay_clients", "%d",
+				g_list_length(media->replay));
+			GST_HTTP_MEDIA_UNLOCK (media);
+		}
+		if (media->recorder) {
+			GstHTTPRecorder *rec = media->recorder;
+			guint64 total = recorder_total_bytes(rec);
+
+			g_mutex_lock(rec->lock);
+			json_string(&w, "record_dir", rec->dir);
+			json_stringf(&w, "record_segments", "%u",
+				g_queue_get_length(rec->segments));
+			json_stringf(&w, "record_disk_bytes", "%llu",
+				(unsigned long long) total);
+			json_stringf(&w, "record_frames", "%llu",
+				(unsigned long long) rec->frames);
+			json_stringf(&w, "record_dropped", "%llu",
+				(unsigned long long) rec->dropped);
+			json_stringf(&w, "record_deleted", "%u", rec->deleted);
+			json_stringf(&w, "record_playbacks", "%u", rec->playbacks);
+			g_mutex_unlock(rec->lock);
+		}
+		if (media->motion_threshold) {
+			json_stringf(&w, "motion", "%d", media->motion);
+			json_stringf(&w, "motion_blocks", "%u", media->motion_score);
+			json_stringf(&w, "motion_events", "%u", media->motion_events);
+			json_stringf(&w, "motion_start", "%ld",
+				(long) media->motion_start);
+		}
+		json_string(&w, "dev", media->v4l2srcdev);
+		json_end_object(&w);
+	}
+	GST_HTTP_MEDIA_MAPPING_UNLOCK(mapping);
+	json_end_array(&w);
+
+	json_begin_array(&w, "clients");
+	for (walk = server->clients, j = 0; walk; walk = g_list_next (walk)) {
+		GstHTTPClient *c = (GstHTTPClient *) walk->data;
+		if (!c->media || !status_media_wanted(q, c->media))
+			continue;
+		// count every match for clients_total, render only the page
+		if (q && (j++ < q->offset ||
+		          (q->limit && j > q->offset + q->limit)))
+			continue;
+		json_begin_object(&w, NULL);
+		if (c->media->pipeline_desc) {
+			json_string(&w, "path", c->media->path);
+			json_stringf(&w, "framesize", "%ldK", c->ewma_framesize / 1024);
+			json_stringf(&w, "bitrate", "%2.0fkbps",
+				rate_get(&c->rate_bytes, 10) * 8.0 / 1024);
+			json_stringf(&w, "framerate", "%.1f",
+				rate_get(&c->rate_frames, 10));
+			json_begin_object(&w, "fps");
+			json_double(&w, "1s", rate_get(&c->rate_frames, 1), 1);
+			json_double(&w, "10s", rate_get(&c->rate_frames, 10), 1);
+			json_double(&w, "60s", rate_get(&c->rate_frames, 60), 1);
+			json_double(&w, "ewma", rate_ewma(&c->rate_frames), 1);
+			json_end_object(&w);
+			json_begin_object(&w, "bps");
+			json_double(&w, "1s", rate_get(&c->rate_bytes, 1) * 8, 0);
+			json_double(&w, "10s", rate_get(&c->rate_bytes, 10) * 8, 0);
+			json_double(&w, "60s", rate_get(&c->rate_bytes, 60) * 8, 0);
+			json_double(&w, "ewma", rate_ewma(&c->rate_bytes) * 8, 0);
+			json_end_object(&w);
+			if (c->tcp.sampled) {
+				json_begin_object(&w, "tcp");
+				json_double(&w, "rtt_ms", c->tcp.rtt / 1000.0, 1);
+				json_double(&w, "rttvar_ms", c->tcp.rttvar / 1000.0, 1);
+				json_uint(&w, "cwnd", c->tcp.cwnd);
+				json_uint(&w, "mss", c->tcp.mss);
+				json_uint(&w, "retrans", c->tcp.retrans);
+				json_uint(&w, "lost", c->tcp.lost);
+				json_uint(&w, "unacked", c->tcp.outq);
+				json_uint(&w, "unsent", c->tcp.unsent);
+				json_bool(&w, "congested", c->tcp.congested);
+				json_uint(&w, "skipped", c->tcp.skipped);
+				json_end_object(&w);
+			}
+			if (c->variant)
+				json_stringf(&w, "variant", "%dx%d q%d%s",
+					c->variant->width, c->variant->height,
+					c->variant->quality,
+					(c->variant->mode == GST_HTTP_VARIANT_TRANSCODE) ?
+					" dct" : "");
+			if (c->adapt.levels) {
+				json_begin_object(&w, "adapt");
+				json_uint(&w, "level", c->adapt.level);
+				json_uint(&w, "levels", c->adapt.levels);
+				json_uint(&w, "stable", c->adapt.stable);
+				json_uint(&w, "hold", c->adapt.hold);
+				json_uint(&w, "switches", c->adapt.switches);
+				json_end_object(&w);
 			}
-			WRITELN(client, "\t\t\"ip\": \"%s\",", c->peer_ip);
-			WRITELN(client, "\t\t\"port\": \"%d\"", c->port);
-			WRITE(client, "\t}");
 		}
+		if (c->replaying)
+			json_stringf(&w, "replay_lag", "%.1f",
+				(g_get_monotonic_time() - c->replay_clock) / 1e6);
+		json_string(&w, "ip", c->peer_ip);
+		json_stringf(&w, "port", "%d", c->port);
+		json_end_object(&w);
 	}
-	WRITE(client, "\r\n  ]");
+	json_end_array(&w);
+	if (q)
+		json_uint(&w, "clients_total", j);
 
 	GST_HTTP_SERVER_UNLOCK(server);
 
@@ -279,19 +732,18 @@ if (p_jif && p_prev_jif) {
 	static unsigned long sused = 0;
 	if (total_diff == 0) total_diff = 1;
 
-	WRITELN(client, ",");
-	WRITELN(client, "  \"cpu\": {");
-	SHOW_STAT(usr); WRITELN(client, ",");
-	SHOW_STAT(sys); WRITELN(client, ",");
-	SHOW_STAT(nic); WRITELN(client, ",");
-	SHOW_STAT(idle); WRITELN(client, ",");
-	SHOW_STAT(io); WRITELN(client, ",");
-	SHOW_STAT(irq); WRITELN(client, ",");
-	SHOW_STAT(sirq); WRITELN(client, " ");
-	WRITE(client, "  }");
-
-	WRITELN(client, ",");
-	WRITELN(client, "  \"memory\": {");
+	json_begin_object(&w, "cpu");
+	SHOW_STAT(usr);
+	SHOW_STAT(sys);
+	SHOW_STAT(nic);
+	SHOW_STAT(idle);
+	SHOW_STAT(io);
+	SHOW_STAT(irq);
+	SHOW_STAT(sirq);
+	json_end_object(&w);
+	cpustat_render(&w);
+
+	json_begin_object(&w, "memory");
 	err = NULL;
 	g_file_get_contents("/proc/meminfo", &str, NULL, &err);
 	if (err != NULL)
@@ -309,32 +761,236 @@ if (p_jif && p_prev_jif) {
 
 		used = total - mfree;
 		if (sused == 0) sused = used;
-		WRITELN(client, "\t\"used\": \"%luK\",", used);
-		WRITELN(client, "\t\"free\": \"%luK\",", mfree);
-		WRITELN(client, "\t\"buff\": \"%luK\",", buffers);
-		WRITELN(client, "\t\"cached\": \"%luK\",", cached);
-		WRITELN(client, "\t\"delta\": \"%ldK\"", used - sused);
+		json_stringf(&w, "used", "%luK", used);
+		json_stringf(&w, "free", "%luK", mfree);
+		json_stringf(&w, "buff", "%luK", buffers);
+		json_stringf(&w, "cached", "%luK", cached);
+		json_stringf(&w, "delta", "%ldK", used - sused);
 	}
-	WRITE(client, "  }");
+	json_end_object(&w);
 
-	WRITELN(client, ",");
-	WRITELN(client, "  \"load\": {");
+	json_begin_object(&w, "load");
 	err = NULL;
 	g_file_get_contents("/proc/loadavg", &str, NULL, &err);
 	if (err != NULL) {
 		//GST_ERROR("error:%s", err->message);
 		g_error_free(err);
 	} else {
-		WRITELN(client, "\t\"avg\": \"%s\"", g_strstrip(str));
+		json_string(&w, "avg", g_strstrip(str));
 		g_free(str);
 	}
-	WRITELN(client, "  }");
+	json_end_object(&w);
 }
 #endif //#ifdef SYS_STAT
-	WRITELN(client, "\r\n}");
+	json_end_object(&w);
+	g_string_append(s, "\r\n");
 
 	g_object_unref(mapping);
 
+	return s;
+}
+
+/*
+ * status snapshot: rendered at most once a second by the stats timer (or
+ * by a request finding it stale) into complete, immutable responses so
+ * pollers cost one send each
+ */
+typedef struct {
+	gint          ref;
+	gint64        time;           // monotonic usec rendered
+	gchar         etag[24];
+	gchar         etag_gz[28];    // gzip body: a distinct entity
+	GString       *plain;         // header and body
+	GString       *gzip;          // header and gzip body (NULL if failed)
+} StatusSnapshot;
+
+G_LOCK_DEFINE_STATIC (status);
+static StatusSnapshot *status_current;
+static gint64 status_polled;          // monotonic usec of the last request
+
+static void
+status_unref(StatusSnapshot *snap)
+{
+	if (!snap || !g_atomic_int_dec_and_test(&snap->ref))
+		return;
+	g_string_free(snap->plain, TRUE);
+	if (snap->gzip)
+		g_string_free(snap->gzip, TRUE);
+	g_free(snap);
+}
+
+/* full response around a body; snapshot bodies (with an ETag) vary on
+ * Accept-Encoding */
+static GString *
+status_response(GstHTTPServer *server, const gchar *etag,
+	const gchar *body, gsize len, gboolean gzip)
+{
+	gchar *name = gst_http_server_get_servername(server);
+	GString *r = g_string_sized_new(len + 256);
+
+	g_string_append_printf(r, "HTTP/1.0 200 OK\r\n"
+		"Server: %s\r\n"
+		"Content-Type: application/json\r\n"
+		"Cache-Control: no-cache\r\n"
+		"%s%s%s"
+		"%s"
+		"%s"
+		"Content-Length: %" G_GSIZE_FORMAT "\r\n\r\n",
+		name, etag ? "ETag: " : "", etag ? etag : "", etag ? "\r\n" : "",
+		etag ? "Vary: Accept-Encoding\r\n" : "",
+		gzip ? "Content-Encoding: gzip\r\n" : "", len);
+	g_string_append_len(r, body, len);
+	g_free(name);
+
+	return r;
+}
+
+/* gzip (RFC 1952) a buffer with the zlib we already link */
+static gboolean
+status_gzip(const gchar *in, gsize len, guchar **out, gsize *outlen)
+{
+	z_stream z;
+	gsize bound;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+	                 Z_DEFAULT_STRATEGY) != Z_OK)
+		return FALSE;
+	bound = deflateBound(&z, len);
+	*out = g_malloc(bound);
+	z.next_in = (Bytef *) in;
+	z.avail_in = len;
+	z.next_out = *out;
+	z.avail_out = bound;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&z);
+		g_free(*out);
+		return FALSE;
+	}
+	*outlen = z.total_out;
+	deflateEnd(&z);
+
+	return TRUE;
+}
+
+/** status_refresh - render a new snapshot
+ */
+static void
+status_refresh(GstHTTPServer *server)
+{
+	StatusSnapshot *snap = g_new0(StatusSnapshot, 1);
+	GString *json = status_render(server, NULL);
+	StatusSnapshot *old;
+	guchar *gz;
+	gsize gzlen;
+
+	snap->ref = 1;
+	snap->time = g_get_monotonic_time();
+	g_snprintf(snap->etag, sizeof(snap->etag), "\"%08x-%" G_GSIZE_FORMAT
+		"\"", g_str_hash(json->str), json->len);
+	g_snprintf(snap->etag_gz, sizeof(snap->etag_gz), "\"%08x-%"
+		G_GSIZE_FORMAT "-gz\"", g_str_hash(json->str), json->len);
+	snap->plain = status_response(server, snap->etag, json->str, json->len,
+		FALSE);
+	if (status_gzip(json->str, json->len, &gz, &gzlen)) {
+		snap->gzip = status_response(server, snap->etag_gz, (gchar *) gz,
+			gzlen, TRUE);
+		g_free(gz);
+	}
+	g_string_free(json, TRUE);
+
+	G_LOCK (status);
+	old = status_current;
+	status_current = snap;
+	G_UNLOCK (status);
+	status_unref(old);
+}
+
+/** status_timer - keep the snapshot fresh while someone polls it
+ * (called from the 1Hz stats timer)
+ */
+static void
+status_timer(GstHTTPServer *server)
+{
+	gboolean polled;
+
+	G_LOCK (status);
+	polled = status_polled &&
+		g_get_monotonic_time() - status_polled < STATUS_IDLE;
+	G_UNLOCK (status);
+
+	if (polled)
+		status_refresh(server);
+}
+
+/** server_status - return server status as JSON
+ * @param url - url mapping
+ * @param client - client connection
+ * @param data - server
+ *
+ * Serves the current snapshot in a single send: gzip'd if the client
+ * accepts it, 304 if it already has this ETag.  Filtered requests (see
+ * StatusQuery) are rendered for the request, still sent in one write.
+ */
+gboolean
+server_status(MediaURL *url, GstHTTPClient *client, gpointer data)
+{
+	GstHTTPServer *server = (GstHTTPServer *) data;
+	StatusSnapshot *snap;
+	const gchar *match, *encoding, *etag;
+	gint64 now = g_get_monotonic_time();
+	StatusQuery *q;
+	GString *r;
+
+	GST_INFO("Serving server_status to %s:%d", client->peer_ip, client->port);
+
+	if ((q = status_query(url))) {
+		GString *json = status_render(server, q);
+
+		r = status_response(server, NULL, json->str, json->len, FALSE);
+		gst_http_client_writebuf(client, r->str, r->len);
+		g_string_free(r, TRUE);
+		g_string_free(json, TRUE);
+		status_query_free(q);
+		return TRUE;
+	}
+
+	G_LOCK (status);
+	status_polled = now;
+	snap = status_current;
+	if (snap && now - snap->time < STATUS_INTERVAL + G_USEC_PER_SEC / 2)
+		g_atomic_int_inc(&snap->ref);
+	else
+		snap = NULL;
+	G_UNLOCK (status);
+
+	/* first poll in a while */
+	if (!snap) {
+		status_refresh(server);
+		G_LOCK (status);
+		snap = status_current;
+		g_atomic_int_inc(&snap->ref);
+		G_UNLOCK (status);
+	}
+
+	match = gst_http_client_get_header(client, "If-None-Match");
+	encoding = gst_http_client_get_header(client, "Accept-Encoding");
+	if (snap->gzip && encoding && strstr(encoding, "gzip")) {
+		r = snap->gzip;
+		etag = snap->etag_gz;
+	} else {
+		r = snap->plain;
+		etag = snap->etag;
+	}
+	if (match && strcmp(match, etag) == 0) {
+		gst_http_client_status(client, "304 Not Modified");
+		gst_http_client_writeln(client, "ETag: %s", etag);
+		gst_http_client_writeln(client, "Vary: Accept-Encoding");
+		gst_http_client_write(client, "\r\n");
+	} else
+		gst_http_client_writebuf(client, r->str, r->len);
+	status_unref(snap);
+
 	return TRUE;
 }
 
@@ -672,6 +1328,10 @@ main (int argc, char *argv[])
 	gchar *cgiroot = NULL;
 	char *cgirootphys = NULL;
 	gchar *sysadmin = "server.json";
+	gchar *events = "events";
+	gchar *metrics = "metrics";
+	gchar *history = "history.json";
+	gchar *flightrec = NULL;
 	gchar *pidfile = NULL;
 	gchar *device = NULL;
 	GstHTTPServer *server;
@@ -690,6 +1350,10 @@ main (int argc, char *argv[])
 		{"docroot", 'd', 0, G_OPTION_ARG_STRING, &docroot, "root directory for www", "path"},
 		{"cgiroot", 'c', 0, G_OPTION_ARG_STRING, &cgiroot, "root directory for cgi-bin", "path"},
 		{"sysadmin", 0, 0, G_OPTION_ARG_STRING, &sysadmin, "path to sysadmin", "path"},
+		{"events", 0, 0, G_OPTION_ARG_STRING, &events, "path to event stream", "path"},
+		{"metrics", 0, 0, G_OPTION_ARG_STRING, &metrics, "path to Prometheus metrics", "path"},
+		{"history", 0, 0, G_OPTION_ARG_STRING, &history, "path to per-second history", "path"},
+		{"flightrec", 0, 0, G_OPTION_ARG_STRING, &flightrec, "path to flight recorder dump (off by default)", "path"},
 		{"pidfile", 'p', 0, G_OPTION_ARG_STRING, &pidfile, "file to store pid", "filename"},
 		{"device", 0, 0, G_OPTION_ARG_STRING, &device, "video device", "filename"},
 		{"inputdev", 0, 0, G_OPTION_ARG_STRING, &input_dev, "device file for input", "filename"},
@@ -716,11 +1380,14 @@ main (int argc, char *argv[])
 	/* install signal handler */ 
 	signal(SIGINT, sighandler);
 	signal(SIGSEGV, sighandler);
+	signal(SIGUSR1, sighandler);
 	signal(SIGPIPE, SIG_IGN);
 
 	/* init gstreamer and create mainloop */
 	gst_init (&argc, &argv);
 	loop = g_main_loop_new (NULL, FALSE);
+	cpustat_thread_register("main", "main loop");
+	events_init ();
 
 	/* create a server instance */
 	server = gst_http_server_new ();
@@ -735,7 +1402,17 @@ main (int argc, char *argv[])
 
 	/* parse configfile */
 	if (configfile) {
+		GList *walk;
+
 		parse_config(server, configfile, input_dev);
+		/* started only once all options of the media are known */
+		GST_HTTP_MEDIA_MAPPING_LOCK(mapping);
+		for (walk = mapping->mappings; walk; walk = g_list_next (walk)) {
+			media = (GstHTTPMedia *) walk->data;
+			if (media->keep_running)
+				gst_http_media_hold(media);
+		}
+		GST_HTTP_MEDIA_MAPPING_UNLOCK(mapping);
 	}
 
 	/* parse commandline arguments */
@@ -763,8 +1440,29 @@ main (int argc, char *argv[])
 #endif
 	if (sysadmin) {
 		media = gst_http_media_new_handler ("Server Status", server_status, server);
+		media->raw_header = TRUE;
 		gst_http_media_mapping_add (mapping, sysadmin, media);
 	}
+	if (events && *events) {
+		media = gst_http_media_new_handler ("Event Stream", events_handler, NULL);
+		gst_http_media_mapping_add (mapping, events, media);
+	}
+	if (metrics && *metrics) {
+		media = gst_http_media_new_handler ("Metrics", metrics_handler, mapping);
+		media->raw_header = TRUE;
+		gst_http_media_mapping_add (mapping, metrics, media);
+	}
+	if (history && *history) {
+		history_init(mapping);
+		media = gst_http_media_new_handler ("History", history_handler, NULL);
+		media->raw_header = TRUE;
+		gst_http_media_mapping_add (mapping, history, media);
+	}
+	if (flightrec && *flightrec) {
+		media = gst_http_media_new_handler ("Flight Recorder",
+			flightrec_handler, NULL);
+		gst_http_media_mapping_add (mapping, flightrec, media);
+	}
 #ifdef CGI_PATH
 	if (cgiroot) {
 			cgirootphys = realpath(cgiroot, NULL);
@@ -806,9 +1504,7 @@ main (int argc, char *argv[])
 		exit(1);
 	}
 
-#ifdef SYS_STAT
-	g_timeout_add(1000, sysstat_timer, NULL);
-#endif
+	g_timeout_add(1000, sysstat_timer, server);
 
 	/* start serving */
 	g_print("%d: Listening on %s:%s\n", getpid(), address, service);
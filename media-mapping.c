@@ -19,6 +19,7 @@
 #include <string.h>
 
 #include "media-mapping.h"
+#include "trace.h"
 
 G_DEFINE_TYPE (GstHTTPMediaMapping, gst_http_media_mapping, G_TYPE_OBJECT);
 
@@ -91,28 +92,32 @@ gst_http_media_mapping_find (GstHTTPMediaMapping * mapping,
     const gchar *path)
 {
 	GstHTTPMedia *result = NULL;
-	guint i;
+	GList *walk;
 
 	GST_HTTP_MEDIA_MAPPING_LOCK(mapping);
-	for (i = 0; i < g_list_length(mapping->mappings); i++) {
-		result = g_list_nth_data(mapping->mappings, i);
+	/* exact matches win over wildcards, ie <path>/recording over HLS */
+	for (walk = mapping->mappings; walk; walk = g_list_next (walk)) {
+		GstHTTPMedia *media = walk->data;
 
-		if (strcmp(path, result->path) == 0) {
+		if (strcmp(path, media->path) == 0) {
+			result = media;
 			break;
 		}
+	}
+	for (walk = mapping->mappings; walk && !result; walk = g_list_next (walk)) {
+		GstHTTPMedia *media = walk->data;
 
-		else if (strchr(result->path, '*')) {
-			int l = strchr(result->path, '*') - result->path;
+		if (strchr(media->path, '*')) {
+			int l = strchr(media->path, '*') - media->path;
 
-			if (strncmp(path, result->path, l) == 0) {
-				break;
+			if (strncmp(path, media->path, l) == 0) {
+				result = media;
 			}
 		}
 	}
-	if (i == g_list_length(mapping->mappings))
-		result = NULL;
 	GST_HTTP_MEDIA_MAPPING_UNLOCK(mapping);
 
+	TRACE_MEDIA_FIND(path, result, result ? result->path : NULL);
 	if (result) {
 		GST_INFO ("found media %p for url abspath %s", result, path);
 	}
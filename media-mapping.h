@@ -47,6 +47,7 @@ typedef struct _MediaURL MediaURL;
 
 struct _MediaURL {
 	gchar *method;
+	gchar *version; // protocol version (ie HTTP/1.1)
 	gchar *path;    // path portion of the URL (following prot/server and preceeding '?')
 	gchar *query;   // full query string (text following a '?' in URL
 	gchar **querys; // query string split by '&'
@@ -22,12 +22,11 @@
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
-#include <pthread.h>
-#include <poll.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <linux/videodev2.h>
 #include <linux/input.h>
 
@@ -36,8 +35,18 @@
 #include <gst/app/gstappbuffer.h>
 
 #include "media.h"
+#include "jpeg-transcode.h"
+#include "events.h"
+#include "hls.h"
+#include "recorder.h"
+#include "input.h"
+#include "cpustat.h"
+#include "trace.h"
+#include "flightrec.h"
 
 #define DEFAULT_SHARED          FALSE
+#define DEFAULT_SUPPRESS_THRESHOLD  6
+#define DEFAULT_SUPPRESS_KEEPALIVE  G_USEC_PER_SEC
 
 enum
 {
@@ -52,85 +61,116 @@ G_DEFINE_TYPE (GstHTTPMedia, gst_http_media, G_TYPE_OBJECT);
 GST_DEBUG_CATEGORY_STATIC (http_media_debug);
 #define GST_CAT_DEFAULT http_media_debug
 
-/** input device handling
+#define MAX_VARIANTS            8
+#define MAX_VARIANT_DIM         4096
+#define MAX_TRANSCODE_FAILURES  5
+#define MAX_ADAPT_LEVELS        3   // down to 1/8 scale
+#define DEFAULT_ADAPT_LEVELS    2   // ?adapt=1 without an 'adapt:' line
+#define MOTION_QUIET            G_USEC_PER_SEC // no motion before period ends
+#define MAX_GOP_BYTES           (8 * 1024 * 1024)
+#define CATCHUP_CHUNK           (64 * 1024) // cached packets per write
+#define MEDIA_HOLD_TIMEOUT      (30 * G_USEC_PER_SEC)
+#define REPLAY_TICK_MS          10
+#define MEDIA_BACKOFF_MIN       G_USEC_PER_SEC        // first restart delay
+#define MEDIA_BACKOFF_MAX       (60 * G_USEC_PER_SEC)
+#define MEDIA_MAX_FAILURES      5   // consecutive errors before clients go
+#define MEDIA_BREAKER_COOLDOWN  (5 * 60 * G_USEC_PER_SEC)
+#define MEDIA_STABLE_TIME       (30 * G_USEC_PER_SEC) // resets failures
+#define WATCHDOG_FRAMES         10  // missed frame intervals to a stall
+#define WATCHDOG_MIN            (2 * G_USEC_PER_SEC)
+#define WATCHDOG_DEFAULT        (5 * G_USEC_PER_SEC)  // framerate unknown
+#define WATCHDOG_STARTUP        (15 * G_USEC_PER_SEC) // until the 1st frame
+#define DEFAULT_H264_ENCODER    "jpegdec ! ffmpegcolorspace ! " \
+                                "x264enc tune=zerolatency key-int-max=30"
+#define LEAKY_QUEUE             "queue leaky=downstream max-size-buffers=1 " \
+                                "max-size-bytes=0 max-size-time=0"
+
+/** media_stream_clear - release a list of cached stream buffers
  */
-static void *
-input_thread(void *user_data)
+static void
+media_stream_clear (GList **list)
 {
-	GstHTTPMedia *media = (GstHTTPMedia *) user_data;
-	char name[256] = "Unknown";
-	struct input_event ev[64];
-	int rd;
-	struct input_id device_info;
-	int i;
-
-	if ((media->input_fd = open(media->input_dev, O_RDONLY)) == -1) {
-		perror("open failed");
-		return NULL;
-	}
+	g_list_foreach (*list, (GFunc) gst_buffer_unref, NULL);
+	g_list_free (*list);
+	*list = NULL;
+}
 
-	if (ioctl(media->input_fd, EVIOCGNAME(sizeof(name)), name) < 0)
-		perror("EVIOCGNAME failed");
-	if (ioctl(media->input_fd, EVIOCGID, &device_info))
-		perror("EVIOCGID failed");
+/** media_stream_flush - release a queue of cached stream buffers
+ */
+static void
+media_stream_flush (GQueue *queue)
+{
+	GstBuffer *b;
 
-	GST_INFO( "opened %s: %04hx:%04hx version %04hx: %s\n",
-		media->input_dev, device_info.vendor, device_info.product,
-		device_info.version, name);
+	while ((b = g_queue_pop_head(queue)))
+		gst_buffer_unref(b);
+}
 
-	while (1) {
-		struct pollfd fds[1];
+/** media worker jobs
+ */
+typedef enum {
+	MEDIA_JOB_START = 1,
+	MEDIA_JOB_STOP,
+	MEDIA_JOB_LINK_VARIANT,
+	MEDIA_JOB_UNLINK_VARIANT,
+} MediaJobType;
+
+typedef struct {
+	MediaJobType  type;
+	GstHTTPMediaVariant *variant;
+} MediaJob;
+
+static void media_queue_job (GstHTTPMedia *media, MediaJobType type,
+	GstHTTPMediaVariant *variant);
+static void media_variant_release (GstHTTPMedia *media,
+	GstHTTPMediaVariant *v);
+static void media_variant_resolve (GstHTTPMedia *media,
+	GstHTTPMediaVariant *v);
+static void media_recover (GstHTTPMedia *media, const gchar *reason);
+static void media_set_state (GstHTTPMedia *media, GstHTTPMediaState state);
+static void media_client_unsync (GstHTTPClient *c);
+
+/** media_input_event - input device event (runs on the main loop)
+ */
+static void
+media_input_event (const struct input_event *ev, gpointer data)
+{
+	GstHTTPMedia *media = (GstHTTPMedia *) data;
 
-		fds[0].fd = media->input_fd;
-		fds[0].events = POLLIN | POLLPRI;
-		if (poll(fds, 1, 2000) == 0)
-			continue;
-		rd = read(media->input_fd, ev, sizeof(ev));
-		if (rd < (int) sizeof(struct input_event)) {
-			if (errno != EBADF)
-				fprintf(stderr, "read failed: %s (%d)\n", strerror(errno), errno);
-			break;
-		}
-		for (i = 0; i < (int) (rd / sizeof(struct input_event)); i++) {
-			if (EV_KEY == ev[i].type && KEY_CAMERA == ev[i].code) {
-				/* NB: value=1 for press, value=0 for release - we don't distinguish */
-				media->ev_press = ev[i].time.tv_sec;
-			}
-		}
+	if (EV_KEY == ev->type && KEY_CAMERA == ev->code) {
+		/* NB: value=1 for press, value=0 for release - we don't distinguish */
+		g_mutex_lock (media->ev_lock);
+		media->ev_press = ev->time.tv_sec;
+		g_mutex_unlock (media->ev_lock);
+	}
+	/* keys and switches; the rest (sync, axes) would flood the stream */
+	if (EV_KEY == ev->type || EV_SW == ev->type) {
+		events_publish("input", media->path, "\"type\": %u, \"code\": %u, "
+			"\"value\": %d, \"event_time\": %ld.%06ld", ev->type, ev->code,
+			ev->value, (long) ev->time.tv_sec, (long) ev->time.tv_usec);
 	}
-
-	return NULL;
 }
 
-/** start input device thread
+/** media_input_open - subscribe to the media's input device
  */
-int
-input_device_open(GstHTTPMedia *media)
+static void
+media_input_open (GstHTTPMedia *media)
 {
-	GST_INFO ("%s", __func__ );
-	if (media->input_dev && !media->input_thread) {
+	if (media->input_dev && !media->input) {
 		media->ev_press = 0;
-		return pthread_create(&media->input_thread, NULL, input_thread, (void*)media);
+		media->input = input_subscribe(media->input_dev, media_input_event,
+			media);
 	}
-	return 0;
 }
 
-
-/** stop input device thread
- * (blocks until it is complete)
+/** media_input_close - unsubscribe from the input device
+ * (no event callback runs once this returns)
  */
-int
-input_device_close(GstHTTPMedia *media)
+static void
+media_input_close (GstHTTPMedia *media)
 {
-	GST_INFO ("%s", __func__ );
-	if (media->input_thread) {
-		close(media->input_fd);
-		sleep(1);
-		pthread_join(media->input_thread, NULL);
-		media->input_fd = 0;
-		media->input_thread = 0;
-	}
-	return 0;
+	input_unsubscribe(media->input);
+	media->input = NULL;
 }
 
 
@@ -141,6 +181,7 @@ static void gst_http_media_get_property (GObject * object, guint propid,
 static void gst_http_media_set_property (GObject * object, guint propid,
     const GValue * value, GParamSpec * pspec);
 static void gst_http_media_finalize (GObject * object);
+static void media_worker (gpointer data, gpointer user_data);
 
 static void
 gst_http_media_class_init (GstHTTPMediaClass * klass)
@@ -168,6 +209,10 @@ gst_http_media_init (GstHTTPMedia * media)
 	media->ev_lock = g_mutex_new ();
 
 	media->shared = DEFAULT_SHARED;
+	media->suppress_threshold = DEFAULT_SUPPRESS_THRESHOLD;
+	media->suppress_keepalive = DEFAULT_SUPPRESS_KEEPALIVE;
+	media->capture_ring = g_queue_new ();
+	media->gop = g_queue_new ();
 
 	GST_INFO ("media created %p", media);
 }
@@ -181,12 +226,34 @@ gst_http_media_finalize (GObject * object)
 
 	GST_INFO ("finalize media %s %p", media->path, media);
 
+	if (media->worker)
+		g_thread_pool_free (media->worker, FALSE, TRUE);
+	if (media->motion_worker)
+		g_thread_pool_free (media->motion_worker, TRUE, TRUE);
+	if (media->motion_frame)
+		gst_buffer_unref (media->motion_frame);
+	transcode_free (media->motion_ref);
+	if (media->bus_watch)
+		g_source_remove (media->bus_watch);
 	if (media->pipeline) {
 		gst_element_set_state (media->pipeline, GST_STATE_NULL);
 		gst_object_unref (media->pipeline);
 	}
 
 	g_list_free (media->clients);
+	g_list_free (media->pending);
+	transcode_free (media->filter.thumb);
+	g_queue_foreach (media->capture_ring, (GFunc) gst_buffer_unref, NULL);
+	g_queue_free (media->capture_ring);
+	media_stream_clear (&media->streamheader);
+	media_stream_flush (media->gop);
+	g_queue_free (media->gop);
+	hls_free (media->hls);
+	timeshift_free (media->timeshift);
+	recorder_free (media->recorder);
+	if (media->last_frame)
+		gst_buffer_unref (media->last_frame);
+	g_free (media->last_error);
 
 	g_free(media->path);
 	g_free(media->desc);
@@ -194,6 +261,7 @@ gst_http_media_finalize (GObject * object)
 	g_free(media->v4l2srcdev);
 	g_free(media->mimetype);
 	g_free(media->capture);
+	g_free(media->encoder);
 	g_free(media->input_dev);
 	g_mutex_free (media->lock);
 	g_mutex_free (media->ev_lock);
@@ -223,6 +291,7 @@ gst_http_media_new_pipeline (const gchar *desc, const gchar *pipeline,
 	result->pipeline_desc = g_strdup(pipeline);
 	result->mimetype = g_strdup("multipart/x-mixed-replace");
 	result->input_dev = g_strdup(inputdev);
+	result->worker = g_thread_pool_new(media_worker, result, 1, FALSE, NULL);
 	//result->mimetype = g_strdup("image/jpeg");
 	elems = g_strsplit(pipeline, "!", 0);
 	if (elems[0] && strstr(elems[0], "v4l2src")) {
@@ -325,6 +394,54 @@ gst_http_media_set_property (GObject * object, guint propid,
   }
 }
 
+/** media_fail_clients - report a stream error and close the client sockets
+ * @param list - clients to fail
+ * @param msg - error text
+ *
+ * The closed sockets are noticed by the client watch which then unmanages
+ * the client.
+ */
+static void
+media_fail_clients (GList *list, const gchar *msg)
+{
+	GList *walk;
+
+	for (walk = list; walk; walk = g_list_next (walk)) {
+		GstHTTPClient *client = (GstHTTPClient *) walk->data;
+		gst_http_client_writeln(client, "Stream Error: %s", msg);
+		gst_http_client_write  (client, "\r\n");
+		close(client->sock);
+	}
+}
+
+/** gst_bus_sync_callback - called in the thread posting a bus message
+ *
+ * Streaming threads announce themselves with stream-status messages
+ * posted from the new thread, which is where they get attributed to
+ * this media for CPU accounting.
+ */
+static GstBusSyncReply
+gst_bus_sync_callback (GstBus *bus, GstMessage *message, gpointer user_data)
+{
+	GstHTTPMedia *media = (GstHTTPMedia *) user_data;
+	GstStreamStatusType type;
+	GstElement *owner;
+	gchar *role;
+
+	if (GST_MESSAGE_TYPE (message) != GST_MESSAGE_STREAM_STATUS)
+		return GST_BUS_PASS;
+
+	gst_message_parse_stream_status (message, &type, &owner);
+	if (type == GST_STREAM_STATUS_TYPE_ENTER) {
+		role = g_strdup_printf("stream %s", GST_ELEMENT_NAME (owner));
+		cpustat_thread_register(media->path, role);
+		g_free(role);
+	} else if (type == GST_STREAM_STATUS_TYPE_LEAVE)
+		cpustat_thread_unregister();
+
+	return GST_BUS_PASS;
+}
+
 /** gst_bus_callback - called when a message appears on the bus
  * @param bus
  * @param message
@@ -333,7 +450,6 @@ gst_http_media_set_property (GObject * object, guint propid,
 static gboolean
 gst_bus_callback (GstBus *bus, GstMessage *message, gpointer user_data)
 {
-	GList *walk;
 	GstHTTPMedia *media = (GstHTTPMedia *) user_data;
 
 	//GST_DEBUG_OBJECT(media, "Got %s message", GST_MESSAGE_TYPE_NAME (message));
@@ -345,21 +461,15 @@ gst_bus_callback (GstBus *bus, GstMessage *message, gpointer user_data)
 			gst_message_parse_error (message, &err, &debug);
 			GST_ERROR ("Pipeline Error for %s: %s", media->path, err->message);
 
-#if 1
 			GST_HTTP_MEDIA_LOCK (media);
-			for (walk = media->clients; walk; walk = g_list_next (walk)) {
-				GstHTTPClient *client = (GstHTTPClient *) walk->data;
-				gst_http_client_writeln(client, "Stream Error: %s", err->message);
-				gst_http_client_write  (client, "\r\n");
-				close(client->sock);
-			}
+			/* one failure can post several errors */
+			if (media->state == GST_HTTP_MEDIA_STATE_STARTING ||
+			    media->state == GST_HTTP_MEDIA_STATE_PLAYING)
+				media_recover(media, err->message);
 			GST_HTTP_MEDIA_UNLOCK (media);
-#endif
 
 			g_error_free (err);
 			g_free (debug);
-
-			gst_http_media_stop (media, NULL);
 		}	break;
 
 		case GST_MESSAGE_STATE_CHANGED: {
@@ -379,130 +489,1418 @@ gst_bus_callback (GstBus *bus, GstMessage *message, gpointer user_data)
 }
 
 
-/** gst_buffer_available - callback when frame buffer available to sink
- * @param elt - target element
- * @param media - media media
+/** media_configure_sink - set up an appsink feeding clients
+ * @param media
+ * @param sink - appsink element
  *
- * Called when the Media has a frame available for the clients
+ * With a latency budget the sink holds at most one frame and drops older
+ * ones instead of queueing them behind a slow fan-out, and does not wait
+ * on the clock (intended for live sources).
  */
-static GstFlowReturn
-gst_buffer_available(GstAppSink * sink, gpointer user_data)
+static void
+media_configure_sink (GstHTTPMedia *media, GstElement *sink)
+{
+	/* dropping buffers would corrupt a byte stream */
+	if (media->latency_budget && !GST_HTTP_MEDIA_IS_TS(media)) {
+		g_object_set (G_OBJECT (sink), "emit-signals", TRUE, "sync", FALSE,
+			"max-buffers", 1, "drop", TRUE, NULL);
+	} else {
+		g_object_set (G_OBJECT (sink), "emit-signals", TRUE, NULL);
+	}
+}
+
+/** media_frame_age - time since a frame was captured
+ * @param sink - appsink the frame was pulled from
+ * @param buffer - the frame
+ *
+ * Returns GST_CLOCK_TIME_NONE if the frame has no timestamp
+ */
+static GstClockTime
+media_frame_age (GstElement *sink, GstBuffer *buffer)
+{
+	GstClock *clock;
+	GstClockTime now, capture;
+
+	if (!GST_BUFFER_TIMESTAMP_IS_VALID (buffer))
+		return GST_CLOCK_TIME_NONE;
+	if (!(clock = gst_element_get_clock (sink)))
+		return GST_CLOCK_TIME_NONE;
+	now = gst_clock_get_time (clock);
+	gst_object_unref (clock);
+
+	/* running time of the frame plus the base time is its capture time */
+	capture = gst_element_get_base_time (sink) + GST_BUFFER_TIMESTAMP (buffer);
+	return (now > capture) ? now - capture : 0;
+}
+
+/** media_frame_captured - wall clock capture time of a frame
+ * Returns usec since the epoch, 0 if the frame has no timestamp
+ */
+static gint64
+media_frame_captured (GstElement *sink, GstBuffer *buffer)
+{
+	GstClockTime age = media_frame_age(sink, buffer);
+
+	if (!GST_CLOCK_TIME_IS_VALID (age))
+		return 0;
+	return g_get_real_time() - age / GST_USECOND;
+}
+
+/** media_over_budget - check if a frame is already too old to send
+ */
+static gboolean
+media_over_budget (GstHTTPMedia *media, GstElement *sink, GstBuffer *buffer)
+{
+	GstClockTime age;
+
+	if (!media->latency_budget)
+		return FALSE;
+	age = media_frame_age(sink, buffer);
+	if (GST_CLOCK_TIME_IS_VALID (age) && age > media->latency_budget) {
+		metric_inc(&media->late_frames); // native and variant sinks
+		flightrec_log(FR_FRAME_LATE, media->path, 0, age / GST_USECOND);
+		GST_DEBUG ("%s: dropping frame %" GST_TIME_FORMAT " over budget",
+			media->path, GST_TIME_ARGS (age));
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/** media_record_latency - account capture-to-send latency of a sent frame
+ * (call with media lock held: the native and variant sinks share it)
+ */
+static void
+media_record_latency (GstHTTPMedia *media, GstElement *sink,
+	GstBuffer *buffer)
+{
+	GstClockTime age = media_frame_age(sink, buffer);
+
+	if (GST_CLOCK_TIME_IS_VALID (age))
+		pctl_add_sample(&media->latency, age / GST_USECOND);
+}
+
+/** media_luma_changed - compare two luma thumbnails
+ * Returns TRUE if any 8x8 block changed its mean luma by more than threshold
+ */
+static gboolean
+media_luma_changed(const guchar *a, const guchar *b, guint size,
+	guint threshold)
+{
+	guint i;
+
+	for (i = 0; i < size; i++) {
+		if ((guint) ABS((gint) a[i] - (gint) b[i]) > threshold)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* change signature of a frame, computed without the media lock */
+typedef struct {
+	gboolean       computed;      // FALSE: nobody watching, or suppress off
+	guint32        hash;
+	guchar        *thumb;
+	guint          w, h;
+} MediaFrameSig;
+
+/** media_stream_watched - check if a stream has clients to suppress for
+ * (call with media lock held)
+ */
+static gboolean
+media_stream_watched(GstHTTPMedia *media, GstHTTPMediaVariant *variant)
 {
 	GList *walk;
-	GstBuffer *buffer;
-	GstHTTPMedia *media;
 
-	/* get the buffer from appsink */
-	buffer = gst_app_sink_pull_buffer (sink);
-	if (!buffer)
-		return GST_FLOW_OK;
+	if (media->suppress == GST_HTTP_SUPPRESS_NONE ||
+	    strcmp(media->mimetype, "image/jpeg") == 0)
+		return FALSE;
+	for (walk = media->clients; walk; walk = g_list_next (walk)) {
+		if (((GstHTTPClient *) walk->data)->variant == variant)
+			return TRUE;
+	}
+	return FALSE;
+}
 
- 	media = (GstHTTPMedia *) user_data;
+/** media_frame_sign - hash or thumbnail a frame for media_frame_unchanged
+ * (call without the media lock: luma mode entropy-decodes the frame)
+ */
+static void
+media_frame_sign(GstHTTPMedia *media, const guchar *data, gsize size,
+	MediaFrameSig *sig)
+{
+	memset(sig, 0, sizeof(*sig));
+	switch (media->suppress) {
+		case GST_HTTP_SUPPRESS_HASH:
+			sig->hash = transcode_entropy_hash(data, size);
+			sig->computed = TRUE;
+			break;
+		case GST_HTTP_SUPPRESS_LUMA:
+			sig->computed = transcode_luma_thumbnail(data, size,
+				&sig->thumb, &sig->w, &sig->h);
+			break;
+		default:
+			break;
+	}
+}
 
-	GST_DEBUG ("%s frame available: %d bytes", media->path, buffer->size);
+/** media_frame_sign_stream - sign a frame of a stream if it has clients
+ */
+static void
+media_frame_sign_stream(GstHTTPMedia *media, GstHTTPMediaVariant *variant,
+	GstBuffer *buffer, MediaFrameSig *sig)
+{
+	gboolean watched;
 
-	/* get width/height of stream */
-	if (0 == media->width) {
-		GstCaps *caps = gst_buffer_get_caps(buffer);
-		const GstStructure *str = gst_caps_get_structure (caps, 0);
-		if (!gst_structure_get_int (str, "width", (int*)&media->width) ||
-		    !gst_structure_get_int (str, "height", (int*)&media->height)) {
-			GST_ERROR("No width/height available");
+	GST_HTTP_MEDIA_LOCK (media);
+	watched = media_stream_watched(media, variant);
+	GST_HTTP_MEDIA_UNLOCK (media);
+	if (watched)
+		media_frame_sign(media, buffer->data, buffer->size, sig);
+	else
+		memset(sig, 0, sizeof(*sig));
+}
+
+/** media_frame_unchanged - check if a frame can be suppressed
+ * @param media
+ * @param f - change detector of the stream the frame belongs to
+ * @param sig - signature of the frame (its thumbnail is taken over)
+ *
+ * Frames are compared against the last frame sent on the stream, so slow
+ * drift still gets through eventually.  Single image clients always get
+ * their frame.  Call with media lock held.
+ *
+ * Returns TRUE if the frame should not be sent
+ */
+static gboolean
+media_frame_unchanged(GstHTTPMedia *media, GstHTTPFrameFilter *f,
+	MediaFrameSig *sig)
+{
+	gboolean unchanged = FALSE;
+	gint64 now;
+
+	if (!sig || !sig->computed ||
+	    media->suppress == GST_HTTP_SUPPRESS_NONE ||
+	    strcmp(media->mimetype, "image/jpeg") == 0)
+		return FALSE;
+
+	now = g_get_monotonic_time();
+	switch (media->suppress) {
+		case GST_HTTP_SUPPRESS_HASH:
+			unchanged = (f->last_sent && sig->hash == f->hash);
+			break;
+		case GST_HTTP_SUPPRESS_LUMA:
+			unchanged = (f->thumb && sig->w == f->thumb_w &&
+				sig->h == f->thumb_h &&
+				!media_luma_changed(sig->thumb, f->thumb, sig->w * sig->h,
+					media->suppress_threshold));
+			break;
+		default:
+			break;
+	}
+
+	if (unchanged && !f->force &&
+	    now - f->last_sent < media->suppress_keepalive)
+		return TRUE;
+
+	/* frame goes out and becomes the reference */
+	f->force = FALSE;
+	f->last_sent = now;
+	f->hash = sig->hash;
+	if (sig->thumb) {
+		transcode_free(f->thumb);
+		f->thumb = sig->thumb;
+		f->thumb_w = sig->w;
+		f->thumb_h = sig->h;
+		sig->thumb = NULL;
+	}
+	return FALSE;
+}
+
+/** media_force_frames - make every stream send its next frame
+ * (call with media lock held)
+ */
+static void
+media_force_frames(GstHTTPMedia *media)
+{
+	GList *walk;
+
+	media->filter.force = TRUE;
+	for (walk = media->variants; walk; walk = g_list_next (walk))
+		((GstHTTPMediaVariant *) walk->data)->filter.force = TRUE;
+}
+
+/** media_send_frame - write one jpeg frame to a client
+ * @param media
+ * @param c - client
+ * @param data, size - jpeg frame
+ * @param captured - wall clock capture time (usec, 0 = unknown), sent as
+ *   X-Timestamp for clients measuring capture-to-receive latency
+ *
+ * Multipart frames the client's socket cannot take without blocking are
+ * skipped (see gst_http_client_congested).
+ *
+ * Returns FALSE if the client connection is finished
+ */
+static gboolean
+media_send_frame(GstHTTPMedia *media, GstHTTPClient *c, const guchar *data,
+	gsize size, gint64 captured)
+{
+	gint ret;
+
+	if (strcmp(media->mimetype, "multipart/x-mixed-replace") == 0)
+	{
+		/* a full socket would block the other clients */
+		if (gst_http_client_congested(c, size)) {
+			c->tcp.skipped++;
+			return TRUE;
 		}
-		GST_INFO("framesize=%dx%d", media->width, media->height);
+		gst_http_client_write  (c, "\r\n");
+		gst_http_client_writeln(c, "--%s", MULTIPART_BOUNDARY);
+		gst_http_client_writeln(c, "Content-Type: image/jpeg");
+		gst_http_client_writeln(c, "Content-Length: %d", (int) size);
+	}
+	if (strcmp(media->mimetype, "image/jpeg") == 0)
+	{
+		gst_http_client_writeln(c, "Content-Length: %d", (int) size);
+	}
+	
+	if (media->ev_press && media->ev_press > c->ev_press) {
+		c->ev_press = media->ev_press;
+		gst_http_client_writeln(c, "Button-Press: %ld",
+			(long)(c->ev_press - media->starttime));
+	}
+	if (captured)
+		gst_http_client_writeln(c, "X-Timestamp: %" G_GINT64_FORMAT ".%06d",
+			captured / G_USEC_PER_SEC, (int) (captured % G_USEC_PER_SEC));
+
+	gst_http_client_write  (c, "\r\n");
+
+	c->ewma_framesize = c->ewma_framesize ?
+			(((c->ewma_framesize * (2 /*weight*/ - 1)) +
+				(size * 1 /*factor*/)) / 2 /*weight*/) :
+			(size * 1 /*factor*/);
+	rate_add(&c->rate_frames, 1);
+	rate_add(&c->rate_bytes, size);
+	metric_inc(&c->metrics.frames);
+	metric_inc(&media->metrics.out.frames);
+	TRACE_SEND_START(c->sock, media->path, size);
+	ret = gst_http_client_writebuf(c, (char*)data, size);
+	TRACE_SEND_END(c->sock, media->path, ret);
+	if (ret < 0) {
+		close(c->sock);
+		return FALSE;
+	}
+
+	// if we are serving just an image, close the socket
+	if (strcmp(media->mimetype, "image/jpeg") == 0) {
+		close(c->sock);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/** media_push_buffer - send a frame to the clients of a stream variant
+ * @param media
+ * @param variant - variant the frame belongs to (NULL for native stream)
+ * @param buffer - jpeg frame
+ * @param sig - its signature (see media_frame_sign), NULL if none
+ *
+ * Call with media lock held
+ */
+static void
+media_push_buffer(GstHTTPMedia *media, GstHTTPMediaVariant *variant,
+	GstBuffer *buffer, MediaFrameSig *sig)
+{
+	GList *walk;
+
+	if (media_frame_unchanged(media, variant ? &variant->filter :
+	                          &media->filter, sig))
+	{
+		media->suppressed_frames++;
+		for (walk = media->clients; walk; walk = g_list_next (walk)) {
+			if (((GstHTTPClient *) walk->data)->variant == variant)
+				media->suppressed_bytes += buffer->size;
+		}
+		return;
 	}
 
 	/* push buffer to clients*/
-	GST_HTTP_MEDIA_LOCK (media);
 	for (walk = media->clients; walk; walk = g_list_next (walk)) {
 		GstHTTPClient *c = (GstHTTPClient *) walk->data;
 
-		if (strcmp(media->mimetype, "multipart/x-mixed-replace") == 0)
-		{
-			gst_http_client_write  (c, "\r\n");
-			gst_http_client_writeln(c, "--%s", MULTIPART_BOUNDARY);
-			gst_http_client_writeln(c, "Content-Type: image/jpeg");
-			gst_http_client_writeln(c, "Content-Length: %d", buffer->size);
-		}
-		if (strcmp(media->mimetype, "image/jpeg") == 0)
-		{
-			gst_http_client_writeln(c, "Content-Length: %d", buffer->size);
-		}
-		
-		if (media->ev_press && media->ev_press > c->ev_press) {
-			c->ev_press = media->ev_press;
-			gst_http_client_writeln(c, "Button-Press: %ld",
-				(long)(c->ev_press - media->starttime));
-		}
+		if (c->variant != variant)
+			continue;
+		media_send_frame(media, c, buffer->data, buffer->size,
+			media->frame_captured);
+	}
+}
 
-		gst_http_client_write  (c, "\r\n");
+/** media_release_variants - drop the variants of clients being failed
+ * (call with media lock held)
+ *
+ * The clients are off the media lists, so gst_http_media_stop will not
+ * release them later.
+ */
+static void
+media_release_variants(GstHTTPMedia *media, GList *clients)
+{
+	GList *walk;
 
-		c->ewma_framesize = c->ewma_framesize ?
-				(((c->ewma_framesize * (2 /*weight*/ - 1)) +
-					(buffer->size * 1 /*factor*/)) / 2 /*weight*/) :
-				(buffer->size * 1 /*factor*/);
-		avg_add_samples(&c->avg_frames, 1);
-		avg_add_samples(&c->avg_bytes, buffer->size);
-		if (media->capture)
-		{
-			gchar *fname = g_strdup_printf(media->capture,
-				c->avg_frames.total);
-			g_file_set_contents(fname, (char*)buffer->data,
-				buffer->size, NULL);
-			g_free(fname);
-		}
-		if (gst_http_client_writebuf(c, (char*)buffer->data, buffer->size) < 0) {
-			close(c->sock);
+	for (walk = clients; walk; walk = g_list_next (walk)) {
+		GstHTTPClient *c = (GstHTTPClient *) walk->data;
+
+		if (c->variant) {
+			media_variant_release(media, c->variant);
+			c->variant = NULL;
 		}
+	}
+}
+
+/** media_start_failed - fail clients of a pipeline that could not be
+ * started or recovered (runs on the main loop)
+ */
+typedef struct {
+	GstHTTPMedia *media;
+	GList        *clients;
+	gchar        *msg;
+} MediaStartFailure;
+
+static gboolean
+media_start_failed (gpointer user_data)
+{
+	MediaStartFailure *f = (MediaStartFailure *) user_data;
+	GList *walk;
+
+	GST_ERROR ("%s: %s, dropping %d clients", f->media->path, f->msg,
+		g_list_length(f->clients));
+	media_fail_clients(f->clients, f->msg);
+	for (walk = f->clients; walk; walk = g_list_next (walk))
+		g_object_unref(walk->data);
+	g_list_free(f->clients);
+	g_free(f->msg);
+	g_object_unref(f->media);
+	g_free(f);
+
+	return FALSE;
+}
+
+/** media_restart_timer - bring a failed pipeline back after its backoff
+ * (runs on the main loop, once a second while restarting)
+ *
+ * Streaming clients parked during the restart get the last good frame
+ * again so they do not time out.
+ */
+static gboolean
+media_restart_timer (gpointer data)
+{
+	GstHTTPMedia *media = (GstHTTPMedia *) data;
+	GList *walk;
+
+	GST_HTTP_MEDIA_LOCK (media);
+	if (media->state != GST_HTTP_MEDIA_STATE_RESTARTING) {
+		media->restart_timer = 0;
+		GST_HTTP_MEDIA_UNLOCK (media);
+		g_object_unref (media);
+		return FALSE;
+	}
 
-		// if we are serving just an image, close the socket
-		if (strcmp(media->mimetype, "image/jpeg") == 0) {
-			close(c->sock);
+	/* under the lock so the frames cannot interleave with the first new
+	 * one; media_send_frame skips clients that cannot take them without
+	 * blocking */
+	if (media->last_frame &&
+	    strcmp(media->mimetype, "multipart/x-mixed-replace") == 0)
+	{
+		for (walk = media->pending; walk; walk = g_list_next (walk)) {
+			GstHTTPClient *c = (GstHTTPClient *) walk->data;
+
+			if (!c->variant)
+				media_send_frame(media, c, media->last_frame->data,
+					media->last_frame->size, 0);
 		}
 	}
+
+	if (g_get_monotonic_time() < media->restart_at) {
+		GST_HTTP_MEDIA_UNLOCK (media);
+		return TRUE;
+	}
+
+	if (media->clients || media->pending || media->replay || media->hold) {
+		GST_INFO ("%s: restarting pipeline (attempt %u)", media->path,
+			media->failures);
+		media_set_state(media, GST_HTTP_MEDIA_STATE_STARTING);
+		media_queue_job(media, MEDIA_JOB_START, NULL);
+	} else {
+		/* everyone left while we waited */
+		media_set_state(media, GST_HTTP_MEDIA_STATE_STOPPING);
+		media_queue_job(media, MEDIA_JOB_STOP, NULL);
+	}
+	media->restart_timer = 0;
 	GST_HTTP_MEDIA_UNLOCK (media);
 
-	/* we don't need the buffer anymore */
-	gst_buffer_unref(buffer);
+	g_object_unref (media);
+	return FALSE;
+}
 
-	return GST_FLOW_OK;
+/** media_breaker_reset - restart held media once the breaker cooled down
+ * (runs on the main loop)
+ */
+static gboolean
+media_breaker_reset (gpointer data)
+{
+	GstHTTPMedia *media = (GstHTTPMedia *) data;
+
+	GST_HTTP_MEDIA_LOCK (media);
+	if (media->hold && media->state == GST_HTTP_MEDIA_STATE_STOPPED &&
+	    g_get_monotonic_time() >= media->breaker_until)
+	{
+		GST_INFO ("%s: breaker reset, starting held media", media->path);
+		media_set_state(media, GST_HTTP_MEDIA_STATE_STARTING);
+		media_queue_job(media, MEDIA_JOB_START, NULL);
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	g_object_unref (media);
+	return FALSE;
 }
 
-/**
- * gst_http_media_create_pipeline:
- * @media: a #GstHTTPMedia to play
- 
- * Launch the gstreamer pipeline
+/** media_recover - handle a pipeline failure
+ * @param media
+ * @param reason - error message
  *
- * Returns error code (0 = success) 
+ * The pipeline is torn down and started again after an exponential backoff
+ * while the streaming clients stay connected (moved back to the pending
+ * list, released again by the first new frame).  After MEDIA_MAX_FAILURES
+ * consecutive failures the breaker trips: clients are dropped and plays are
+ * refused for MEDIA_BREAKER_COOLDOWN.
  *
+ * Call with media lock held
  */
-static int
-gst_http_media_create_pipeline(GstHTTPMedia *media)
+static void
+media_recover (GstHTTPMedia *media, const gchar *reason)
 {
-	GstElement *sink;
-	GstBus *bus;
-	gchar *desc;
-	GError *err = NULL;
+	gint64 now = g_get_monotonic_time();
+	gint64 backoff;
+	GList *walk;
 
-	if (media->pipeline)
-		return -1;
+	g_free(media->last_error);
+	media->last_error = g_strdup(reason);
+	media->failures++;
+	metric_inc(&media->metrics.errors);
+	flightrec_log(FR_ERROR, media->path, media->failures, 0);
+
+	if (media->failures > MEDIA_MAX_FAILURES) {
+		MediaStartFailure *f = g_new0(MediaStartFailure, 1);
+
+		GST_ERROR ("%s: %u consecutive failures, giving up for %ds",
+			media->path, media->failures - 1,
+			(int) (MEDIA_BREAKER_COOLDOWN / G_USEC_PER_SEC));
+		media->breaker_trips++;
+		media->breaker_until = now + MEDIA_BREAKER_COOLDOWN;
+		flightrec_log(FR_BREAKER, media->path, media->failures, 0);
+		media->failures = 0;
+		/* held media (timeshift, record, HLS) come back by themselves */
+		g_timeout_add_seconds (MEDIA_BREAKER_COOLDOWN / G_USEC_PER_SEC,
+			media_breaker_reset, g_object_ref (media));
+
+		f->media = g_object_ref(media);
+		f->clients = g_list_concat(media->clients, media->pending);
+		f->msg = g_strdup(reason);
+		media->clients = NULL;
+		media->pending = NULL;
+		media_release_variants(media, f->clients);
+		g_idle_add(media_start_failed, f);
+
+		media_set_state(media, GST_HTTP_MEDIA_STATE_STOPPING);
+		media_queue_job(media, MEDIA_JOB_STOP, NULL);
+		return;
+	}
 
-	GST_INFO ("Creating new multipart/jpeg pipeline for '%s'", media->path);
+	backoff = MIN(MEDIA_BACKOFF_MIN << (media->failures - 1),
+		MEDIA_BACKOFF_MAX);
+	GST_WARNING ("%s: %s, restarting in %.1fs", media->path, reason,
+		backoff / 1e6);
+	media->restarts++;
+	media->restart_at = now + backoff;
+	media->pending = g_list_concat(media->clients, media->pending);
+	media->clients = NULL;
+	/* the new muxer starts a new stream: header and keyframe group again */
+	for (walk = media->pending; walk; walk = g_list_next (walk))
+		media_client_unsync((GstHTTPClient *) walk->data);
+
+	media_set_state(media, GST_HTTP_MEDIA_STATE_RESTARTING);
+	media_queue_job(media, MEDIA_JOB_STOP, NULL);
+	if (!media->restart_timer)
+		media->restart_timer = g_timeout_add_seconds (1, media_restart_timer,
+			g_object_ref (media));
+}
 
-	if (!strchr(media->pipeline_desc, '!')) {
-		struct v4l2_fmtdesc fmt;
-		struct v4l2_frmsizeenum frmsize;
-		int i = 0;
-		int width, height;
-		int target_w, target_h;
-		char* dev = g_strdup("/dev/video0");
-		const char* mediafmt = NULL;
-		int fd;
-		gchar **elems;
+/* one DCT-domain variant frame, generated without the media lock */
+typedef struct {
+	gint           width;         // identify the variant again afterwards
+	gint           height;
+	gint           quality;
+	guint          scale;
+	guchar        *data;          // NULL: native frame passed through
+	gsize          size;
+	gboolean       ok;
+	gboolean       watched;       // has clients: sign the frame
+	MediaFrameSig  sig;
+} MediaTranscode;
+
+/** media_transcode_frames - generate and push the DCT-domain variant frames
+ * @param media
+ * @param sink - native appsink (frame age)
+ * @param buffer - native jpeg frame
+ * @param captured - wall clock capture time of @buffer (usec, 0 = unknown)
+ *
+ * Call without the media lock: the parameters of the variants are copied
+ * under the lock, the frames transcoded outside it so the fan-out of other
+ * streams is not held up, and pushed to the variants still listed.
+ * Like branch variant frames they are checked against the latency budget
+ * after encoding and their latency recorded.
+ */
+static void
+media_transcode_frames(GstHTTPMedia *media, GstElement *sink,
+	GstBuffer *buffer, gint64 captured)
+{
+	MediaTranscode *jobs;
+	GList *walk;
+	guint n = 0, i;
 
-		i = 0;
-		elems = g_strsplit(media->pipeline_desc, " ", 0);
+	GST_HTTP_MEDIA_LOCK (media);
+	jobs = g_new0(MediaTranscode, MAX_VARIANTS);
+	for (walk = media->variants; walk && n < MAX_VARIANTS;
+	     walk = g_list_next (walk))
+	{
+		GstHTTPMediaVariant *v = (GstHTTPMediaVariant *) walk->data;
+
+		if (v->mode == GST_HTTP_VARIANT_UNRESOLVED && media->width)
+			media_variant_resolve(media, v);
+		if (v->mode != GST_HTTP_VARIANT_TRANSCODE)
+			continue;
+		jobs[n].width = v->width;
+		jobs[n].height = v->height;
+		jobs[n].quality = v->quality;
+		jobs[n].scale = v->scale;
+		jobs[n].watched = media_stream_watched(media, v);
+		n++;
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	for (i = 0; i < n; i++) {
+		MediaTranscode *t = &jobs[i];
+
+		if (t->scale == 1 && t->quality == 0)
+			t->ok = TRUE;
+		else
+			t->ok = transcode_jpeg(buffer->data, buffer->size, t->scale,
+				t->quality, &t->data, &t->size);
+		if (t->ok && t->watched)
+			media_frame_sign(media, t->data ? t->data : buffer->data,
+				t->data ? t->size : buffer->size, &t->sig);
+	}
+
+	GST_HTTP_MEDIA_LOCK (media);
+	media->frame_captured = captured;
+	for (i = 0; i < n; i++) {
+		MediaTranscode *t = &jobs[i];
+		GstHTTPMediaVariant *v = NULL;
+		GstBuffer *out;
+
+		/* released (or moved to a branch) while transcoding */
+		for (walk = media->variants; walk; walk = g_list_next (walk)) {
+			v = (GstHTTPMediaVariant *) walk->data;
+			if (v->width == t->width && v->height == t->height &&
+			    v->quality == t->quality)
+				break;
+		}
+		if (!walk || v->mode != GST_HTTP_VARIANT_TRANSCODE)
+			continue;
+
+		if (!t->ok) {
+			if (++v->failures >= MAX_TRANSCODE_FAILURES) {
+				GST_WARNING ("%s: cannot transcode frames, using encoder "
+					"branch", media->path);
+				v->mode = GST_HTTP_VARIANT_BRANCH;
+				if (media->pipeline)
+					media_queue_job(media, MEDIA_JOB_LINK_VARIANT, v);
+			}
+			continue;
+		}
+		v->failures = 0;
+		if (!t->data) {
+			media_push_buffer(media, v, buffer, &t->sig);
+			continue;
+		}
+		out = gst_buffer_new();
+		GST_BUFFER_DATA(out) = t->data;
+		GST_BUFFER_SIZE(out) = t->size;
+		gst_buffer_copy_metadata(out, buffer, GST_BUFFER_COPY_TIMESTAMPS);
+		if (!media_over_budget(media, sink, out)) {
+			media_push_buffer(media, v, out, &t->sig);
+			media_record_latency(media, sink, out);
+		}
+		gst_buffer_unref(out);
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	for (i = 0; i < n; i++) {
+		transcode_free(jobs[i].data);
+		transcode_free(jobs[i].sig.thumb);
+	}
+	g_free(jobs);
+}
+
+/** media_variant_resolve - decide how a variant is generated
+ * (call with media lock held, once the native frame size is known)
+ */
+static void
+media_variant_resolve (GstHTTPMedia *media, GstHTTPMediaVariant *v)
+{
+	guint scale;
+
+	v->mode = GST_HTTP_VARIANT_BRANCH;
+	for (scale = 1; scale <= TRANSCODE_MAX_SCALE; scale <<= 1) {
+		if ((!v->width || v->width == (media->width + scale - 1) / scale) &&
+		    (!v->height || v->height == (media->height + scale - 1) / scale))
+		{
+			v->mode = GST_HTTP_VARIANT_TRANSCODE;
+			v->scale = scale;
+			break;
+		}
+	}
+
+	GST_INFO ("%s: %dx%d q%d variant uses %s", media->path, v->width,
+		v->height, v->quality, (v->mode == GST_HTTP_VARIANT_TRANSCODE) ?
+		"DCT-domain transcode" : "encoder branch");
+	if (v->mode == GST_HTTP_VARIANT_BRANCH && media->pipeline)
+		media_queue_job(media, MEDIA_JOB_LINK_VARIANT, v);
+}
+
+/** media_motion_feed - hand the latest frame to the motion worker
+ * (call with media lock held)
+ *
+ * Only the newest frame is kept: if the worker has not picked up the
+ * previous one yet it is replaced, so analysis never holds up the fan-out.
+ */
+static void
+media_motion_feed(GstHTTPMedia *media, GstBuffer *buffer)
+{
+	if (!media->motion_worker)
+		return;
+
+	if (media->motion_frame) {
+		gst_buffer_unref(media->motion_frame);
+		media->motion_frame = gst_buffer_ref(buffer);
+		return;
+	}
+	media->motion_frame = gst_buffer_ref(buffer);
+	g_thread_pool_push(media->motion_worker, media, NULL);
+}
+
+/** media_motion_publish - send a motion start/end event
+ */
+static void
+media_motion_publish(GstHTTPMedia *media, gboolean active, guint score)
+{
+	GST_INFO ("%s: motion %s (%u blocks)", media->path,
+		active ? "started" : "ended", score);
+	events_publish("motion", media->path, "\"active\": %s, \"blocks\": %u",
+		active ? "true" : "false", score);
+}
+
+/** media_motion_worker - analyse a frame for motion
+ *
+ * Compares the 1/8 scale luma image (one value per 8x8 block) with the
+ * previous analysed frame and counts blocks that changed by more than
+ * the threshold.  A motion period ends after MOTION_QUIET without motion.
+ */
+static void
+media_motion_worker (gpointer data, gpointer user_data)
+{
+	GstHTTPMedia *media = (GstHTTPMedia *) user_data;
+	GstBuffer *buffer;
+	guchar *thumb;
+	guint w, h, i, score = 0;
+	gboolean started = FALSE, ended = FALSE;
+	gint64 now;
+
+	cpustat_thread_register(media->path, "motion");
+	GST_HTTP_MEDIA_LOCK (media);
+	buffer = media->motion_frame;
+	media->motion_frame = NULL;
+	GST_HTTP_MEDIA_UNLOCK (media);
+	if (!buffer)
+		return;
+
+	if (!transcode_luma_thumbnail(buffer->data, buffer->size, &thumb, &w, &h)) {
+		gst_buffer_unref(buffer);
+		return;
+	}
+	gst_buffer_unref(buffer);
+
+	if (media->motion_ref && w == media->motion_ref_w &&
+	    h == media->motion_ref_h)
+	{
+		for (i = 0; i < w * h; i++) {
+			if ((guint) ABS((gint) thumb[i] - (gint) media->motion_ref[i]) >
+			    media->motion_threshold)
+				score++;
+		}
+	}
+	transcode_free(media->motion_ref);
+	media->motion_ref = thumb;
+	media->motion_ref_w = w;
+	media->motion_ref_h = h;
+
+	now = g_get_monotonic_time();
+	GST_HTTP_MEDIA_LOCK (media);
+	media->motion_score = score;
+	if (score >= media->motion_blocks) {
+		media->motion_seen = now;
+		if (!media->motion) {
+			media->motion = started = TRUE;
+			media->motion_events++;
+			media->motion_start = time(NULL);
+		}
+	} else if (media->motion && now - media->motion_seen > MOTION_QUIET) {
+		media->motion = FALSE;
+		ended = TRUE;
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	if (started || ended)
+		media_motion_publish(media, started, score);
+}
+
+/** media_capture_write - write a frame to the next capture file
+ */
+static void
+media_capture_write(GstHTTPMedia *media, GstBuffer *buffer)
+{
+	gchar *fname = g_strdup_printf(media->capture, media->capture_count++);
+
+	if (!g_file_set_contents(fname, (char*)buffer->data, buffer->size, NULL))
+		GST_WARNING ("%s: failed writing capture %s", media->path, fname);
+	g_free(fname);
+}
+
+/** media_capture - handle the capture option for a native frame
+ * (runs on the streaming thread, without the media lock)
+ *
+ * In motion mode the last capture_preroll frames are kept in memory and
+ * written out when motion starts; capture continues capture_postroll
+ * after the last frame with motion.
+ */
+static void
+media_capture(GstHTTPMedia *media, GstBuffer *buffer)
+{
+	GstBuffer *b;
+	gboolean active;
+
+	if (!media->capture)
+		return;
+	if (!media->capture_motion) {
+		media_capture_write(media, buffer);
+		return;
+	}
+
+	GST_HTTP_MEDIA_LOCK (media);
+	active = media->motion || (media->motion_seen &&
+		g_get_monotonic_time() - media->motion_seen < media->capture_postroll);
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	if (active) {
+		while ((b = g_queue_pop_head(media->capture_ring))) {
+			media_capture_write(media, b);
+			gst_buffer_unref(b);
+		}
+		media_capture_write(media, buffer);
+	} else if (media->capture_preroll) {
+		g_queue_push_tail(media->capture_ring, gst_buffer_ref(buffer));
+		if (g_queue_get_length(media->capture_ring) > media->capture_preroll)
+			gst_buffer_unref(g_queue_pop_head(media->capture_ring));
+	}
+}
+
+/** media_stream_cache - keep what a joining client needs to start decoding
+ * (call with media lock held)
+ *
+ * The muxer's stream header (PAT/PMT) comes from the caps; the buffers
+ * since the start of the last keyframe are cached, bounded by
+ * MAX_GOP_BYTES.  Every buffer of a keyframe is a non-delta unit, so a new
+ * group starts at the first non-delta buffer following a delta buffer.
+ */
+static void
+media_stream_cache(GstHTTPMedia *media, GstBuffer *buffer)
+{
+	gboolean delta = GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	GstCaps *caps;
+
+	if (!media->streamheader && (caps = gst_buffer_get_caps(buffer))) {
+		const GValue *hdr = gst_structure_get_value(
+			gst_caps_get_structure(caps, 0), "streamheader");
+		guint i;
+
+		if (hdr && GST_VALUE_HOLDS_ARRAY(hdr)) {
+			for (i = 0; i < gst_value_array_get_size(hdr); i++) {
+				GstBuffer *b = gst_value_get_buffer(
+					gst_value_array_get_value(hdr, i));
+				media->streamheader = g_list_append(media->streamheader,
+					gst_buffer_ref(b));
+			}
+		}
+		gst_caps_unref(caps);
+	}
+	if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_IN_CAPS))
+		return;
+
+	if (!delta && (g_queue_is_empty(media->gop) || GST_BUFFER_FLAG_IS_SET(
+	               g_queue_peek_tail(media->gop), GST_BUFFER_FLAG_DELTA_UNIT)))
+	{
+		media_stream_flush(media->gop);
+		media->gop_bytes = 0;
+	} else if (g_queue_is_empty(media->gop)) {
+		return; // no keyframe seen yet
+	}
+
+	if (media->gop_bytes + buffer->size > MAX_GOP_BYTES) {
+		GST_WARNING ("%s: keyframe group over %d bytes, not cached",
+			media->path, MAX_GOP_BYTES);
+		flightrec_log(FR_FRAME_DROPPED, media->path, 0, media->gop_bytes);
+		media_stream_flush(media->gop);
+		media->gop_bytes = 0;
+		return;
+	}
+	g_queue_push_tail(media->gop, gst_buffer_ref(buffer));
+	media->gop_bytes += buffer->size;
+}
+
+/** media_client_dead - stop writing to a client whose send failed
+ * (call with media lock held)
+ *
+ * The socket is shut down, not closed: the main loop sees the hangup and
+ * removes the client, and the fd cannot be reused before that.
+ */
+static void
+media_client_dead(GstHTTPClient *c)
+{
+	if (c->dead)
+		return;
+	c->dead = TRUE;
+	shutdown(c->sock, SHUT_RDWR);
+}
+
+/** media_client_send - write stream data to a client
+ * @param nbufs - buffers in data (for the frame counters)
+ */
+static gboolean
+media_client_send(GstHTTPClient *c, const guchar *data, gsize size,
+	guint nbufs)
+{
+	gint ret;
+
+	rate_add(&c->rate_bytes, size);
+	metric_add(&c->metrics.frames, nbufs);
+	if (c->media)
+		metric_add(&c->media->metrics.out.frames, nbufs);
+	TRACE_SEND_START(c->sock, c->media ? c->media->path : NULL, size);
+	ret = gst_http_client_writechunk(c, (const char *) data, size);
+	TRACE_SEND_END(c->sock, c->media ? c->media->path : NULL, ret);
+	return ret >= 0;
+}
+
+/*
+ * stream catch-up: a joining client gets the stream header and the cached
+ * keyframe group (up to MAX_GOP_BYTES) from its own thread, coalesced into
+ * CATCHUP_CHUNK writes.  Live buffers for the client are queued behind it
+ * until the thread has drained the queue; only then does the streaming
+ * thread write to the client itself.
+ */
+typedef struct _MediaCatchUp {
+	GstHTTPMedia  *media;
+	GstHTTPClient *client;
+	GQueue        *queue;         // buffers still to send
+	gsize          bytes;
+	gboolean       cancelled;     // client re-parked or removed
+} MediaCatchUp;
+
+/* take up to CATCHUP_CHUNK bytes of queued buffers (media lock held) */
+static GList *
+media_catchup_take(MediaCatchUp *cu, gsize *size)
+{
+	GList *bufs = NULL;
+	GstBuffer *b;
+
+	*size = 0;
+	while ((b = g_queue_peek_head(cu->queue)) &&
+	       (!bufs || *size + b->size <= CATCHUP_CHUNK)) {
+		bufs = g_list_prepend(bufs, g_queue_pop_head(cu->queue));
+		*size += b->size;
+		cu->bytes -= b->size;
+	}
+	return g_list_reverse(bufs);
+}
+
+static gpointer
+media_catchup_thread(gpointer data)
+{
+	MediaCatchUp *cu = (MediaCatchUp *) data;
+	GstHTTPMedia *media = cu->media;
+	GstHTTPClient *c = cu->client;
+	guchar *chunk = g_malloc(CATCHUP_CHUNK);
+	GList *bufs, *walk;
+	gboolean ok = TRUE;
+	gsize size, off;
+
+	cpustat_thread_register(media->path, "catch-up");
+	for (;;) {
+		GST_HTTP_MEDIA_LOCK (media);
+		if (!ok)
+			media_client_dead(c);
+		if (!ok || cu->cancelled || c->dead ||
+		    !g_list_find(media->clients, c)) {
+			c->catchup = NULL;
+			GST_HTTP_MEDIA_UNLOCK (media);
+			break;
+		}
+		bufs = media_catchup_take(cu, &size);
+		if (!bufs) {
+			/* drained under the lock: live buffers go straight out now */
+			c->catchup = NULL;
+			c->synced = TRUE;
+			GST_HTTP_MEDIA_UNLOCK (media);
+			break;
+		}
+		GST_HTTP_MEDIA_UNLOCK (media);
+
+		if (!bufs->next) {
+			GstBuffer *b = (GstBuffer *) bufs->data;
+			ok = media_client_send(c, b->data, b->size, 1);
+		} else {
+			for (off = 0, walk = bufs; walk; walk = g_list_next (walk)) {
+				GstBuffer *b = (GstBuffer *) walk->data;
+				memcpy(chunk + off, b->data, b->size);
+				off += b->size;
+			}
+			ok = media_client_send(c, chunk, size, g_list_length(bufs));
+		}
+		g_list_foreach(bufs, (GFunc) gst_buffer_unref, NULL);
+		g_list_free(bufs);
+	}
+
+	media_stream_flush(cu->queue);
+	g_queue_free(cu->queue);
+	g_free(chunk);
+	g_object_unref(c);
+	g_object_unref(media);
+	g_free(cu);
+	return NULL;
+}
+
+/** media_catchup_start - queue header and keyframe group for a client
+ * (call with media lock held)
+ */
+static void
+media_catchup_start(GstHTTPMedia *media, GstHTTPClient *c)
+{
+	MediaCatchUp *cu = g_new0(MediaCatchUp, 1);
+	GList *b;
+
+	GST_DEBUG ("%s: starting %s:%d with %" G_GSIZE_FORMAT " cached bytes",
+		media->path, c->peer_ip, c->port, media->gop_bytes);
+	cu->media = g_object_ref(media);
+	cu->client = g_object_ref(c);
+	cu->queue = g_queue_new();
+	for (b = media->streamheader; b; b = g_list_next (b)) {
+		g_queue_push_tail(cu->queue, gst_buffer_ref(b->data));
+		cu->bytes += GST_BUFFER_SIZE (b->data);
+	}
+	for (b = media->gop->head; b; b = g_list_next (b)) {
+		g_queue_push_tail(cu->queue, gst_buffer_ref(b->data));
+		cu->bytes += GST_BUFFER_SIZE (b->data);
+	}
+	c->catchup = cu;
+	g_thread_create(media_catchup_thread, cu, FALSE, NULL);
+}
+
+/** media_client_unsync - make a stream client start over with the header
+ * and keyframe group of the next stream (call with media lock held)
+ */
+static void
+media_client_unsync(GstHTTPClient *c)
+{
+	c->synced = FALSE;
+	if (c->catchup)
+		c->catchup->cancelled = TRUE;
+}
+
+/** media_push_stream - send a byte stream buffer to the clients
+ * (call with media lock held)
+ *
+ * A client that has not started yet gets the stream header and the cached
+ * keyframe group (which ends with @buffer) first from a catch-up thread;
+ * until a keyframe has been seen it gets nothing.  A client whose send
+ * failed is skipped until the main loop removes it.
+ */
+static void
+media_push_stream(GstHTTPMedia *media, GstBuffer *buffer)
+{
+	GList *walk;
+
+	media_stream_cache(media, buffer);
+	if (media->hls)
+		hls_push(media->hls, media->streamheader, buffer);
+
+	for (walk = media->clients; walk; walk = g_list_next (walk)) {
+		GstHTTPClient *c = (GstHTTPClient *) walk->data;
+		MediaCatchUp *cu = c->catchup;
+
+		if (c->dead || (cu && cu->cancelled))
+			continue;
+		if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_IN_CAPS))
+			continue;
+		if (cu) {
+			/* behind the catch-up: a client that cannot keep up goes */
+			if (cu->bytes + buffer->size > 2 * MAX_GOP_BYTES) {
+				GST_WARNING ("%s: %s:%d not catching up, dropping",
+					media->path, c->peer_ip, c->port);
+				media_client_dead(c);
+				continue;
+			}
+			g_queue_push_tail(cu->queue, gst_buffer_ref(buffer));
+			cu->bytes += buffer->size;
+			continue;
+		}
+		if (!c->synced) {
+			if (!g_queue_is_empty(media->gop))
+				media_catchup_start(media, c);
+			continue;
+		}
+		if (!media_client_send(c, buffer->data, buffer->size, 1))
+			media_client_dead(c);
+	}
+}
+
+/** gst_buffer_available - callback when frame buffer available to sink
+ * @param elt - target element
+ * @param media - media media
+ *
+ * Called when the Media has a frame available for the clients
+ */
+static GstFlowReturn
+gst_buffer_available(GstAppSink * sink, gpointer user_data)
+{
+	GstBuffer *buffer;
+	GstHTTPMedia *media;
+	MediaFrameSig sig;
+	gint64 captured;
+
+	/* get the buffer from appsink */
+	buffer = gst_app_sink_pull_buffer (sink);
+	if (!buffer)
+		return GST_FLOW_OK;
+
+ 	media = (GstHTTPMedia *) user_data;
+
+	GST_DEBUG ("%s frame available: %d bytes", media->path, buffer->size);
+
+	metric_inc(&media->metrics.frames_in);
+	TRACE_FRAME(media->path, buffer->size, GST_BUFFER_TIMESTAMP (buffer));
+
+	/* first frame: release clients parked while the pipeline started */
+	GST_HTTP_MEDIA_LOCK (media);
+	media->last_buffer = g_get_monotonic_time();
+	if (media->pending) {
+		GST_INFO ("%s: releasing %d pending clients", media->path,
+			g_list_length(media->pending));
+		media->clients = g_list_concat(media->clients, media->pending);
+		media->pending = NULL;
+		media_force_frames(media);
+	}
+	if (media->state == GST_HTTP_MEDIA_STATE_STARTING) {
+		media_set_state(media, GST_HTTP_MEDIA_STATE_PLAYING);
+		media->playing_since = g_get_monotonic_time();
+	}
+	if (media->failures &&
+	    g_get_monotonic_time() - media->playing_since > MEDIA_STABLE_TIME)
+	{
+		GST_INFO ("%s: recovered after %u failures", media->path,
+			media->failures);
+		media->failures = 0;
+	}
+	if (GST_HTTP_MEDIA_IS_TS(media)) {
+		media_push_stream(media, buffer);
+		GST_HTTP_MEDIA_UNLOCK (media);
+		gst_buffer_unref(buffer);
+		return GST_FLOW_OK;
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	/* get width/height of stream */
+	if (0 == media->width) {
+		GstCaps *caps = gst_buffer_get_caps(buffer);
+		const GstStructure *str = gst_caps_get_structure (caps, 0);
+		if (!gst_structure_get_int (str, "width", (int*)&media->width) ||
+		    !gst_structure_get_int (str, "height", (int*)&media->height)) {
+			GST_ERROR("No width/height available");
+		}
+		if (!gst_structure_get_fraction (str, "framerate", &media->fps_n,
+		                                 &media->fps_d))
+			media->fps_n = media->fps_d = 0;
+		GST_INFO("framesize=%dx%d", media->width, media->height);
+	}
+
+	if (media_over_budget(media, GST_ELEMENT(sink), buffer)) {
+		gst_buffer_unref(buffer);
+		return GST_FLOW_OK;
+	}
+
+	captured = media_frame_captured(GST_ELEMENT(sink), buffer);
+	media_frame_sign_stream(media, NULL, buffer, &sig);
+
+	GST_HTTP_MEDIA_LOCK (media);
+	if (media->last_frame)
+		gst_buffer_unref(media->last_frame);
+	media->last_frame = gst_buffer_ref(buffer);
+	media->frame_captured = captured;
+	media_push_buffer(media, NULL, buffer, &sig);
+	media_record_latency(media, GST_ELEMENT(sink), buffer);
+	media_motion_feed(media, buffer);
+	if (media->timeshift)
+		timeshift_push(media->timeshift, buffer->data, buffer->size,
+			g_get_monotonic_time());
+	GST_HTTP_MEDIA_UNLOCK (media);
+	transcode_free(sig.thumb);
+
+	/* variants waiting on the native size, DCT-domain variants */
+	media_transcode_frames(media, GST_ELEMENT(sink), buffer, captured);
+
+	media_capture(media, buffer);
+	if (media->recorder)
+		recorder_push(media->recorder, buffer);
+
+	/* we don't need the buffer anymore */
+	gst_buffer_unref(buffer);
+
+	return GST_FLOW_OK;
+}
+
+/** gst_variant_buffer_available - callback when a variant branch has a frame
+ * @param elt - variant appsink
+ * @param variant - the #GstHTTPMediaVariant
+ */
+static GstFlowReturn
+gst_variant_buffer_available(GstAppSink * sink, gpointer user_data)
+{
+	GstHTTPMediaVariant *variant = (GstHTTPMediaVariant *) user_data;
+	GstBuffer *buffer;
+	MediaFrameSig sig;
+	gint64 captured;
+
+	buffer = gst_app_sink_pull_buffer (sink);
+	if (!buffer)
+		return GST_FLOW_OK;
+
+	GST_DEBUG ("%s %dx%d q%d frame available: %d bytes",
+		variant->media->path, variant->width, variant->height,
+		variant->quality, buffer->size);
+
+	if (media_over_budget(variant->media, GST_ELEMENT(sink), buffer)) {
+		gst_buffer_unref(buffer);
+		return GST_FLOW_OK;
+	}
+
+	captured = media_frame_captured(GST_ELEMENT(sink), buffer);
+	media_frame_sign_stream(variant->media, variant, buffer, &sig);
+
+	GST_HTTP_MEDIA_LOCK (variant->media);
+	variant->media->frame_captured = captured;
+	media_push_buffer(variant->media, variant, buffer, &sig);
+	media_record_latency(variant->media, GST_ELEMENT(sink), buffer);
+	GST_HTTP_MEDIA_UNLOCK (variant->media);
+	transcode_free(sig.thumb);
+	gst_buffer_unref(buffer);
+
+	return GST_FLOW_OK;
+}
+
+/** media_variant_link - build a variant branch and attach it to the tee
+ * (runs on the media worker thread)
+ */
+static void
+media_variant_link (GstHTTPMedia *media, GstHTTPMediaVariant *v)
+{
+	GstElement *tee, *sink;
+	GstPad *pad;
+	GString *desc;
+	GError *err = NULL;
+
+	if (!media->pipeline || v->bin || v->mode != GST_HTTP_VARIANT_BRANCH)
+		return;
+
+	desc = g_string_new(media->leaky ? LEAKY_QUEUE " ! jpegdec" :
+		"queue ! jpegdec");
+	if (v->width || v->height) {
+		g_string_append(desc, " ! videoscale ! video/x-raw-yuv");
+		if (v->width)
+			g_string_append_printf(desc, ",width=%d", v->width);
+		if (v->height)
+			g_string_append_printf(desc, ",height=%d", v->height);
+	}
+	g_string_append(desc, " ! jpegenc");
+	if (v->quality)
+		g_string_append_printf(desc, " quality=%d", v->quality);
+	g_string_append(desc, " ! appsink name=sink");
+
+	GST_INFO ("%s: adding variant branch '%s'", media->path, desc->str);
+	v->bin = gst_parse_bin_from_description(desc->str, TRUE, &err);
+	if (!v->bin) {
+		GST_ERROR ("Failed to create variant '%s':%s", desc->str,
+			err ? err->message : "unknown error");
+		if (err)
+			g_error_free(err);
+		g_string_free(desc, TRUE);
+		return;
+	}
+	if (err)
+		g_error_free(err);
+	g_string_free(desc, TRUE);
+
+	sink = gst_bin_get_by_name (GST_BIN(v->bin), "sink");
+	media_configure_sink(media, sink);
+	g_signal_connect (sink, "new-buffer",
+		G_CALLBACK(gst_variant_buffer_available), v);
+	gst_object_unref(sink);
+
+	gst_bin_add (GST_BIN(media->pipeline), v->bin);
+	tee = gst_bin_get_by_name (GST_BIN(media->pipeline), "tee");
+	v->teepad = gst_element_get_request_pad (tee, "src%d");
+	pad = gst_element_get_static_pad (v->bin, "sink");
+	if (gst_pad_link (v->teepad, pad) != GST_PAD_LINK_OK)
+		GST_ERROR ("%s: failed to link variant branch", media->path);
+	gst_object_unref(pad);
+	gst_object_unref(tee);
+
+	gst_element_sync_state_with_parent (v->bin);
+}
+
+/** media_variant_unlink - detach and destroy a variant branch
+ * (runs on the media worker thread)
+ */
+static void
+media_variant_unlink (GstHTTPMedia *media, GstHTTPMediaVariant *v)
+{
+	GstElement *tee;
+	GstPad *pad;
+
+	if (!media->pipeline || !v->bin)
+		return;
+
+	GST_INFO ("%s: removing %dx%d q%d variant branch", media->path,
+		v->width, v->height, v->quality);
+
+	tee = gst_bin_get_by_name (GST_BIN(media->pipeline), "tee");
+	pad = gst_element_get_static_pad (v->bin, "sink");
+	gst_pad_unlink (v->teepad, pad);
+	gst_object_unref(pad);
+	gst_element_release_request_pad (tee, v->teepad);
+	gst_object_unref(v->teepad);
+	gst_object_unref(tee);
+
+	/* stops the branch streaming thread: no more callbacks after this */
+	gst_element_set_state (v->bin, GST_STATE_NULL);
+	gst_bin_remove (GST_BIN(media->pipeline), v->bin);
+	v->bin = NULL;
+	v->teepad = NULL;
+}
+
+/** media_variant_acquire - find or create the variant for a parameter set
+ * (call with media lock held)
+ */
+static GstHTTPMediaVariant *
+media_variant_acquire (GstHTTPMedia *media, gint width, gint height,
+	gint quality)
+{
+	GstHTTPMediaVariant *v;
+	GList *walk;
+
+	for (walk = media->variants; walk; walk = g_list_next (walk)) {
+		v = (GstHTTPMediaVariant *) walk->data;
+		if (v->width == width && v->height == height && v->quality == quality) {
+			v->refcount++;
+			return v;
+		}
+	}
+
+	if (g_list_length(media->variants) >= MAX_VARIANTS) {
+		GST_WARNING ("%s: too many variants, serving native stream",
+			media->path);
+		return NULL;
+	}
+
+	v = g_new0(GstHTTPMediaVariant, 1);
+	v->media = media;
+	v->width = width;
+	v->height = height;
+	v->quality = quality;
+	v->refcount = 1;
+	media->variants = g_list_append(media->variants, v);
+
+	/* otherwise resolved by the first frame; a pipeline being started
+	 * links all resolved branch variants on the list */
+	if (media->width)
+		media_variant_resolve(media, v);
+
+	return v;
+}
+
+/** media_variant_release - drop a client reference on a variant
+ * (call with media lock held)
+ */
+static void
+media_variant_release (GstHTTPMedia *media, GstHTTPMediaVariant *v)
+{
+	if (--v->refcount > 0)
+		return;
+
+	media->variants = g_list_remove(media->variants, v);
+	media_queue_job(media, MEDIA_JOB_UNLINK_VARIANT, v);
+}
+
+/**
+ * gst_http_media_create_pipeline:
+ * @media: a #GstHTTPMedia to play
+ 
+ * Build the gstreamer pipeline (runs on the media worker thread)
+ *
+ * Returns the new pipeline in NULL state or NULL on error
+ *
+ */
+static GstElement *
+gst_http_media_create_pipeline(GstHTTPMedia *media)
+{
+	GstElement *pipeline;
+	GstElement *sink;
+	gchar *src;
+	gchar *desc;
+	GError *err = NULL;
+
+	GST_INFO ("Creating new multipart/jpeg pipeline for '%s'", media->path);
+
+	if (!strchr(media->pipeline_desc, '!')) {
+		struct v4l2_fmtdesc fmt;
+		struct v4l2_frmsizeenum frmsize;
+		int i = 0;
+		int width, height;
+		int target_w, target_h;
+		char* dev = g_strdup("/dev/video0");
+		const char* mediafmt = NULL;
+		int fd;
+		gchar **elems;
+
+		i = 0;
+		elems = g_strsplit(media->pipeline_desc, " ", 0);
 		target_w = 640;
 		target_h = 480;
 		if (elems[0] && strncmp("/dev/video", elems[0], 10) == 0) {
@@ -536,7 +1934,7 @@ gst_http_media_create_pipeline(GstHTTPMedia *media)
 		if (-1 == fd) {
 			GST_ERROR ("Failed to open device:%s", dev);
 			g_free(dev);
-			return 2;
+			return NULL;
 		}
 
 		GST_DEBUG ("creating pipeline for '%s'", dev);
@@ -588,74 +1986,694 @@ gst_http_media_create_pipeline(GstHTTPMedia *media)
 			fmt.index++;
 		}
 		if (strcmp(mediafmt, "image/jpeg") == 0) {
-			desc = g_strdup_printf("v4l2src device=%s ! %s,width=%d,height=%d "
-				"! appsink name=sink",
+			src = g_strdup_printf("v4l2src device=%s ! %s,width=%d,height=%d",
 				dev, mediafmt, width, height);
 		} else {
-			desc = g_strdup_printf("v4l2src device=%s ! %s,width=%d,height=%d "
-				"! jpegenc ! appsink name=sink",
-				dev, mediafmt, width, height);
+			src = g_strdup_printf("v4l2src device=%s ! %s,width=%d,height=%d "
+				"! jpegenc", dev, mediafmt, width, height);
 		}
 		g_free(dev);
 	}
  	else 
-		desc = g_strdup_printf("%s ! appsink name=sink", media->pipeline_desc);
+		src = g_strdup(media->pipeline_desc);
+
+	/* byte stream: encode and mux the jpeg frames */
+	if (GST_HTTP_MEDIA_IS_TS(media)) {
+		gchar *enc = g_strdup_printf("%s ! %s ! mpegtsmux", src,
+			media->encoder ? media->encoder : DEFAULT_H264_ENCODER);
+		g_free(src);
+		src = enc;
+	}
 
-	/* install device event handler */
-	input_device_open(media);
+	/* in latency budget mode a leaky queue keeps only the newest frame */
+	desc = g_strdup_printf("%s ! tee name=tee ! %sappsink name=sink", src,
+		(media->leaky && !GST_HTTP_MEDIA_IS_TS(media)) ? LEAKY_QUEUE " ! " : "");
+	g_free(src);
 
 	GST_DEBUG ("launching pipeline '%s'", desc);
-	if (!(media->pipeline = gst_parse_launch(desc, &err))) {
+	if (!(pipeline = gst_parse_launch(desc, &err))) {
 		GST_ERROR ("Failed to create pipeline from '%s':%s",
-			desc, err->message);
-		return 1;
+			desc, err ? err->message : "unknown error");
+		if (err)
+			g_error_free(err);
+		g_free(desc);
+		return NULL;
 	}
-
-	// add bus callback
-	bus = gst_pipeline_get_bus(GST_PIPELINE(media->pipeline));
-	gst_bus_add_watch(bus, gst_bus_callback, media);
-	gst_object_unref(bus);
+	if (err) {
+		GST_WARNING ("Pipeline '%s': %s", desc, err->message);
+		g_error_free(err);
+	}
+	g_free(desc);
 
 	// attach signal to sink
-	sink = gst_bin_get_by_name (GST_BIN(media->pipeline), "sink");
-	//g_object_set (G_OBJECT (sink), "emit-signals", TRUE, "sync", FALSE, NULL);
-	g_object_set (G_OBJECT (sink), "emit-signals", TRUE, FALSE, NULL);
+	sink = gst_bin_get_by_name (GST_BIN(pipeline), "sink");
+	media_configure_sink(media, sink);
 	g_signal_connect (sink, "new-buffer",
 		G_CALLBACK(gst_buffer_available), media);
 	gst_object_unref(sink);
 
+	return pipeline;
+}
+
+/** media_client_set_level - move an adaptive client to a ladder step
+ * (call with media lock held)
+ *
+ * Frames are pushed under the media lock, so the client gets whole frames
+ * of the old stream up to here and of the new one from its next frame on,
+ * on the same connection.
+ *
+ * Returns FALSE if the variant for the step is not available
+ */
+static gboolean
+media_client_set_level(GstHTTPMedia *media, GstHTTPClient *c, guint level)
+{
+	struct client_adapt *a = &c->adapt;
+	GstHTTPMediaVariant *v = NULL;
+	gint width = a->width, height = a->height, quality = a->quality;
+	guint scale = 1 << level;
+
+	if (level) {
+		if (!width && !height) {
+			width = media->width;
+			height = media->height;
+		}
+		/* same rounding as the transcoder so native halvings use it */
+		width = width ? (width + scale - 1) / scale : 0;
+		height = height ? (height + scale - 1) / scale : 0;
+		if (media->adapt_quality &&
+		    (!quality || media->adapt_quality < quality))
+			quality = media->adapt_quality;
+	}
+	if (width || height || quality) {
+		v = media_variant_acquire(media, width, height, quality);
+		if (!v)
+			return FALSE;
+	}
+	if (c->variant)
+		media_variant_release(media, c->variant);
+	c->variant = v;
+	if (v)
+		v->filter.force = TRUE;
+	else
+		media->filter.force = TRUE;
+
+	GST_INFO ("%s: %s:%d adapt level %u -> %u (%dx%d q%d), %.0f bytes/s",
+		media->path, c->peer_ip, c->port, a->level, level, width, height,
+		quality, rate_get(&c->rate_bytes, 5));
+	flightrec_log(FR_ADAPT, c->peer_ip, level, rate_get(&c->rate_bytes, 5));
+	a->level = level;
+	a->stable = 0;
+	a->switched = g_get_monotonic_time();
+	a->switches++;
+
+	return TRUE;
+}
+
+/** media_client_adapt - pick the ladder step of an adaptive client
+ * (call with media lock held, once a second after the TCP sample)
+ */
+static void
+media_client_adapt(GstHTTPMedia *media, GstHTTPClient *c)
+{
+	struct client_adapt *a = &c->adapt;
+	struct client_tcp *t = &c->tcp;
+	gint64 now = g_get_monotonic_time();
+	gboolean trouble = t->congested || t->skipped != a->skipped;
+	gdouble capacity;
+
+	a->skipped = t->skipped;
+	if (!a->levels || !media->width || !t->sampled)
+		return;
+
+	if (trouble) {
+		a->stable = 0;
+		if (a->level >= a->levels ||
+		    now - a->switched < CLIENT_ADAPT_SETTLE * G_USEC_PER_SEC)
+			return;
+		/* the last step back did not hold: stay longer next time */
+		if (a->improved &&
+		    now - a->improved < 2 * a->hold * G_USEC_PER_SEC)
+			a->hold = MIN(a->hold * 2, CLIENT_ADAPT_HOLD_MAX);
+		media_client_set_level(media, c, a->level + 1);
+		return;
+	}
+
+	if (++a->stable > CLIENT_ADAPT_HOLD_MAX)
+		a->hold = CLIENT_ADAPT_HOLD;
+	if (!a->level || a->stable < a->hold)
+		return;
+	/* go back only with an idle socket and room for the larger frames */
+	capacity = t->rtt ? (gdouble) t->cwnd * t->mss * G_USEC_PER_SEC /
+		t->rtt : 0;
+	if (t->unsent > c->ewma_framesize ||
+	    (capacity && capacity < CLIENT_ADAPT_HEADROOM *
+	     rate_get(&c->rate_bytes, 5)))
+		return;
+	if (media_client_set_level(media, c, a->level - 1))
+		a->improved = now;
+}
+
+/** media_watchdog - detect a pipeline that stopped delivering frames
+ * (runs on the main loop, once a second while a pipeline exists)
+ *
+ * A PLAYING pipeline stalls after WATCHDOG_FRAMES frame intervals (as given
+ * by the caps framerate) without an appsink buffer, a STARTING one after
+ * WATCHDOG_STARTUP.  Stalls are handled like pipeline errors.  It also
+ * samples the TCP state of the clients and adapts their quality.
+ */
+static gboolean
+media_watchdog (gpointer data)
+{
+	GstHTTPMedia *media = (GstHTTPMedia *) data;
+	gint64 age, limit;
+	gboolean stalled = FALSE;
+	GList *walk;
+
+	GST_HTTP_MEDIA_LOCK (media);
+	if (media->state == GST_HTTP_MEDIA_STATE_STOPPED) {
+		media->watchdog = 0;
+		GST_HTTP_MEDIA_UNLOCK (media);
+		g_object_unref (media);
+		return FALSE;
+	}
+
+	/* congestion state for the delivery in media_push_buffer */
+	for (walk = media->clients; walk; walk = g_list_next (walk)) {
+		GstHTTPClient *c = (GstHTTPClient *) walk->data;
+
+		if (gst_http_client_sample_tcp(c) &&
+		    media->state == GST_HTTP_MEDIA_STATE_PLAYING)
+			media_client_adapt(media, c);
+	}
+
+	age = g_get_monotonic_time() - media->last_buffer;
+	if (media->state == GST_HTTP_MEDIA_STATE_STARTING)
+		limit = WATCHDOG_STARTUP;
+	else if (media->fps_n > 0 && media->fps_d > 0)
+		limit = MAX(WATCHDOG_MIN, WATCHDOG_FRAMES * G_USEC_PER_SEC *
+			(gint64) media->fps_d / media->fps_n);
+	else
+		limit = WATCHDOG_DEFAULT;
+
+	if ((media->state == GST_HTTP_MEDIA_STATE_STARTING ||
+	     media->state == GST_HTTP_MEDIA_STATE_PLAYING) &&
+	    media->pipeline && age > limit)
+	{
+		gchar *reason = g_strdup_printf("stalled: no frames for %.1fs",
+			age / 1e6);
+
+		media->stalls++;
+		media->stall_time += age;
+		flightrec_log(FR_STALL, media->path, media->stalls, age);
+		media->last_stall = age;
+		media_recover(media, reason);
+		g_free(reason);
+		stalled = TRUE;
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	if (stalled)
+		events_publish("stall", media->path, "\"seconds\": %.1f, "
+			"\"stalls\": %u", age / 1e6, media->stalls);
+	return TRUE;
+}
+
+/** media_start - build the pipeline and set it playing
+ * (runs on the media worker thread)
+ *
+ * Clients stay on the pending list until the first frame arrives
+ */
+static void
+media_start (GstHTTPMedia *media)
+{
+	GstElement *pipeline;
+	GstBus *bus;
+	GList *variants, *walk;
+
+	GST_HTTP_MEDIA_LOCK (media);
+	if (media->pipeline || media->state != GST_HTTP_MEDIA_STATE_STARTING) {
+		/* reusing a pipeline that was not torn down yet, or cancelled */
+		GST_HTTP_MEDIA_UNLOCK (media);
+		return;
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	GST_INFO ("%s: starting pipeline", media->path);
+	pipeline = gst_http_media_create_pipeline(media);
+	if (!pipeline) {
+		MediaStartFailure *f;
+
+		GST_HTTP_MEDIA_LOCK (media);
+		/* a device that went away may take a few attempts to come back;
+		 * held media also retry a failed first start (camera not ready) */
+		if ((media->failures || media->hold) &&
+		    media->state == GST_HTTP_MEDIA_STATE_STARTING) {
+			media_recover(media, "failed to start pipeline");
+			GST_HTTP_MEDIA_UNLOCK (media);
+			return;
+		}
+		metric_inc(&media->metrics.errors);
+		f = g_new0(MediaStartFailure, 1);
+		f->media = g_object_ref(media);
+		f->clients = media->pending;
+		f->msg = g_strdup("failed to start pipeline");
+		media->pending = NULL;
+		media_release_variants(media, f->clients);
+		if (!media->clients)
+			media_set_state(media, GST_HTTP_MEDIA_STATE_STOPPED);
+		GST_HTTP_MEDIA_UNLOCK (media);
+
+		g_idle_add(media_start_failed, f);
+		return;
+	}
+
+	/* install device event handler */
+	media_input_open(media);
+
+	if (media->motion_threshold && !media->motion_worker) {
+		media->motion_worker = g_thread_pool_new(media_motion_worker, media,
+			1, FALSE, NULL);
+	}
+
+	// add bus callback (dispatched from the main loop)
+	bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+	GST_HTTP_MEDIA_LOCK (media);
+	media->pipeline = pipeline;
+	media->bus_watch = gst_bus_add_watch(bus, gst_bus_callback, media);
+	gst_bus_set_sync_handler(bus, gst_bus_sync_callback, media);
+	variants = g_list_copy(media->variants);
+	GST_HTTP_MEDIA_UNLOCK (media);
+	gst_object_unref(bus);
+
+	/* variants requested before the pipeline existed; only this thread
+	 * frees variants so the copied list stays valid */
+	for (walk = variants; walk; walk = g_list_next (walk))
+		media_variant_link(media, (GstHTTPMediaVariant *) walk->data);
+	g_list_free(variants);
+
+	GST_HTTP_MEDIA_LOCK (media);
+	media->last_buffer = g_get_monotonic_time();
+	if (!media->watchdog)
+		media->watchdog = g_timeout_add_seconds (1, media_watchdog,
+			g_object_ref (media));
+	GST_HTTP_MEDIA_UNLOCK (media);
+
 	// set pipeline to playing state
-	gst_element_set_state (media->pipeline, GST_STATE_PLAYING);
+	metric_inc(&media->metrics.starts);
+	gst_element_set_state (pipeline, GST_STATE_PLAYING);
 	media->starttime = time(NULL);
+}
 
-	g_free(desc);
-	return 0;
+/** media_teardown - stop and destroy the pipeline
+ * (runs on the media worker thread)
+ */
+static void
+media_teardown (GstHTTPMedia *media)
+{
+	GstElement *pipeline;
+	GstBuffer *b;
+	GList *walk;
+	gboolean motion_ended = FALSE;
+	guint watch;
+
+	GST_HTTP_MEDIA_LOCK (media);
+	if (media->state != GST_HTTP_MEDIA_STATE_STOPPING &&
+	    media->state != GST_HTTP_MEDIA_STATE_RESTARTING) {
+		/* a client arrived since the stop was queued: keep the pipeline */
+		GST_HTTP_MEDIA_UNLOCK (media);
+		return;
+	}
+	pipeline = media->pipeline;
+	watch = media->bus_watch;
+	media->pipeline = NULL;
+	media->bus_watch = 0;
+	/* branches go down with the pipeline, relinked by the next start */
+	for (walk = media->variants; walk; walk = g_list_next (walk)) {
+		GstHTTPMediaVariant *v = (GstHTTPMediaVariant *) walk->data;
+
+		if (v->teepad)
+			gst_object_unref(v->teepad);
+		v->bin = NULL;
+		v->teepad = NULL;
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	if (pipeline) {
+		GST_DEBUG_OBJECT (media, "Shutting down pipeline for %s", media->path);
+		if (watch)
+			g_source_remove(watch);
+		// set pipeline to NULL state
+		gst_element_set_state (pipeline, GST_STATE_NULL);
+		gst_object_unref (pipeline);
+		media_input_close(media);
+
+		/* no streaming thread left touching the pre-roll */
+		while ((b = g_queue_pop_head(media->capture_ring)))
+			gst_buffer_unref(b);
+	}
+
+	GST_HTTP_MEDIA_LOCK (media);
+	media_stream_clear(&media->streamheader);
+	media_stream_flush(media->gop);
+	media->gop_bytes = 0;
+	/* the next start may negotiate other caps: read them again and decide
+	 * again how each variant is generated */
+	media->width = media->height = 0;
+	media->fps_n = media->fps_d = 0;
+	for (walk = media->variants; walk; walk = g_list_next (walk)) {
+		GstHTTPMediaVariant *v = (GstHTTPMediaVariant *) walk->data;
+
+		v->mode = GST_HTTP_VARIANT_UNRESOLVED;
+		v->failures = 0;
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+	if (media->hls)
+		hls_reset(media->hls);
+
+	GST_HTTP_MEDIA_LOCK (media);
+	if (media->state == GST_HTTP_MEDIA_STATE_STOPPING) {
+		media_set_state(media, GST_HTTP_MEDIA_STATE_STOPPED);
+		media->ev_press = 0;
+		media->starttime = 0;
+		motion_ended = media->motion;
+		media->motion = FALSE;
+		media->motion_seen = 0;
+		if (media->last_frame) {
+			gst_buffer_unref(media->last_frame);
+			media->last_frame = NULL;
+		}
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	if (motion_ended)
+		media_motion_publish(media, FALSE, 0);
+}
+
+static void
+media_worker (gpointer data, gpointer user_data)
+{
+	MediaJob *job = (MediaJob *) data;
+	GstHTTPMedia *media = (GstHTTPMedia *) user_data;
+	gboolean listed;
+
+	cpustat_thread_register(media->path, "worker");
+	switch (job->type) {
+		case MEDIA_JOB_START:
+			media_start(media);
+			break;
+		case MEDIA_JOB_STOP:
+			media_teardown(media);
+			break;
+		case MEDIA_JOB_LINK_VARIANT:
+			GST_HTTP_MEDIA_LOCK (media);
+			listed = g_list_find(media->variants, job->variant) != NULL;
+			GST_HTTP_MEDIA_UNLOCK (media);
+			/* an unlink job follows if the variant was already released */
+			if (listed)
+				media_variant_link(media, job->variant);
+			break;
+		case MEDIA_JOB_UNLINK_VARIANT:
+			media_variant_unlink(media, job->variant);
+			transcode_free(job->variant->filter.thumb);
+			g_free(job->variant);
+			break;
+	}
+	g_free(job);
+}
+
+/** media_queue_job - queue a job for the media worker thread
+ * (call with media lock held)
+ */
+static void
+media_queue_job (GstHTTPMedia *media, MediaJobType type,
+	GstHTTPMediaVariant *variant)
+{
+	MediaJob *job = g_new0(MediaJob, 1);
+
+	job->type = type;
+	job->variant = variant;
+	g_thread_pool_push(media->worker, job, NULL);
+}
+
+/** media_set_state - change the media state and publish it
+ * (call with media lock held)
+ */
+static void
+media_set_state (GstHTTPMedia *media, GstHTTPMediaState state)
+{
+	if (media->state == state)
+		return;
+	TRACE_STATE(media->path, media->state, state);
+	flightrec_log(FR_STATE, media->path, media->state, state);
+	media->state = state;
+	events_publish("state", media->path, "\"state\": \"%s\"",
+		gst_http_media_state_name(state));
+}
+
+/**
+ * gst_http_media_state_name:
+ * @state: a #GstHTTPMediaState
+ *
+ * Returns: a static string describing @state
+ */
+const gchar *
+gst_http_media_state_name (GstHTTPMediaState state)
+{
+	switch (state) {
+		case GST_HTTP_MEDIA_STATE_STOPPED:  return "Stopped";
+		case GST_HTTP_MEDIA_STATE_STARTING: return "Starting";
+		case GST_HTTP_MEDIA_STATE_PLAYING:  return "Playing";
+		case GST_HTTP_MEDIA_STATE_STOPPING: return "Stopping";
+		case GST_HTTP_MEDIA_STATE_RESTARTING: return "Restarting";
+	}
+	return "Unknown";
+}
+
+/** query_int - integer value of a query field (0 if not present)
+ */
+static gint
+query_int (MediaURL *url, const char *name)
+{
+	gchar *str = get_query_field(url, name);
+	gint val = 0;
+
+	if (str) {
+		val = atoi(str);
+		g_free(str);
+	}
+	return val;
+}
+
+/** query_offset - parse a relative time query field (ie -10s, -500ms, -2m)
+ * Returns usec, 0 if not present
+ */
+static gint64
+query_offset (MediaURL *url, const char *name)
+{
+	gchar *str = get_query_field(url, name);
+	gchar *end;
+	gdouble val;
+
+	if (!str)
+		return 0;
+	val = g_ascii_strtod(str, &end);
+	if (strcmp(end, "ms") == 0)
+		val *= 1000;
+	else if (*end == 'm')
+		val *= 60 * G_USEC_PER_SEC;
+	else
+		val *= G_USEC_PER_SEC;
+	g_free(str);
+
+	return (gint64) val;
+}
+
+/** media_replay_tick - send the due timeshift frames to the replay clients
+ * (main loop timer, one per media)
+ *
+ * Each playback position advances at the catch-up speed; only the newest
+ * due frame is sent.  Once a client has been sent the newest frame in the
+ * ring it moves to the live client list.  Frames are sent from the ring
+ * under the media lock like live frames: media_send_frame skips clients
+ * whose socket could not take them without blocking.
+ */
+static gboolean
+media_replay_tick (gpointer data)
+{
+	GstHTTPMedia *media = (GstHTTPMedia *) data;
+	GstHTTPTimeshift *ts = media->timeshift;
+	gint64 now = g_get_monotonic_time();
+	GList *walk, *next;
+
+	GST_HTTP_MEDIA_LOCK (media);
+	for (walk = media->replay; walk; walk = next) {
+		GstHTTPClient *c = (GstHTTPClient *) walk->data;
+		const GstHTTPTimeshiftFrame *f, *due = NULL;
+
+		next = g_list_next (walk);
+		if (!c->replaying)
+			continue; // send failed, waiting for the main loop to stop it
+		c->replay_clock += (now - c->replay_wall) * media->catchup;
+		c->replay_wall = now;
+		if (c->replay_seq < timeshift_oldest(ts))
+			c->replay_seq = timeshift_oldest(ts); // fell out of the ring
+
+		if (c->replay_seq >= ts->next_seq) {
+			GST_INFO ("%s: replay client %s:%d reached live", media->path,
+				c->peer_ip, c->port);
+			media->replay = g_list_delete_link(media->replay, walk);
+			media->clients = g_list_append(media->clients, c);
+			media->filter.force = TRUE;
+			c->replaying = FALSE;
+			continue;
+		}
+
+		while ((f = timeshift_get(ts, c->replay_seq)) &&
+		       f->ts <= c->replay_clock) {
+			due = f;
+			c->replay_seq++;
+		}
+		if (due && !media_send_frame(media, c, timeshift_data(ts, due),
+		                             due->size, 0))
+			c->replaying = FALSE;
+	}
+	if (!media->replay) {
+		media->replay_timer = 0;
+		GST_HTTP_MEDIA_UNLOCK (media);
+		return FALSE;
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	return TRUE;
 }
 
+/** media_replay_start - play a client from the timeshift ring
+ * (call with media lock held, from the main loop)
+ */
+static void
+media_replay_start (GstHTTPMedia *media, GstHTTPClient *client, guint64 seq)
+{
+	const GstHTTPTimeshiftFrame *f = timeshift_get(media->timeshift, seq);
+
+	GST_INFO ("%s: replaying %.1fs for %s:%d", media->path,
+		(g_get_monotonic_time() - f->ts) / 1e6, client->peer_ip, client->port);
+	client->replay_seq = seq;
+	client->replay_clock = f->ts;
+	client->replay_wall = g_get_monotonic_time();
+	client->replaying = TRUE;
+	media->replay = g_list_append(media->replay, client);
+	if (!media->replay_timer)
+		media->replay_timer = g_timeout_add(REPLAY_TICK_MS, media_replay_tick,
+			media);
+}
 
 /**
  * gst_http_media_play:
  * @media: a #GstHTTPMedia to play
  * @client: Client to stream to
- * Launch the gstreamer pipeline
+ * @url: requested url; w=, h= and q= query fields select a scaled and/or
+ *   re-encoded variant of the stream shared with other clients asking for
+ *   the same parameters; from=-<time> starts playback that far in the past
+ *   when the media keeps a timeshift ring; adapt=0|1 turns adaptive
+ *   quality off or on for this client
+ * Add @client to the stream, starting the gstreamer pipeline if needed
+ *
+ * The pipeline is started asynchronously; @client is parked on the pending
+ * list until the first frame arrives or the start fails.  Clients arriving
+ * while a start is in progress share that start.
  *
  * Returns error code (0 = success) 
  */
 gint
-gst_http_media_play (GstHTTPMedia *media, GstHTTPClient *client)
+gst_http_media_play (GstHTTPMedia *media, GstHTTPClient *client,
+	MediaURL *url)
 {
-	if (!media->pipeline) {
-		if (gst_http_media_create_pipeline(media))
-			return 1;
+	gint width, height, quality;
+	gint64 from;
+	guint64 seq;
+	gchar *adapt;
+
+	if (!media->pipeline_desc || !media->worker)
+		return 1;
+
+	/* optional per-client scaling/quality: ?w=&h=&q= */
+	width = query_int(url, "w=");
+	height = query_int(url, "h=");
+	quality = query_int(url, "q=");
+	if (width < 0 || width > MAX_VARIANT_DIM ||
+	    height < 0 || height > MAX_VARIANT_DIM ||
+	    quality < 0 || quality > 100)
+		return 1;
+
+	from = query_offset(url, "from=");
+
+	/* adaptive quality: on with an 'adapt:' config line, ?adapt= overrides */
+	client->adapt.levels = media->adapt_levels;
+	if ((adapt = get_query_field(url, "adapt="))) {
+		if (atoi(adapt) == 0)
+			client->adapt.levels = 0;
+		else if (!client->adapt.levels)
+			client->adapt.levels = DEFAULT_ADAPT_LEVELS;
+		g_free(adapt);
 	}
+	client->adapt.levels = MIN(client->adapt.levels, MAX_ADAPT_LEVELS);
+	client->adapt.width = width;
+	client->adapt.height = height;
+	client->adapt.quality = quality;
+	client->adapt.hold = CLIENT_ADAPT_HOLD;
 
+	GST_HTTP_MEDIA_LOCK (media);
+	if (media->breaker_until &&
+	    g_get_monotonic_time() < media->breaker_until) {
+		GST_WARNING ("%s: refusing client, pipeline failing: %s", media->path,
+			media->last_error);
+		GST_HTTP_MEDIA_UNLOCK (media);
+		return 1;
+	}
 	g_object_ref(client);
 
-	// add client to client list of media
-	GST_INFO ("%s: Adding client to pipeline serving %d clients",
-		media->path, g_list_length(media->clients));
-	GST_HTTP_MEDIA_LOCK (media);
-	media->clients = g_list_append(media->clients, client);
+	/* ?from=-<time>: start from the timeshift ring */
+	if (from < 0 && media->timeshift &&
+	    media->state == GST_HTTP_MEDIA_STATE_PLAYING &&
+	    timeshift_seek(media->timeshift, g_get_monotonic_time() + from, &seq))
+	{
+		media_replay_start(media, client, seq);
+		GST_HTTP_MEDIA_UNLOCK (media);
+		return 0;
+	}
+	if (GST_HTTP_MEDIA_IS_TS(media))
+		client->adapt.levels = 0;
+	if ((width || height || quality) && GST_HTTP_MEDIA_IS_TS(media)) {
+		GST_WARNING ("%s: variants need a jpeg stream, serving native stream",
+			media->path);
+	} else if (width || height || quality) {
+		client->variant = media_variant_acquire(media, width, height, quality);
+	}
+	switch (media->state) {
+		case GST_HTTP_MEDIA_STATE_PLAYING:
+			// add client to client list of media
+			GST_INFO ("%s: Adding client to pipeline serving %d clients",
+				media->path, g_list_length(media->clients));
+			media->clients = g_list_append(media->clients, client);
+			/* new client should not wait for the scene to change */
+			if (client->variant)
+				client->variant->filter.force = TRUE;
+			else
+				media->filter.force = TRUE;
+			break;
+
+		case GST_HTTP_MEDIA_STATE_STOPPED:
+		case GST_HTTP_MEDIA_STATE_STOPPING:
+			media_set_state(media, GST_HTTP_MEDIA_STATE_STARTING);
+			media_queue_job(media, MEDIA_JOB_START, NULL);
+			/* fall through */
+		case GST_HTTP_MEDIA_STATE_STARTING:
+		case GST_HTTP_MEDIA_STATE_RESTARTING:
+			GST_INFO ("%s: client waiting on pipeline start (%d pending)",
+				media->path, g_list_length(media->pending));
+			media->pending = g_list_append(media->pending, client);
+			break;
+	}
 	GST_HTTP_MEDIA_UNLOCK (media);
 
 	return 0;
@@ -668,13 +2686,20 @@ gst_http_media_play (GstHTTPMedia *media, GstHTTPClient *client)
  
  * Stop the gstreamer pipeline (client=NULL for all clients)
  *
+ * The pipeline is torn down asynchronously once no clients remain.
+ *
  * Returns error code (0 = success) 
  *
  */
 gint
 gst_http_media_stop (GstHTTPMedia *media, GstHTTPClient *client)
 {
-	if (!media->pipeline) {
+	GList *removed = NULL;
+	GList *walk;
+
+	GST_HTTP_MEDIA_LOCK (media);
+	if (media->state == GST_HTTP_MEDIA_STATE_STOPPED) {
+		GST_HTTP_MEDIA_UNLOCK (media);
 		return -1;
 	}
 
@@ -683,45 +2708,115 @@ gst_http_media_stop (GstHTTPMedia *media, GstHTTPClient *client)
 	if (client) {
 		GList *found;
 
-		GST_HTTP_MEDIA_LOCK (media);
-		found = g_list_find(media->clients, client);
-		if (found)
-			media->clients = g_list_remove (media->clients, client);
-		GST_HTTP_MEDIA_UNLOCK (media);
-
-		if (found) {
-			gst_http_client_close(client, "stopping");
-			g_object_unref (client);
-		} else
+		if ((found = g_list_find(media->clients, client)))
+			media->clients = g_list_delete_link (media->clients, found);
+		else if ((found = g_list_find(media->pending, client)))
+			media->pending = g_list_delete_link (media->pending, found);
+		else if ((found = g_list_find(media->replay, client)))
+			media->replay = g_list_delete_link (media->replay, found);
+		if (!found) {
+			GST_HTTP_MEDIA_UNLOCK (media);
 			return -2;
+		}
+		removed = g_list_prepend(NULL, client);
 	}
 
 	// close all clients being served this stream
 	else {
-		GST_HTTP_MEDIA_LOCK (media);
-		while (g_list_length(media->clients))
-		{
-			GstHTTPClient *client = g_list_nth_data(media->clients, 0);
-
-			media->clients = g_list_remove (media->clients, client);
-			GST_DEBUG_OBJECT (media, "now managing %d clients",
-				g_list_length(media->clients));
-			g_object_unref (client);
+		removed = g_list_concat(media->clients, media->pending);
+		removed = g_list_concat(removed, media->replay);
+		media->clients = NULL;
+		media->pending = NULL;
+		media->replay = NULL;
+	}
+	for (walk = removed; walk; walk = g_list_next (walk)) {
+		GstHTTPClient *c = (GstHTTPClient *) walk->data;
+		c->replaying = FALSE;
+		if (c->variant) {
+			media_variant_release(media, c->variant);
+			c->variant = NULL;
 		}
-		GST_HTTP_MEDIA_UNLOCK (media);
 	}
-
-	// if no more clients shut down the pipeline
-	if (g_list_length(media->clients) == 0) {	
-		GST_DEBUG_OBJECT (media, "Shutting down pipeline for %s", media->path);
-		// set pipeline to NULL state
-		gst_element_set_state (media->pipeline, GST_STATE_NULL);
-		g_object_unref (media->pipeline);
-		input_device_close(media);
-		media->pipeline = NULL;
-		media->ev_press = 0;
-		media->starttime = 0;
+	if (!media->replay && media->replay_timer) {
+		g_source_remove(media->replay_timer);
+		media->replay_timer = 0;
 	}
+	GST_DEBUG_OBJECT (media, "now managing %d clients (%d pending)",
+		g_list_length(media->clients), g_list_length(media->pending));
+
+	// if no more clients (and not held) shut down the pipeline
+	if (!media->clients && !media->pending && !media->replay &&
+	    (!media->hold || !client) &&
+	    (media->state == GST_HTTP_MEDIA_STATE_STARTING ||
+	     media->state == GST_HTTP_MEDIA_STATE_PLAYING))
+	{
+		media_set_state(media, GST_HTTP_MEDIA_STATE_STOPPING);
+		media_queue_job(media, MEDIA_JOB_STOP, NULL);
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	if (client)
+		gst_http_client_close(client, "stopping");
+	for (walk = removed; walk; walk = g_list_next (walk))
+		g_object_unref (walk->data);
+	g_list_free (removed);
 
 	return 0;
 }
+
+static gboolean
+media_hold_timer (gpointer data)
+{
+	GstHTTPMedia *media = (GstHTTPMedia *) data;
+
+	GST_HTTP_MEDIA_LOCK (media);
+	if (media->keep_running || g_get_monotonic_time() < media->hold_until)
+	{
+		GST_HTTP_MEDIA_UNLOCK (media);
+		return TRUE;
+	}
+	GST_INFO ("%s: released idle hold", media->path);
+	media->hold = FALSE;
+	if (!media->clients && !media->pending && !media->replay &&
+	    (media->state == GST_HTTP_MEDIA_STATE_STARTING ||
+	     media->state == GST_HTTP_MEDIA_STATE_PLAYING))
+	{
+		media_set_state(media, GST_HTTP_MEDIA_STATE_STOPPING);
+		media_queue_job(media, MEDIA_JOB_STOP, NULL);
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	g_object_unref (media);
+	return FALSE;
+}
+
+/**
+ * gst_http_media_hold:
+ * @media: a #GstHTTPMedia
+ *
+ * Keep the pipeline of @media running without streaming clients, starting
+ * it if needed.  Used for viewers served from memory (HLS) rather than from
+ * the client list; the hold is released MEDIA_HOLD_TIMEOUT after the last
+ * call.
+ */
+void
+gst_http_media_hold (GstHTTPMedia *media)
+{
+	GST_HTTP_MEDIA_LOCK (media);
+	media->hold_until = g_get_monotonic_time() + MEDIA_HOLD_TIMEOUT;
+	if (!media->hold) {
+		media->hold = TRUE;
+		g_timeout_add_seconds (1, media_hold_timer, g_object_ref (media));
+	}
+	/* during a breaker cooldown media_breaker_reset starts it */
+	if ((media->state == GST_HTTP_MEDIA_STATE_STOPPED ||
+	     media->state == GST_HTTP_MEDIA_STATE_STOPPING) &&
+	    (!media->breaker_until ||
+	     g_get_monotonic_time() >= media->breaker_until))
+	{
+		GST_INFO ("%s: starting pipeline for held media", media->path);
+		media_set_state(media, GST_HTTP_MEDIA_STATE_STARTING);
+		media_queue_job(media, MEDIA_JOB_START, NULL);
+	}
+	GST_HTTP_MEDIA_UNLOCK (media);
+}
@@ -39,14 +39,94 @@ G_BEGIN_DECLS
 #define GST_HTTP_MEDIA_LOCK(mapping)      (g_mutex_lock(GST_HTTP_MEDIA_GET_LOCK(mapping)))
 #define GST_HTTP_MEDIA_UNLOCK(mapping)    (g_mutex_unlock(GST_HTTP_MEDIA_GET_LOCK(mapping)))
 
+/* H.264 in MPEG-TS byte stream rather than JPEG frames */
+#define GST_HTTP_MEDIA_TS_MIMETYPE        "video/mp2t"
+#define GST_HTTP_MEDIA_IS_TS(media) \
+	(strcmp(GST_HTTP_MEDIA_CAST(media)->mimetype, GST_HTTP_MEDIA_TS_MIMETYPE) == 0)
+
 typedef struct _GstHTTPMedia GstHTTPMedia;
 typedef struct _GstHTTPMediaClass GstHTTPMediaClass;
+typedef struct _GstHTTPMediaVariant GstHTTPMediaVariant;
 
 #include "http-client.h"
 #include "media-mapping.h"
+#include "rate.h"
+#include "metrics.h"
+#include "timeshift.h"
 
 typedef gboolean (*MediaHandlerFunc)(MediaURL *url, GstHTTPClient *client, gpointer data);
 
+/** GstHTTPMediaState - lifecycle of a stream pipeline
+ *
+ * Pipelines are built and torn down on the media worker thread so the
+ * main loop never blocks on device probing or state changes:
+ *   STOPPED  -> STARTING  client requested the stream, start job queued
+ *   STARTING -> PLAYING   first frame arrived, pending clients released
+ *   PLAYING  -> STOPPING  last client left, stop job queued
+ *   PLAYING  -> RESTARTING  pipeline error: torn down and started again
+ *                         after a backoff with the clients kept open
+ */
+typedef enum {
+	GST_HTTP_MEDIA_STATE_STOPPED,
+	GST_HTTP_MEDIA_STATE_STARTING,
+	GST_HTTP_MEDIA_STATE_PLAYING,
+	GST_HTTP_MEDIA_STATE_STOPPING,
+	GST_HTTP_MEDIA_STATE_RESTARTING,
+} GstHTTPMediaState;
+
+/** GstHTTPMediaVariantMode - how a variant is generated
+ *
+ * Decided once the native frame size is known: power-of-two downscales and
+ * quality changes of a JPEG stream are transcoded in the DCT domain from
+ * the native frames, anything else gets a decode/scale/encode branch.
+ */
+typedef enum {
+	GST_HTTP_VARIANT_UNRESOLVED,
+	GST_HTTP_VARIANT_BRANCH,
+	GST_HTTP_VARIANT_TRANSCODE,
+} GstHTTPMediaVariantMode;
+
+/** GstHTTPMediaSuppress - unchanged-frame detection
+ *
+ * Frames that differ too little from the last frame sent on a stream are
+ * not sent; a keep-alive frame still goes out at a minimum rate.
+ */
+typedef enum {
+	GST_HTTP_SUPPRESS_NONE,
+	GST_HTTP_SUPPRESS_HASH,     // identical scan data
+	GST_HTTP_SUPPRESS_LUMA,     // 1/8 scale luma change below threshold
+} GstHTTPMediaSuppress;
+
+/* change detector state of one stream (native or variant) */
+typedef struct {
+	guint32        hash;          // scan data hash of the last sent frame
+	guchar        *thumb;         // luma thumbnail of the last sent frame
+	guint          thumb_w;
+	guint          thumb_h;
+	gint64         last_sent;     // monotonic time (usec)
+	gboolean       force;         // send the next frame regardless
+} GstHTTPFrameFilter;
+
+/** GstHTTPMediaVariant - a scaled and/or re-encoded copy of a stream
+ *
+ * Built lazily for each distinct parameter set and shared by every client
+ * asking for the same parameters.  Torn down when the last client using it
+ * goes away.
+ */
+struct _GstHTTPMediaVariant {
+	GstHTTPMedia  *media;
+	gint           width;         // 0 = native
+	gint           height;        // 0 = native
+	gint           quality;       // jpegenc quality (0 = default)
+	guint          refcount;      // clients using this variant (media lock)
+	GstHTTPMediaVariantMode mode;
+	guint          scale;         // transcode: power of two divisor
+	guint          failures;      // transcode: consecutive failed frames
+	GstElement    *bin;           // queue ! jpegdec ! videoscale ! jpegenc ! appsink
+	GstPad        *teepad;
+	GstHTTPFrameFilter filter;
+};
+
 /** GstHTTPMedia - A mapping of a unique URL path to a resource
  *
  * There are two types of mappings:
@@ -66,24 +146,106 @@ struct _GstHTTPMedia {
 	gchar         *pipeline_desc; // gst-launch text
 	gchar         *mimetype;
 	gchar         *v4l2srcdev;    // capture source device
+	gchar         *encoder;       // ts: jpeg to h264 gst-launch text
+	GList         *streamheader;  // ts: buffers from the muxer caps
+	GQueue        *gop;           // ts: buffers since the last keyframe
+	gsize          gop_bytes;
+	struct _GstHTTPHLS *hls;      // ts: in-memory HLS segmenter
+	gboolean       hold;          // keep running without clients (HLS)
+	gint64         hold_until;    // monotonic usec
+	gboolean       keep_running;  // timeshift/record: held from startup
 	gchar         *capture;       // printf fmt string for capture fname
+	gboolean       capture_motion; // capture only around motion
+	guint          capture_preroll; // frames kept from before motion
+	gint64         capture_postroll; // capture time after motion (usec)
+	GQueue        *capture_ring;  // pre-roll frames (streaming thread)
+	guint          capture_count; // frames written
 	guint          count;
 	GList         *clients;
+	GList         *pending;       // clients waiting for the first frame
+	GList         *variants;      // GstHTTPMediaVariant branches in use
 	GstElement    *pipeline;
+	GstHTTPMediaState state;
+	GThreadPool   *worker;        // serializes pipeline start/stop jobs
+	guint          bus_watch;
 	guint         width;          // width of stream frame
 	guint         height;         // height of stream frame
 	time_t        starttime;			// time stream playback started
 	gboolean      shared;
 
+	struct metrics_media metrics;
+
+	/* error recovery */
+	GstBuffer     *last_frame;    // native jpeg, re-sent while restarting
+	guint         restarts;       // pipeline errors recovered from
+	guint         failures;       // consecutive errors (reset once stable)
+	guint         breaker_trips;  // times clients were dropped
+	gint64        restart_at;     // monotonic usec of the next start
+	gint64        breaker_until;  // monotonic usec, plays refused before
+	gint64        playing_since;  // monotonic usec of the first frame
+	guint         restart_timer;
+	gchar         *last_error;
+
+	/* frame-flow watchdog */
+	guint         watchdog;       // timer source id
+	gint64        last_buffer;    // monotonic usec of the last appsink buffer
+	gint          fps_n;          // framerate from caps (0 = unknown)
+	gint          fps_d;
+	guint         stalls;
+	gint64        stall_time;     // usec without frames, all stalls
+	gint64        last_stall;     // usec without frames, last stall
+
+	/* latency budget */
+	GstClockTime  latency_budget; // max capture-to-send age (0 = unbounded)
+	gboolean      leaky;          // leaky queue in front of the appsinks
+	guint64       late_frames;    // frames dropped over budget (atomic)
+	gint64        frame_captured; // wall usec of the frame being pushed
+	struct pctl   latency;        // capture-to-send latency (usec)
+
+	/* unchanged-frame suppression */
+	GstHTTPMediaSuppress suppress;
+	guint         suppress_threshold; // luma: max block change (0-255)
+	gint64        suppress_keepalive; // max time between frames (usec)
+	GstHTTPFrameFilter filter;    // native stream detector
+	guint64       suppressed_frames;
+	guint64       suppressed_bytes; // frame bytes not sent to clients
+
+	/* adaptive quality (see struct client_adapt) */
+	guint         adapt_levels;   // ladder steps offered (0 = off)
+	gint          adapt_quality;  // jpeg quality of the lower steps (0 = keep)
+
+	/* timeshift (keeps the pipeline running) */
+	GstHTTPTimeshift *timeshift;  // recent native frames
+	gdouble       catchup;        // replay speed until clients reach live
+	GList         *replay;        // clients playing from the ring
+	guint         replay_timer;   // main loop source sending to all of them
+
+	/* on-disk recording (keeps the pipeline running) */
+	struct _GstHTTPRecorder *recorder;
+
+	/* motion detection (analysis runs on motion_worker) */
+	guint         motion_threshold; // block luma change (0 = disabled)
+	guint         motion_blocks;  // changed blocks that count as motion
+	GThreadPool   *motion_worker;
+	GstBuffer     *motion_frame;  // latest frame waiting for analysis
+	guchar        *motion_ref;    // worker: previous luma thumbnail
+	guint         motion_ref_w;
+	guint         motion_ref_h;
+	gboolean      motion;         // motion currently active
+	guint         motion_score;   // changed blocks in last analysed frame
+	guint         motion_events;  // number of motion periods
+	gint64        motion_seen;    // monotonic time of last motion (usec)
+	time_t        motion_start;   // start of current/last motion period
+
 	/* input device handling */
 	gchar         *input_dev;			// input device filename
-	int           input_fd;
-	pthread_t     input_thread;
+	struct _InputSubscription *input;
 	time_t        ev_press;
 	GMutex        *ev_lock;
 	
 	/* Media Handler resources */
 	MediaHandlerFunc   func;
+	gboolean      raw_header;     // func writes its own status line
 	gpointer      *data;
 };
 
@@ -108,8 +270,10 @@ GstHTTPMedia * gst_http_media_new_handler (const gchar *desc,
 	MediaHandlerFunc, gpointer);
 
 /* media playback/control */
-gint gst_http_media_play (GstHTTPMedia *, GstHTTPClient *);
+const gchar * gst_http_media_state_name (GstHTTPMediaState state);
+gint gst_http_media_play (GstHTTPMedia *, GstHTTPClient *, MediaURL *);
 gint gst_http_media_stop (GstHTTPMedia *, GstHTTPClient *);
+void gst_http_media_hold (GstHTTPMedia *);
 
 G_END_DECLS
 
@@ -0,0 +1,323 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include <gst/gst.h>
+
+#include "metrics.h"
+#include "http-client.h"
+#include "media-mapping.h"
+#include "media.h"
+#include "recorder.h"
+
+struct metrics_server server_metrics;
+
+/** metric_observe - add a value to a histogram
+ */
+void
+metric_observe(struct metric_hist *h, guint64 value)
+{
+	guint i = (value > 1) ? 64 - __builtin_clzll(value - 1) : 0;
+
+	metric_inc(&h->buckets[MIN(i, METRIC_BUCKETS - 1)]);
+	metric_inc(&h->count);
+	metric_add(&h->sum, value);
+}
+
+/** metrics_send_account - count the result of a send syscall
+ * @param ret - send return value
+ * @param err - errno after the call
+ */
+void
+metrics_send_account(struct metrics_send *m, gint ret, gint err)
+{
+	metric_inc(&m->calls);
+	if (ret > 0)
+		metric_add(&m->bytes, ret);
+	else if (ret < 0)
+		metric_inc(&m->errors);
+}
+
+/*
+ * rendering: one GString per metric family so the samples of all media
+ * are grouped under a single TYPE line
+ */
+enum {
+	M_FRAMES_IN, M_FRAMES_OUT, M_BYTES, M_CALLS, M_SEND_ERRORS,
+	M_LATE, M_SUPPRESSED, M_STARTS, M_ERRORS, M_STALLS, M_CLIENTS,
+	M_PENDING, M_SOCK_QUEUE, M_REC_QUEUE, M_REC_DROPPED,
+	M_C_FRAMES, M_C_BYTES, M_C_CALLS,
+	M_C_RTT, M_C_CWND, M_C_RETRANS, M_C_QUEUED, M_C_UNSENT, M_C_CONGESTED,
+	M_C_SKIPPED,
+	M_C_ADAPT,
+	M_REQUESTS, M_REQ_LATENCY,
+	M_FAMILIES
+};
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+} families[M_FAMILIES] = {
+	{ "media_frames_in_total", "counter", "Frames received from the pipeline" },
+	{ "media_frames_out_total", "counter", "Frames sent to clients" },
+	{ "media_bytes_sent_total", "counter", "Bytes sent to clients" },
+	{ "media_send_calls_total", "counter", "Send syscalls" },
+	{ "media_send_errors_total", "counter", "Failed send syscalls" },
+	{ "media_late_frames_total", "counter", "Frames dropped over the latency budget" },
+	{ "media_suppressed_frames_total", "counter", "Unchanged frames not sent" },
+	{ "media_pipeline_starts_total", "counter", "Pipelines started" },
+	{ "media_pipeline_errors_total", "counter", "Pipeline errors and stalls" },
+	{ "media_stalls_total", "counter", "Watchdog stalls" },
+	{ "media_clients", "gauge", "Streaming clients" },
+	{ "media_pending_clients", "gauge", "Clients waiting for a frame" },
+	{ "media_socket_queue_bytes", "gauge", "Bytes queued in the client sockets" },
+	{ "media_recorder_queue_depth", "gauge", "Frames waiting for the recorder" },
+	{ "media_recorder_dropped_total", "counter", "Frames the recorder dropped" },
+	{ "client_frames_sent_total", "counter", "Frames sent to the client" },
+	{ "client_bytes_sent_total", "counter", "Bytes sent to the client" },
+	{ "client_send_calls_total", "counter", "Send syscalls for the client" },
+	{ "client_tcp_rtt_seconds", "gauge", "Smoothed TCP round trip time" },
+	{ "client_tcp_cwnd_segments", "gauge", "TCP congestion window" },
+	{ "client_tcp_retransmits_total", "counter", "TCP segments retransmitted" },
+	{ "client_socket_queue_bytes", "gauge", "Bytes queued in the socket, sent or not, unacked" },
+	{ "client_tcp_unsent_bytes", "gauge", "Bytes queued in the socket not yet sent" },
+	{ "client_congested", "gauge", "Client is skipping frames (1) or not (0)" },
+	{ "client_frames_skipped_total", "counter", "Frames skipped while congested" },
+	{ "client_adapt_level", "gauge", "Adaptive quality step (0 = requested stream)" },
+	{ "requests_total", "counter", "Requests by handler" },
+	{ "request_duration_seconds", "histogram", "Time to handle a request" },
+};
+
+/* name="value" with the label value escaped for the text format */
+static void
+metric_label(GString *s, const char *name, const char *value)
+{
+	const char *p;
+
+	g_string_append_printf(s, "%s=\"", name);
+	for (p = value; *p; p++) {
+		switch (*p) {
+		case '\\': g_string_append(s, "\\\\"); break;
+		case '"':  g_string_append(s, "\\\""); break;
+		case '\n': g_string_append(s, "\\n"); break;
+		default:   g_string_append_c(s, *p);
+		}
+	}
+	g_string_append_c(s, '"');
+}
+
+static void
+metric_sample(GString *s, const char *name, const char *labels,
+	guint64 value)
+{
+	g_string_append_printf(s, "gst_httpd_%s{%s} %" G_GUINT64_FORMAT "\n",
+		name, labels, value);
+}
+
+static void
+metric_sample_double(GString *s, const char *name, const char *labels,
+	gdouble value)
+{
+	g_string_append_printf(s, "gst_httpd_%s{%s} %.6f\n", name, labels, value);
+}
+
+static void
+metric_hist_render(GString *s, const char *name, const char *labels,
+	struct metric_hist *h)
+{
+	guint64 cumulative = 0;
+	gint i;
+
+	/* the last bucket is the overflow, only in +Inf */
+	for (i = 0; i < METRIC_BUCKETS - 1; i++) {
+		cumulative += h->buckets[i];
+		g_string_append_printf(s,
+			"gst_httpd_%s_bucket{%s,le=\"%g\"} %" G_GUINT64_FORMAT "\n",
+			name, labels, (double) (1ULL << i) / 1e6, cumulative);
+	}
+	g_string_append_printf(s,
+		"gst_httpd_%s_bucket{%s,le=\"+Inf\"} %" G_GUINT64_FORMAT "\n"
+		"gst_httpd_%s_sum{%s} %.6f\n"
+		"gst_httpd_%s_count{%s} %" G_GUINT64_FORMAT "\n",
+		name, labels, h->count, name, labels, h->sum / 1e6, name, labels,
+		h->count);
+}
+
+static void
+metrics_media(GString **f, GstHTTPMedia *media)
+{
+	struct metrics_media *m = &media->metrics;
+	GString *ls = g_string_new(NULL);
+	gchar *labels;
+	guint64 queued = 0;
+	GList *walk;
+
+	metric_label(ls, "path", media->path);
+	labels = g_string_free(ls, FALSE);
+
+	metric_sample(f[M_REQUESTS], families[M_REQUESTS].name, labels,
+		m->requests);
+	metric_hist_render(f[M_REQ_LATENCY], families[M_REQ_LATENCY].name,
+		labels, &m->request_latency);
+	if (!media->pipeline_desc) {
+		g_free(labels);
+		return;
+	}
+
+	metric_sample(f[M_FRAMES_IN], families[M_FRAMES_IN].name, labels,
+		m->frames_in);
+	metric_sample(f[M_FRAMES_OUT], families[M_FRAMES_OUT].name, labels,
+		m->out.frames);
+	metric_sample(f[M_BYTES], families[M_BYTES].name, labels, m->out.bytes);
+	metric_sample(f[M_CALLS], families[M_CALLS].name, labels, m->out.calls);
+	metric_sample(f[M_SEND_ERRORS], families[M_SEND_ERRORS].name, labels,
+		m->out.errors);
+	metric_sample(f[M_LATE], families[M_LATE].name, labels,
+		media->late_frames);
+	metric_sample(f[M_SUPPRESSED], families[M_SUPPRESSED].name, labels,
+		media->suppressed_frames);
+	metric_sample(f[M_STARTS], families[M_STARTS].name, labels, m->starts);
+	metric_sample(f[M_ERRORS], families[M_ERRORS].name, labels, m->errors);
+	metric_sample(f[M_STALLS], families[M_STALLS].name, labels,
+		media->stalls);
+
+	GST_HTTP_MEDIA_LOCK (media);
+	metric_sample(f[M_CLIENTS], families[M_CLIENTS].name, labels,
+		g_list_length(media->clients) + g_list_length(media->replay));
+	metric_sample(f[M_PENDING], families[M_PENDING].name, labels,
+		g_list_length(media->pending));
+	for (walk = media->clients; walk; walk = g_list_next (walk)) {
+		GstHTTPClient *c = (GstHTTPClient *) walk->data;
+		GString *cs = g_string_new(labels);
+		gchar *peer = g_strdup_printf("%s:%d", c->peer_ip, c->port);
+		gchar *cl;
+
+		g_string_append_c(cs, ',');
+		metric_label(cs, "client", peer);
+		g_free(peer);
+		cl = g_string_free(cs, FALSE);
+		queued += c->tcp.outq;
+
+		metric_sample(f[M_C_FRAMES], families[M_C_FRAMES].name, cl,
+			c->metrics.frames);
+		metric_sample(f[M_C_BYTES], families[M_C_BYTES].name, cl,
+			c->metrics.bytes);
+		metric_sample(f[M_C_CALLS], families[M_C_CALLS].name, cl,
+			c->metrics.calls);
+		if (c->tcp.sampled) {
+			metric_sample_double(f[M_C_RTT], families[M_C_RTT].name, cl,
+				c->tcp.rtt / 1e6);
+			metric_sample(f[M_C_CWND], families[M_C_CWND].name, cl,
+				c->tcp.cwnd);
+			metric_sample(f[M_C_RETRANS], families[M_C_RETRANS].name, cl,
+				c->tcp.retrans);
+			metric_sample(f[M_C_QUEUED], families[M_C_QUEUED].name, cl,
+				c->tcp.outq);
+			metric_sample(f[M_C_UNSENT], families[M_C_UNSENT].name, cl,
+				c->tcp.unsent);
+		}
+		metric_sample(f[M_C_CONGESTED], families[M_C_CONGESTED].name, cl,
+			c->tcp.congested);
+		metric_sample(f[M_C_SKIPPED], families[M_C_SKIPPED].name, cl,
+			c->tcp.skipped);
+		if (c->adapt.levels)
+			metric_sample(f[M_C_ADAPT], families[M_C_ADAPT].name, cl,
+				c->adapt.level);
+		g_free(cl);
+	}
+	metric_sample(f[M_SOCK_QUEUE], families[M_SOCK_QUEUE].name, labels,
+		queued);
+	GST_HTTP_MEDIA_UNLOCK (media);
+
+	if (media->recorder) {
+		metric_sample(f[M_REC_QUEUE], families[M_REC_QUEUE].name, labels,
+			media->recorder->queued);
+		metric_sample(f[M_REC_DROPPED], families[M_REC_DROPPED].name, labels,
+			media->recorder->dropped);
+	}
+	g_free(labels);
+}
+
+/** metrics_handler - Prometheus text exposition of the server counters
+ * @param url - unused
+ * @param client - client connection
+ * @param data - the #GstHTTPMediaMapping to report on
+ */
+gboolean
+metrics_handler(MediaURL *url, GstHTTPClient *client, gpointer data)
+{
+	GstHTTPMediaMapping *mapping = (GstHTTPMediaMapping *) data;
+	GString *f[M_FAMILIES];
+	GString *out = g_string_sized_new(16 * 1024);
+	GList *medias, *walk;
+	gint i;
+
+	for (i = 0; i < M_FAMILIES; i++)
+		f[i] = g_string_new(NULL);
+
+	/* the mapping list only grows at startup, but don't hold its lock
+	 * while taking media locks */
+	GST_HTTP_MEDIA_MAPPING_LOCK(mapping);
+	medias = g_list_copy(mapping->mappings);
+	g_list_foreach(medias, (GFunc) g_object_ref, NULL);
+	GST_HTTP_MEDIA_MAPPING_UNLOCK(mapping);
+	for (walk = medias; walk; walk = g_list_next (walk))
+		metrics_media(f, (GstHTTPMedia *) walk->data);
+	g_list_foreach(medias, (GFunc) g_object_unref, NULL);
+	g_list_free(medias);
+
+	g_string_append_printf(out,
+		"# HELP gst_httpd_accepts_total Connections accepted\n"
+		"# TYPE gst_httpd_accepts_total counter\n"
+		"gst_httpd_accepts_total %" G_GUINT64_FORMAT "\n"
+		"# HELP gst_httpd_connections Open connections\n"
+		"# TYPE gst_httpd_connections gauge\n"
+		"gst_httpd_connections %" G_GUINT64_FORMAT "\n"
+		"# HELP gst_httpd_http_requests_total Requests received\n"
+		"# TYPE gst_httpd_http_requests_total counter\n"
+		"gst_httpd_http_requests_total %" G_GUINT64_FORMAT "\n"
+		"# HELP gst_httpd_not_found_total Requests without a mapping\n"
+		"# TYPE gst_httpd_not_found_total counter\n"
+		"gst_httpd_not_found_total %" G_GUINT64_FORMAT "\n",
+		server_metrics.accepts, server_metrics.accepts - server_metrics.closes,
+		server_metrics.requests, server_metrics.not_found);
+	for (i = 0; i < M_FAMILIES; i++) {
+		if (f[i]->len) {
+			g_string_append_printf(out,
+				"# HELP gst_httpd_%s %s\n# TYPE gst_httpd_%s %s\n",
+				families[i].name, families[i].help, families[i].name,
+				families[i].type);
+			g_string_append_len(out, f[i]->str, f[i]->len);
+		}
+		g_string_free(f[i], TRUE);
+	}
+
+	gst_http_client_status(client, "200 OK");
+	gst_http_client_writeln(client, "Content-Type: text/plain; version=0.0.4");
+	gst_http_client_writeln(client, "Content-Length: %" G_GSIZE_FORMAT,
+		out->len);
+	gst_http_client_write(client, "\r\n");
+	gst_http_client_writebuf(client, out->str, out->len);
+	g_string_free(out, TRUE);
+
+	return TRUE;
+}
@@ -0,0 +1,78 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <glib.h>
+
+/*
+ * counters and histograms for the /metrics endpoint (Prometheus text)
+ *   - updated with atomic adds from any thread, no locks on the hot path
+ *   - histograms use power of two buckets: bucket i counts values up to
+ *     and including 2^i (usec for latencies) above 2^(i-1), the last one
+ *     everything larger; every series is rendered with the same le set
+ */
+#define metric_add(p, n)   __sync_fetch_and_add((p), (n))
+#define metric_inc(p)      __sync_fetch_and_add((p), 1)
+
+#define METRIC_BUCKETS 32
+
+struct metric_hist {
+	guint64 buckets[METRIC_BUCKETS];
+	guint64 count;
+	guint64 sum;
+};
+
+void metric_observe(struct metric_hist *h, guint64 value);
+
+/* socket writes, kept per client and summed per media */
+struct metrics_send {
+	guint64 frames;        // frames (or stream buffers) sent
+	guint64 bytes;
+	guint64 calls;         // send syscalls (blocking: no EAGAIN)
+	guint64 errors;
+};
+
+void metrics_send_account(struct metrics_send *m, gint ret, gint err);
+
+struct metrics_media {
+	struct metrics_send out;
+	guint64 frames_in;     // appsink buffers
+	guint64 starts;        // pipelines started
+	guint64 errors;        // pipeline errors and stalls
+	guint64 requests;
+	struct metric_hist request_latency; // usec to handle a request
+};
+
+struct metrics_server {
+	guint64 accepts;
+	guint64 closes;
+	guint64 requests;
+	guint64 not_found;
+};
+
+extern struct metrics_server server_metrics;
+
+struct _MediaURL;
+struct _GstHTTPClient;
+gboolean metrics_handler(struct _MediaURL *url, struct _GstHTTPClient *client,
+	gpointer data);
+
+#endif /* _METRICS_H_ */
@@ -17,50 +17,139 @@
  * Boston, MA 02111-1307, USA.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "rate.h"
 
-unsigned long
-avg_add_samples(struct avg* pavg, unsigned long val)
+/* monotonic seconds, never 0 */
+static long
+rate_now(void)
+{
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ts.tv_sec + 1;
+}
+
+/* value of a finished second (0 if nothing was added that second) */
+static unsigned long
+rate_bucket(struct rate *r, long sec)
+{
+	unsigned int idx = sec % RATE_BUCKETS;
+
+	return (r->stamp[idx] == sec) ? r->bucket[idx] : 0;
+}
+
+/* the EWMA with the seconds from r->tick up to (not including) now folded
+ * in: the current bucket, then zeroes for idle seconds.  The first second
+ * is partial and skipped, the first full second seeds the average. */
+static double
+rate_fold(struct rate *r, long now)
 {
-	int i;
-	time_t now = time(NULL);
-
-	if (pavg->lastupdate > now 
-	 || now - pavg->lastupdate > 0
-	 || pavg->_idx == 0)
-	{
-		// TODO: this is incorrect for Windows sizes > 1
-		// - need to increment by number of seconds passed and clear
-		//   all windows in between
-		pavg->idx++;
-		pavg->lastupdate = now;
-		if (pavg->_idx < AVG_WINDOW+1)
-			pavg->_idx++;
-		if (pavg->idx >= AVG_WINDOW+1)
-			pavg->idx = 0;
-		pavg->window[pavg->idx] = 0;
+	double ewma = r->ewma;
+	long gap;
+
+	if (!r->tick || now <= r->tick)
+		return ewma;
+	if (r->tick == r->start + 1)
+		ewma = rate_bucket(r, r->tick);
+	else if (r->tick != r->start)
+		ewma += RATE_EWMA_ALPHA * ((double) rate_bucket(r, r->tick) - ewma);
+	for (gap = now - r->tick - 1; gap > 0 && ewma > 0.0; gap--) {
+		ewma -= RATE_EWMA_ALPHA * ewma;
+		if (gap > RATE_BUCKETS)
+			gap = RATE_BUCKETS; // decayed to nothing anyway
 	}
+	return ewma;
+}
+
+void
+rate_add(struct rate *r, unsigned long val)
+{
+	long now = rate_now();
+
+	if (now != r->tick) {
+		unsigned int idx = now % RATE_BUCKETS;
 
-	pavg->window[pavg->idx] += val;
-	pavg->total += val;
-
-	/* recalc average over window */
-	pavg->avg = 0;
-	if (pavg->_idx > 1) {
-		for (i = 0; i < AVG_WINDOW+1; i++) {
-			if (i != pavg->idx)
-				pavg->avg += pavg->window[i];
-		}
-		if (pavg->_idx > 2)
-			pavg->avg /= (pavg->_idx - 1);
+		r->ewma = rate_fold(r, now);
+		r->bucket[idx] = 0;
+		r->stamp[idx] = now;
+		r->tick = now;
+		if (!r->start)
+			r->start = now;
 	}
-	return pavg->avg;
+	r->bucket[now % RATE_BUCKETS] += val;
+	r->total += val;
+}
+
+/* average per second over the last window complete seconds, or over the
+ * full seconds since the first sample if that is shorter */
+double
+rate_get(struct rate *r, unsigned int window)
+{
+	long now = rate_now();
+	long span, sec;
+	unsigned long sum = 0;
+
+	if (!r->start)
+		return 0.0;
+	if (window > RATE_BUCKETS - 1)
+		window = RATE_BUCKETS - 1;
+	span = now - (r->start + 1);
+	if (span > (long) window)
+		span = window;
+	if (span <= 0)
+		return 0.0;
+
+	for (sec = now - span; sec < now; sec++)
+		sum += rate_bucket(r, sec);
+	return (double) sum / span;
+}
+
+/* exponentially weighted rate per second (decays while idle) */
+double
+rate_ewma(struct rate *r)
+{
+	return rate_fold(r, rate_now());
+}
+
+void
+pctl_add_sample(struct pctl *p, unsigned long val)
+{
+	p->samples[p->idx] = val;
+	p->idx = (p->idx + 1) % PCTL_SAMPLES;
+	p->count++;
+}
+
+static int
+cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *) a;
+	unsigned long y = *(const unsigned long *) b;
+
+	return (x > y) - (x < y);
 }
 
+/* percentile of the retained samples (0 if there are none) */
 unsigned long
-avg_get_avg(struct avg *pavg)
+pctl_get(struct pctl *p, unsigned int percent)
 {
-	return pavg->avg;
+	unsigned long sorted[PCTL_SAMPLES];
+	unsigned int n = (p->count < PCTL_SAMPLES) ? p->count : PCTL_SAMPLES;
+
+	if (n == 0)
+		return 0;
+	if (percent > 100)
+		percent = 100;
+
+	memcpy(sorted, p->samples, n * sizeof(sorted[0]));
+	qsort(sorted, n, sizeof(sorted[0]), cmp_ulong);
+
+	return sorted[((n - 1) * percent) / 100];
 }
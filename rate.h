@@ -21,23 +21,44 @@
 #define _RATE_H_
 
 /*
- * track samples over a sliding window
- *   - sample is whatever units you feed in
+ * rate of samples over sliding windows
+ *   - sample is whatever units you feed in, rates are per second
+ *   - one second buckets on CLOCK_MONOTONIC_COARSE: O(1) updates, no
+ *     clock read beyond one vDSO call per sample
+ *   - buckets are stamped with their second so idle gaps read as zero
+ *     without the writer having to clear them
+ *   - one writer; readers in other threads take no lock and may see the
+ *     second being rolled over
  */
-#define AVG_WINDOW 1 // seconds to average over
+#define RATE_BUCKETS 64          // >= the largest window
+#define RATE_EWMA_ALPHA 0.1      // weight of each new second in the EWMA
 
-struct avg {
-	unsigned long total; // total sample count
-	unsigned long avg;   // integer average (samples/second)
+struct rate {
+	unsigned long total;     // total sample count
+	long start;              // second of the first sample (0 = none)
+	long tick;               // second of the current bucket
+	unsigned long bucket[RATE_BUCKETS];
+	long stamp[RATE_BUCKETS];
+	double ewma;             // per second, up to the end of the last tick
+};
+
+void   rate_add(struct rate*, unsigned long);
+double rate_get(struct rate*, unsigned int window);  // window in seconds
+double rate_ewma(struct rate*);
+
+/*
+ * percentiles over the most recent samples
+ *   - one writer, readers may see a sample being replaced
+ */
+#define PCTL_SAMPLES 256
 
-	/* accounting */
-	unsigned int idx;
-	unsigned int _idx;
-	unsigned long window[AVG_WINDOW+1];
-	time_t lastupdate;
+struct pctl {
+	unsigned long samples[PCTL_SAMPLES];
+	unsigned int idx;     // next slot to write
+	unsigned long count;  // total sample count
 };
 
-unsigned long avg_add_samples(struct avg*, unsigned long);
-unsigned long avg_get_avg(struct avg*);
+void pctl_add_sample(struct pctl*, unsigned long);
+unsigned long pctl_get(struct pctl*, unsigned int percent);
 
 #endif /* _RATE_H_ */
@@ -0,0 +1,534 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "recorder.h"
+#include "media.h"
+#include "cpustat.h"
+#include "flightrec.h"
+
+GST_DEBUG_CATEGORY_STATIC (http_recorder_debug);
+#define GST_CAT_DEFAULT http_recorder_debug
+
+typedef struct {
+	GstBuffer     *buffer;
+	gint64         time;
+} RecFrame;
+
+static gchar *
+recorder_path(GstHTTPRecorder *rec, gint64 start, const gchar *ext)
+{
+	return g_strdup_printf("%s/%" G_GINT64_FORMAT ".%s", rec->dir, start, ext);
+}
+
+static gint
+segment_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+	gint64 x = ((const GstHTTPRecSegment *) a)->start;
+	gint64 y = ((const GstHTTPRecSegment *) b)->start;
+
+	return (x > y) - (x < y);
+}
+
+/* delete the oldest segments beyond the retention limits (lock held) */
+static void
+recorder_retention(GstHTTPRecorder *rec, gint64 now)
+{
+	guint64 total = 0;
+	GList *walk;
+
+	for (walk = rec->segments->head; walk; walk = g_list_next (walk))
+		total += ((GstHTTPRecSegment *) walk->data)->bytes;
+
+	while (g_queue_get_length(rec->segments) > 1) {
+		GstHTTPRecSegment *seg = g_queue_peek_head(rec->segments);
+		gchar *path;
+
+		if (seg == rec->cur)
+			break;
+		if (!(rec->keep_bytes && total > rec->keep_bytes) &&
+		    !(rec->keep_time && seg->end < now - rec->keep_time))
+			break;
+
+		GST_INFO ("removing segment %" G_GINT64_FORMAT, seg->start);
+		path = recorder_path(rec, seg->start, "mjpeg");
+		g_unlink(path);
+		g_free(path);
+		path = recorder_path(rec, seg->start, "idx");
+		g_unlink(path);
+		g_free(path);
+
+		total -= seg->bytes;
+		rec->deleted++;
+		g_queue_pop_head(rec->segments);
+		g_free(seg);
+	}
+}
+
+/* pick up segments recorded by a previous run */
+static void
+recorder_scan(GstHTTPRecorder *rec)
+{
+	GDir *dir = g_dir_open(rec->dir, 0, NULL);
+	const gchar *name;
+
+	if (!dir)
+		return;
+	while ((name = g_dir_read_name(dir))) {
+		GstHTTPRecSegment *seg;
+		GstHTTPRecIndex last;
+		struct stat data, idx;
+		gchar *end, *path;
+		gint64 start = g_ascii_strtoll(name, &end, 10);
+		int fd;
+
+		if (strcmp(end, ".idx") != 0)
+			continue;
+
+		path = recorder_path(rec, start, "idx");
+		fd = open(path, O_RDONLY);
+		g_free(path);
+		if (fd < 0)
+			continue;
+		path = recorder_path(rec, start, "mjpeg");
+		if (fstat(fd, &idx) < 0 || stat(path, &data) < 0 ||
+		    idx.st_size < (off_t) sizeof(last) ||
+		    pread(fd, &last, sizeof(last), (idx.st_size / sizeof(last) - 1) *
+		          sizeof(last)) != sizeof(last))
+		{
+			close(fd);
+			g_free(path);
+			continue;
+		}
+		close(fd);
+		g_free(path);
+
+		seg = g_new0(GstHTTPRecSegment, 1);
+		seg->start = start;
+		seg->end = last.time;
+		seg->bytes = data.st_size + idx.st_size;
+		g_queue_insert_sorted(rec->segments, seg, segment_cmp, NULL);
+	}
+	g_dir_close(dir);
+
+	GST_INFO ("%s: found %d segments", rec->dir,
+		g_queue_get_length(rec->segments));
+}
+
+/* start a new segment (writer thread) */
+static void
+recorder_rotate(GstHTTPRecorder *rec, gint64 now)
+{
+	GstHTTPRecSegment *seg;
+	gchar *path;
+
+	if (rec->data_fd >= 0)
+		close(rec->data_fd);
+	if (rec->idx_fd >= 0)
+		close(rec->idx_fd);
+
+	seg = g_new0(GstHTTPRecSegment, 1);
+	seg->start = seg->end = now;
+
+	path = recorder_path(rec, now, "mjpeg");
+	rec->data_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (rec->data_fd < 0)
+		GST_ERROR ("%s: %s", path, strerror(errno));
+	g_free(path);
+	path = recorder_path(rec, now, "idx");
+	rec->idx_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (rec->idx_fd < 0)
+		GST_ERROR ("%s: %s", path, strerror(errno));
+	g_free(path);
+	rec->data_off = 0;
+
+	g_mutex_lock(rec->lock);
+	g_queue_push_tail(rec->segments, seg);
+	rec->cur = seg;
+	recorder_retention(rec, now);
+	g_mutex_unlock(rec->lock);
+}
+
+static gboolean
+write_all(int fd, const void *buf, gsize size)
+{
+	const guchar *p = buf;
+
+	while (size) {
+		ssize_t n = write(fd, p, size);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FALSE;
+		p += n;
+		size -= n;
+	}
+	return TRUE;
+}
+
+static void
+recorder_write(gpointer data, gpointer user_data)
+{
+	GstHTTPRecorder *rec = (GstHTTPRecorder *) user_data;
+	RecFrame *f = (RecFrame *) data;
+	GstHTTPRecIndex entry;
+
+	cpustat_thread_register("recorder", rec->dir);
+	if (!rec->cur || f->time - rec->cur->start >= rec->segment_time)
+		recorder_rotate(rec, f->time);
+
+	memset(&entry, 0, sizeof(entry));
+	entry.time = f->time;
+	entry.offset = rec->data_off;
+	entry.size = f->buffer->size;
+
+	/* the data must be on disk before its index record */
+	if (rec->data_fd >= 0 && rec->idx_fd >= 0 &&
+	    write_all(rec->data_fd, f->buffer->data, f->buffer->size) &&
+	    write_all(rec->idx_fd, &entry, sizeof(entry)))
+	{
+		rec->data_off += f->buffer->size;
+		g_mutex_lock(rec->lock);
+		rec->cur->end = f->time;
+		rec->cur->bytes += f->buffer->size + sizeof(entry);
+		rec->frames++;
+		rec->bytes += f->buffer->size;
+		g_mutex_unlock(rec->lock);
+	} else {
+		GST_WARNING ("%s: write failed: %s", rec->dir, strerror(errno));
+		flightrec_log(FR_FRAME_DROPPED, rec->dir, errno, f->buffer->size);
+		g_mutex_lock(rec->lock);
+		rec->dropped++;
+		g_mutex_unlock(rec->lock);
+	}
+
+	g_mutex_lock(rec->lock);
+	rec->queued--;
+	g_mutex_unlock(rec->lock);
+
+	gst_buffer_unref(f->buffer);
+	g_free(f);
+}
+
+/** recorder_new - create a recorder writing to a directory
+ * @param dir - segment directory (created if needed)
+ * @param segment_sec - segment duration
+ * @param keep_bytes - retention size (0 = unlimited)
+ * @param keep_time - retention age in usec (0 = unlimited)
+ */
+GstHTTPRecorder *
+recorder_new(const gchar *dir, guint segment_sec, guint64 keep_bytes,
+	gint64 keep_time)
+{
+	GstHTTPRecorder *rec;
+
+	if (!http_recorder_debug)
+		GST_DEBUG_CATEGORY_INIT (http_recorder_debug, "httprecorder", 0,
+			"segment recorder");
+
+	if (g_mkdir_with_parents(dir, 0755) < 0) {
+		GST_ERROR ("%s: %s", dir, strerror(errno));
+		return NULL;
+	}
+
+	rec = g_new0(GstHTTPRecorder, 1);
+	rec->lock = g_mutex_new();
+	rec->dir = g_strdup(dir);
+	rec->segment_time = (gint64) MAX(segment_sec, 1) * G_USEC_PER_SEC;
+	rec->keep_bytes = keep_bytes;
+	rec->keep_time = keep_time;
+	rec->segments = g_queue_new();
+	rec->data_fd = rec->idx_fd = -1;
+	rec->writer = g_thread_pool_new(recorder_write, rec, 1, FALSE, NULL);
+
+	recorder_scan(rec);
+	recorder_retention(rec, g_get_real_time());
+
+	return rec;
+}
+
+void
+recorder_free(GstHTTPRecorder *rec)
+{
+	if (!rec)
+		return;
+	g_thread_pool_free(rec->writer, FALSE, TRUE);
+	if (rec->data_fd >= 0)
+		close(rec->data_fd);
+	if (rec->idx_fd >= 0)
+		close(rec->idx_fd);
+	g_queue_foreach(rec->segments, (GFunc) g_free, NULL);
+	g_queue_free(rec->segments);
+	g_mutex_free(rec->lock);
+	g_free(rec->dir);
+	g_free(rec);
+}
+
+/** recorder_push - queue a frame for writing
+ * Frames are dropped if the writer is RECORDER_MAX_QUEUED frames behind
+ */
+void
+recorder_push(GstHTTPRecorder *rec, GstBuffer *buffer)
+{
+	RecFrame *f;
+
+	g_mutex_lock(rec->lock);
+	if (rec->queued >= RECORDER_MAX_QUEUED) {
+		flightrec_log(FR_FRAME_DROPPED, rec->dir, 0, buffer->size);
+		rec->dropped++;
+		g_mutex_unlock(rec->lock);
+		return;
+	}
+	rec->queued++;
+	g_mutex_unlock(rec->lock);
+
+	f = g_new(RecFrame, 1);
+	f->buffer = gst_buffer_ref(buffer);
+	f->time = g_get_real_time();
+	g_thread_pool_push(rec->writer, f, NULL);
+}
+
+/** recorder_total_bytes - disk space used by the segments
+ */
+guint64
+recorder_total_bytes(GstHTTPRecorder *rec)
+{
+	guint64 total = 0;
+	GList *walk;
+
+	g_mutex_lock(rec->lock);
+	for (walk = rec->segments->head; walk; walk = g_list_next (walk))
+		total += ((GstHTTPRecSegment *) walk->data)->bytes;
+	g_mutex_unlock(rec->lock);
+
+	return total;
+}
+
+/*
+ * playback
+ */
+typedef struct {
+	GstHTTPRecorder *rec;
+	GstHTTPClient *client;
+	GList         *segments;      // copies of the segments in range
+	gint64         from;
+	gint64         to;
+	gdouble        speed;         // 0 = as fast as possible
+} RecPlayback;
+
+/* send the frames of one segment in [from, to]; FALSE on client error */
+static gboolean
+playback_segment(RecPlayback *pb, GstHTTPRecSegment *seg, gint64 *first,
+	gint64 wall_start)
+{
+	GstHTTPClient *client = pb->client;
+	GstHTTPRecIndex *idx;
+	gchar *path;
+	struct stat sb;
+	int data_fd, idx_fd;
+	gsize n, lo, hi;
+	gboolean ok = TRUE;
+
+	path = recorder_path(pb->rec, seg->start, "idx");
+	idx_fd = open(path, O_RDONLY);
+	g_free(path);
+	path = recorder_path(pb->rec, seg->start, "mjpeg");
+	data_fd = open(path, O_RDONLY);
+	g_free(path);
+	if (idx_fd < 0 || data_fd < 0 || fstat(idx_fd, &sb) < 0 ||
+	    (n = sb.st_size / sizeof(GstHTTPRecIndex)) == 0)
+		goto out;
+
+	idx = mmap(NULL, n * sizeof(GstHTTPRecIndex), PROT_READ, MAP_SHARED,
+		idx_fd, 0);
+	if (idx == MAP_FAILED)
+		goto out;
+
+	/* first frame at or after from */
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		gsize mid = lo + (hi - lo) / 2;
+
+		if (idx[mid].time < pb->from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; ok && lo < n && idx[lo].time <= pb->to; lo++) {
+		off_t off = idx[lo].offset;
+		gsize left = idx[lo].size;
+
+		if (pb->speed > 0) {
+			gint64 due;
+
+			if (*first < 0)
+				*first = idx[lo].time;
+			due = wall_start + (idx[lo].time - *first) / pb->speed;
+			if (due > g_get_monotonic_time())
+				g_usleep(due - g_get_monotonic_time());
+		}
+
+		gst_http_client_write  (client, "\r\n");
+		gst_http_client_writeln(client, "--%s", MULTIPART_BOUNDARY);
+		gst_http_client_writeln(client, "Content-Type: image/jpeg");
+		gst_http_client_writeln(client, "Content-Length: %u", idx[lo].size);
+		gst_http_client_writeln(client, "X-Timestamp: %.6f",
+			idx[lo].time / 1e6);
+		if (gst_http_client_write(client, "\r\n") < 0)
+			ok = FALSE;
+
+		while (ok && left) {
+			ssize_t sent = sendfile(client->sock, data_fd, &off, left);
+
+			if (sent < 0 && errno == EINTR)
+				continue;
+			if (sent <= 0)
+				ok = FALSE;
+			else
+				left -= sent;
+		}
+	}
+
+	munmap(idx, n * sizeof(GstHTTPRecIndex));
+out:
+	if (idx_fd >= 0)
+		close(idx_fd);
+	if (data_fd >= 0)
+		close(data_fd);
+	return ok;
+}
+
+static gpointer
+playback_thread(gpointer data)
+{
+	RecPlayback *pb = (RecPlayback *) data;
+	gint64 wall_start = g_get_monotonic_time();
+	gint64 first = -1;
+	GList *walk;
+
+	cpustat_thread_register("recorder", "playback");
+	for (walk = pb->segments; walk; walk = g_list_next (walk)) {
+		if (!playback_segment(pb, (GstHTTPRecSegment *) walk->data, &first,
+		                      wall_start))
+			break;
+	}
+
+	GST_DEBUG ("playback for %s:%d finished", pb->client->peer_ip,
+		pb->client->port);
+	/* the main loop sees the hangup and releases the client */
+	shutdown(pb->client->sock, SHUT_RDWR);
+
+	g_list_foreach(pb->segments, (GFunc) g_free, NULL);
+	g_list_free(pb->segments);
+	g_object_unref(pb->client);
+	g_free(pb);
+	return NULL;
+}
+
+/* parse a time query field: epoch seconds, or relative to now if negative */
+static gint64
+query_time(MediaURL *url, const char *name, gint64 now, gint64 def)
+{
+	gchar *str = get_query_field(url, name);
+	gdouble val;
+
+	if (!str)
+		return def;
+	val = g_ascii_strtod(str, NULL);
+	g_free(str);
+
+	return (val <= 0) ? now + (gint64) (val * G_USEC_PER_SEC) :
+		(gint64) (val * G_USEC_PER_SEC);
+}
+
+/** recorder_handler - play back a recorded time range
+ * @param url - ?from=&to= (epoch seconds, negative is relative to now),
+ *   speed= (playback rate, 0 = as fast as possible, default 1)
+ * @param client - client connection
+ * @param data - the #GstHTTPMedia
+ *
+ * Frames are sent as multipart/x-mixed-replace from a playback thread
+ * using sendfile, each with an X-Timestamp part header.
+ */
+gboolean
+recorder_handler(MediaURL *url, GstHTTPClient *client, gpointer data)
+{
+	GstHTTPMedia *media = (GstHTTPMedia *) data;
+	GstHTTPRecorder *rec = media->recorder;
+	RecPlayback *pb;
+	GList *walk;
+	gint64 now = g_get_real_time();
+	gchar *str;
+
+	pb = g_new0(RecPlayback, 1);
+	pb->rec = rec;
+	pb->from = query_time(url, "from=", now, now - 60 * G_USEC_PER_SEC);
+	pb->to = query_time(url, "to=", now, now);
+	pb->speed = 1.0;
+	if ((str = get_query_field(url, "speed="))) {
+		pb->speed = MAX(g_ascii_strtod(str, NULL), 0);
+		g_free(str);
+	}
+
+	g_mutex_lock(rec->lock);
+	for (walk = rec->segments->head; walk; walk = g_list_next (walk)) {
+		GstHTTPRecSegment *seg = (GstHTTPRecSegment *) walk->data;
+
+		if (seg->end >= pb->from && seg->start <= pb->to)
+			pb->segments = g_list_append(pb->segments,
+				g_memdup(seg, sizeof(*seg)));
+	}
+	if (pb->segments)
+		rec->playbacks++;
+	g_mutex_unlock(rec->lock);
+
+	if (!pb->segments) {
+		g_free(pb);
+		gst_http_client_status(client, "404 Not Found");
+		gst_http_client_write(client, "\r\n");
+		return TRUE;
+	}
+
+	GST_INFO ("%s: playback %.1fs from %" G_GINT64_FORMAT " for %s:%d",
+		media->path, (pb->to - pb->from) / 1e6, pb->from, client->peer_ip,
+		client->port);
+	gst_http_client_status(client, "200 OK");
+	gst_http_client_writeln(client, "Content-Type: multipart/x-mixed-replace;"
+		"boundary=%s", MULTIPART_BOUNDARY);
+
+	pb->client = g_object_ref(client);
+	g_thread_create(playback_thread, pb, FALSE, NULL);
+
+	return FALSE;
+}
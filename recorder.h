@@ -0,0 +1,90 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <gst/gst.h>
+
+#include "http-client.h"
+#include "media-mapping.h"
+
+/*
+ * segmented on-disk recorder
+ *   - frames are appended to <dir>/<start>.mjpeg segment files, <start>
+ *     being the wall clock time (usec) of the first frame
+ *   - <start>.idx holds one fixed size GstHTTPRecIndex record per frame in
+ *     time order: it can be mmap'd and binary searched
+ *   - disk writes run on a writer thread fed through a bounded queue
+ *   - retention by total size and/or age, oldest segments deleted first
+ */
+#define RECORDER_MAX_QUEUED  64   // frames waiting for the writer
+
+typedef struct {
+	gint64         time;          // wall clock usec
+	guint64        offset;        // in the segment data file
+	guint32        size;
+	guint32        reserved;
+} GstHTTPRecIndex;
+
+typedef struct {
+	gint64         start;         // wall clock usec, names the files
+	gint64         end;           // time of the last frame
+	guint64        bytes;         // data and index
+} GstHTTPRecSegment;
+
+typedef struct _GstHTTPRecorder GstHTTPRecorder;
+
+struct _GstHTTPRecorder {
+	GMutex        *lock;
+
+	/* configuration */
+	gchar         *dir;
+	gint64         segment_time;  // usec per segment
+	guint64        keep_bytes;    // 0 = no size limit
+	gint64         keep_time;     // usec, 0 = no age limit
+
+	GQueue        *segments;      // GstHTTPRecSegment, oldest first
+	GThreadPool   *writer;
+	guint          queued;
+
+	/* segment being written (writer thread) */
+	GstHTTPRecSegment *cur;
+	int            data_fd;
+	int            idx_fd;
+	guint64        data_off;
+
+	/* stats */
+	guint64        frames;
+	guint64        bytes;
+	guint64        dropped;
+	guint          deleted;       // segments removed by retention
+	guint          playbacks;
+};
+
+GstHTTPRecorder *recorder_new(const gchar *dir, guint segment_sec,
+	guint64 keep_bytes, gint64 keep_time);
+void     recorder_free(GstHTTPRecorder *rec);
+void     recorder_push(GstHTTPRecorder *rec, GstBuffer *buffer);
+guint64  recorder_total_bytes(GstHTTPRecorder *rec);
+gboolean recorder_handler(MediaURL *url, GstHTTPClient *client,
+	gpointer data);
+
+#endif /* _RECORDER_H_ */
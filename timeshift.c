@@ -0,0 +1,146 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <string.h>
+
+#include "timeshift.h"
+
+#define SLOT(ts, n)  (&(ts)->index[((ts)->first + (n)) % (ts)->capacity])
+
+/** timeshift_new - allocate a ring
+ * @param seconds - time window kept
+ * @param bytes - arena size
+ */
+GstHTTPTimeshift *
+timeshift_new(guint seconds, gsize bytes)
+{
+	GstHTTPTimeshift *ts = g_new0(GstHTTPTimeshift, 1);
+
+	ts->arena = g_malloc(bytes);
+	ts->arena_size = bytes;
+	ts->capacity = MAX(seconds, 1) * TIMESHIFT_MAX_FPS;
+	ts->index = g_new0(GstHTTPTimeshiftFrame, ts->capacity);
+	ts->window = (gint64) seconds * G_USEC_PER_SEC;
+
+	return ts;
+}
+
+void
+timeshift_free(GstHTTPTimeshift *ts)
+{
+	if (!ts)
+		return;
+	g_free(ts->arena);
+	g_free(ts->index);
+	g_free(ts);
+}
+
+static void
+timeshift_evict(GstHTTPTimeshift *ts)
+{
+	ts->first = (ts->first + 1) % ts->capacity;
+	ts->count--;
+}
+
+/** timeshift_push - append a frame, evicting what it overwrites
+ */
+void
+timeshift_push(GstHTTPTimeshift *ts, const guchar *data, gsize size,
+	gint64 now)
+{
+	GstHTTPTimeshiftFrame *f;
+	gsize off = ts->head;
+
+	if (size > ts->arena_size / 2) {
+		ts->dropped++;
+		return;
+	}
+
+	/* frames are contiguous: skip the arena tail if it does not fit.  The
+	 * frames in the skipped tail are the oldest ones */
+	if (off + size > ts->arena_size) {
+		while (ts->count && SLOT(ts, 0)->offset >= off)
+			timeshift_evict(ts);
+		off = 0;
+	}
+	while (ts->count && SLOT(ts, 0)->offset >= off &&
+	       SLOT(ts, 0)->offset < off + size)
+		timeshift_evict(ts);
+	while (ts->count && (ts->count == ts->capacity ||
+	       SLOT(ts, 0)->ts < now - ts->window))
+		timeshift_evict(ts);
+
+	memcpy(ts->arena + off, data, size);
+	f = SLOT(ts, ts->count);
+	f->seq = ts->next_seq++;
+	f->ts = now;
+	f->offset = off;
+	f->size = size;
+	ts->count++;
+	ts->head = off + size;
+}
+
+/** timeshift_seek - find the first frame at or after a time
+ * @param time - monotonic usec
+ * @param seq - sequence of the frame found
+ *
+ * Returns FALSE if the ring is empty.  A time before the oldest frame
+ * gives the oldest frame, a time past the newest gives the newest.
+ */
+gboolean
+timeshift_seek(GstHTTPTimeshift *ts, gint64 time, guint64 *seq)
+{
+	guint lo = 0, hi;
+
+	if (!ts->count)
+		return FALSE;
+
+	hi = ts->count - 1;
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+
+		if (SLOT(ts, mid)->ts < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*seq = SLOT(ts, lo)->seq;
+	return TRUE;
+}
+
+/** timeshift_get - frame by sequence, NULL if evicted or not yet pushed
+ */
+const GstHTTPTimeshiftFrame *
+timeshift_get(GstHTTPTimeshift *ts, guint64 seq)
+{
+	guint64 oldest = ts->next_seq - ts->count;
+
+	if (seq < oldest || seq >= ts->next_seq)
+		return NULL;
+	return SLOT(ts, seq - oldest);
+}
+
+/** timeshift_oldest - sequence of the oldest frame kept
+ */
+guint64
+timeshift_oldest(GstHTTPTimeshift *ts)
+{
+	return ts->next_seq - ts->count;
+}
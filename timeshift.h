@@ -0,0 +1,67 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef _TIMESHIFT_H_
+#define _TIMESHIFT_H_
+
+#include <glib.h>
+
+/*
+ * timeshift ring: the last frames of a stream in a preallocated arena
+ *   - frames are copied into the arena as a circular log; the index ring
+ *     holds one entry per frame in arrival order, so the oldest frame is
+ *     always the one just past the write head
+ *   - frames are numbered by a sequence that never wraps; a frame is
+ *     found by sequence in O(1) and by time in O(log n)
+ *   - not locked: callers serialize access (media lock)
+ */
+#define TIMESHIFT_MAX_FPS  60   // index entries per second of window
+
+typedef struct {
+	guint64        seq;
+	gint64         ts;            // arrival time (monotonic usec)
+	gsize          offset;        // in arena
+	gsize          size;
+} GstHTTPTimeshiftFrame;
+
+typedef struct {
+	guchar        *arena;
+	gsize          arena_size;
+	gsize          head;          // next write offset
+	GstHTTPTimeshiftFrame *index;
+	guint          capacity;
+	guint          first;         // index slot of the oldest frame
+	guint          count;
+	guint64        next_seq;      // sequence of the next frame pushed
+	gint64         window;        // usec of frames kept
+	guint          dropped;       // frames too large for the arena
+} GstHTTPTimeshift;
+
+GstHTTPTimeshift *timeshift_new(guint seconds, gsize bytes);
+void     timeshift_free(GstHTTPTimeshift *ts);
+void     timeshift_push(GstHTTPTimeshift *ts, const guchar *data, gsize size,
+	gint64 now);
+gboolean timeshift_seek(GstHTTPTimeshift *ts, gint64 time, guint64 *seq);
+const GstHTTPTimeshiftFrame *timeshift_get(GstHTTPTimeshift *ts, guint64 seq);
+guint64  timeshift_oldest(GstHTTPTimeshift *ts);
+
+#define timeshift_data(ts, frame) ((ts)->arena + (frame)->offset)
+
+#endif /* _TIMESHIFT_H_ */
@@ -0,0 +1,164 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * flightrec-decode: print a gst-httpd flight recorder dump as text
+ *
+ *   flightrec-decode [flightrec.bin]
+ *
+ * Records of all threads are merged by time; times are converted to wall
+ * clock using the clock pair saved in the dump header.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../flightrec.h"
+
+static const char *types[FR_TYPES] = {
+	"none", "connect", "disconnect", "request", "state", "frame-late",
+	"frame-dropped", "send-stall", "send-error", "error", "stall", "breaker",
+	"congested", "adapt",
+};
+
+/* GstHTTPMediaState */
+static const char *states[] = {
+	"Stopped", "Starting", "Playing", "Stopping", "Restarting",
+};
+
+static const char *
+state_name(long long s)
+{
+	return (s >= 0 && s < (long long) (sizeof(states) / sizeof(states[0]))) ?
+		states[s] : "?";
+}
+
+static int
+event_cmp(const void *a, const void *b)
+{
+	const struct flightrec_event *ea = a, *eb = b;
+
+	return (ea->time > eb->time) - (ea->time < eb->time);
+}
+
+static void
+print_event(const struct flightrec_header *h, const struct flightrec_event *e)
+{
+	unsigned long long wall = h->realtime - (h->monotonic - e->time);
+	time_t sec = wall / 1000000;
+	char tag[FLIGHTREC_TAG + 1];
+	char when[32];
+
+	memcpy(tag, e->tag, FLIGHTREC_TAG);
+	tag[FLIGHTREC_TAG] = 0;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+	printf("%s.%06llu %6u %-13s %-20s ", when, wall % 1000000, e->tid,
+		e->type < FR_TYPES ? types[e->type] : "?", tag);
+
+	switch (e->type) {
+	case FR_CONNECT:
+	case FR_DISCONNECT:
+		printf("port %d fd %lld", e->arg, (long long) e->value);
+		break;
+	case FR_REQUEST:
+		printf("fd %d", e->arg);
+		break;
+	case FR_STATE:
+		printf("%s -> %s", state_name(e->arg), state_name(e->value));
+		break;
+	case FR_FRAME_LATE:
+		printf("age %.3fms", e->value / 1e3);
+		break;
+	case FR_FRAME_DROPPED:
+		printf("%lld bytes%s%s", (long long) e->value,
+			e->arg ? ": " : "", e->arg ? strerror(e->arg) : "");
+		break;
+	case FR_SEND_STALL:
+	case FR_SEND_ERROR:
+		printf("fd %d: %s", e->arg, strerror(e->value));
+		break;
+	case FR_ERROR:
+	case FR_BREAKER:
+		printf("failures %d", e->arg);
+		break;
+	case FR_STALL:
+		printf("stall %d, %.1fs without frames", e->arg, e->value / 1e6);
+		break;
+	case FR_CONGESTED:
+		printf("fd %d: %lld bytes unsent", e->arg, (long long) e->value);
+		break;
+	case FR_ADAPT:
+		printf("level %d at %lld bytes/s", e->arg, (long long) e->value);
+		break;
+	default:
+		printf("arg %d value %lld", e->arg, (long long) e->value);
+		break;
+	}
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *fp = stdin;
+	struct flightrec_header h;
+	struct flightrec_ring_header rh;
+	struct flightrec_event *ev = NULL;
+	size_t n = 0, i;
+	unsigned int r;
+
+	if (argc > 1 && !(fp = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != FLIGHTREC_MAGIC) {
+		fprintf(stderr, "not a flight recorder dump\n");
+		return 1;
+	}
+	if (h.version != FLIGHTREC_VERSION ||
+	    h.event_size != sizeof(struct flightrec_event)) {
+		fprintf(stderr, "unsupported dump version %u (record size %u)\n",
+			h.version, h.event_size);
+		return 1;
+	}
+
+	for (r = 0; r < h.rings; r++) {
+		if (fread(&rh, sizeof(rh), 1, fp) != 1 ||
+		    rh.count > FLIGHTREC_EVENTS)
+			break;
+		ev = realloc(ev, (n + rh.count) * sizeof(*ev));
+		if (!ev || fread(ev + n, sizeof(*ev), rh.count, fp) != rh.count) {
+			fprintf(stderr, "truncated dump\n");
+			break;
+		}
+		n += rh.count;
+	}
+	qsort(ev, n, sizeof(*ev), event_cmp);
+
+	printf("pid %u, %u threads, %zu events\n", h.pid, h.rings, n);
+	for (i = 0; i < n; i++)
+		if (ev[i].type != FR_NONE)
+			print_event(&h, &ev[i]);
+
+	free(ev);
+	if (fp != stdin)
+		fclose(fp);
+	return 0;
+}
@@ -0,0 +1,579 @@
+/* gst-httpd
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * gst-httpd-bench: load generator for a gst-httpd instance
+ *
+ *   gst-httpd-bench [options] [stream path ...]
+ *
+ *   -a <addr>     server address (127.0.0.1)
+ *   -p <port>     server port (8080)
+ *   -n <count>    multipart streaming clients (4), spread over the paths
+ *   -m <count>    polling clients (2), alternating -j and -f
+ *   -s <count>    of the streaming clients, how many read slowly (0)
+ *   -r <KB/s>     read rate of the slow clients (64)
+ *   -i <ms>       polling interval (1000)
+ *   -j <path>     JSON poll path (/server.json)
+ *   -f <path>     static poll path (/index.html)
+ *   -d <seconds>  test duration (10)
+ *   -P <pid>      server pid, to report its CPU use
+ *
+ * Each client runs on its own thread with a blocking socket.  Streaming
+ * clients parse the multipart boundaries and measure per frame:
+ *   - the interval since the previous frame (fps and jitter: the standard
+ *     deviation of the intervals)
+ *   - capture-to-receive latency from the X-Timestamp part header (wall
+ *     clock, so only meaningful against a server on the same host)
+ * Slow clients shrink their receive buffer and pace their reads so the
+ * server sees a full socket and its backpressure handling is exercised.
+ *
+ * A loopback run needs live test sources so frames carry timestamps, ie
+ * with tools/bench.conf:
+ *   gst-httpd -f tools/bench.conf -d www &
+ *   gst-httpd-bench -n 50 -s 5 -m 10 -d 30 -P $! /bench30 /bench5
+ */
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define BENCH_READBUF    (64 * 1024)
+#define BENCH_LINE       1024
+#define BENCH_SAMPLES    4096        // latency samples kept per client
+#define BENCH_SLOW_RCVBUF (16 * 1024)
+
+/* buffered reader over a blocking socket */
+struct reader {
+	int fd;
+	char buf[BENCH_READBUF];
+	size_t pos, len;
+	unsigned long long bytes;        // total read from the socket
+	double rate;                     // bytes/s to read at (0 = unpaced)
+	double start;                    // pacing epoch
+};
+
+struct client {
+	pthread_t thread;
+	int id;
+	int stream;                      // multipart client or poller
+	int slow;
+	const char *path;
+	int fd;
+	char error[128];
+
+	/* streaming */
+	unsigned long frames;
+	unsigned long bad_frames;        // not starting with a JPEG SOI
+	unsigned long long bytes;
+	double first, last;              // receive time of first/last frame
+	double ival_mean, ival_m2;       // Welford over frame intervals
+	unsigned long ivals;
+	double latency[BENCH_SAMPLES];   // seconds, ring
+	unsigned long latencies;
+
+	/* polling */
+	unsigned long requests;
+	unsigned long failures;
+	double response[BENCH_SAMPLES];  // seconds, ring
+};
+
+static const char *address = "127.0.0.1";
+static const char *port = "8080";
+static int streams = 4;
+static int pollers = 2;
+static int slow_clients = 0;
+static int slow_rate = 64;           // KB/s
+static int poll_interval = 1000;     // ms
+static const char *json_path = "/server.json";
+static const char *static_path = "/index.html";
+static int duration = 10;
+static int server_pid = 0;
+
+static volatile int stop;
+static struct addrinfo *server;
+
+static double
+now_mono(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+now_real(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_connect(int rcvbuf)
+{
+	int fd = socket(server->ai_family, SOCK_STREAM, 0);
+	int one = 1;
+
+	if (fd < 0)
+		return -1;
+	/* must be set before connect to limit the advertised window */
+	if (rcvbuf)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, server->ai_addr, server->ai_addrlen) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+bench_request(int fd, const char *path)
+{
+	char req[BENCH_LINE];
+	int len = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n"
+		"Host: %s\r\nUser-Agent: gst-httpd-bench\r\n\r\n", path, address);
+
+	return (write(fd, req, len) == len) ? 0 : -1;
+}
+
+/* refill the reader, sleeping first if it is ahead of its pace */
+static int
+reader_fill(struct reader *r)
+{
+	ssize_t n;
+	size_t want = sizeof(r->buf);
+
+	if (r->rate > 0) {
+		double due = r->start + r->bytes / r->rate - now_mono();
+
+		if (due > 0)
+			usleep(due * 1e6);
+		/* small reads keep the socket full between them */
+		want = 4096;
+	}
+	n = read(r->fd, r->buf, want);
+	if (n <= 0)
+		return -1;
+	r->pos = 0;
+	r->len = n;
+	r->bytes += n;
+	return 0;
+}
+
+/* read one line, without its CRLF */
+static int
+reader_line(struct reader *r, char *line, size_t size)
+{
+	size_t n = 0;
+
+	for (;;) {
+		char ch;
+
+		if (r->pos == r->len && reader_fill(r) < 0)
+			return -1;
+		ch = r->buf[r->pos++];
+		if (ch == '\n')
+			break;
+		if (ch != '\r' && n < size - 1)
+			line[n++] = ch;
+	}
+	line[n] = 0;
+	return 0;
+}
+
+/* read size bytes; only the first head bytes are kept */
+static int
+reader_skip(struct reader *r, size_t size, unsigned char *head, size_t hlen)
+{
+	size_t got = 0;
+
+	while (got < size) {
+		size_t n;
+
+		if (r->pos == r->len && reader_fill(r) < 0)
+			return -1;
+		n = r->len - r->pos;
+		if (n > size - got)
+			n = size - got;
+		if (got < hlen)
+			memcpy(head + got, r->buf + r->pos,
+				(n < hlen - got) ? n : hlen - got);
+		r->pos += n;
+		got += n;
+	}
+	return 0;
+}
+
+/* status line and headers; returns the status code */
+static int
+read_response(struct reader *r, char *boundary, size_t size)
+{
+	char line[BENCH_LINE];
+	int status = 0;
+
+	if (reader_line(r, line, sizeof(line)) < 0 ||
+	    sscanf(line, "HTTP/%*s %d", &status) != 1)
+		return -1;
+	while (reader_line(r, line, sizeof(line)) == 0 && *line) {
+		char *b;
+
+		if (boundary && strncasecmp(line, "Content-Type:", 13) == 0 &&
+		    (b = strstr(line, "boundary="))) {
+			snprintf(boundary, size, "--%s", b + 9);
+		}
+	}
+	return status;
+}
+
+static void *
+stream_client(void *data)
+{
+	struct client *c = (struct client *) data;
+	struct reader *r = calloc(1, sizeof(*r));
+	char line[BENCH_LINE];
+	char boundary[BENCH_LINE] = "";
+	int status;
+
+	c->fd = r->fd = bench_connect(c->slow ? BENCH_SLOW_RCVBUF : 0);
+	if (r->fd < 0 || bench_request(r->fd, c->path) < 0) {
+		snprintf(c->error, sizeof(c->error), "connect: %s", strerror(errno));
+		goto out;
+	}
+	if (c->slow) {
+		r->rate = slow_rate * 1024.0;
+		r->start = now_mono();
+	}
+	status = read_response(r, boundary, sizeof(boundary));
+	if (status != 200 || !*boundary) {
+		snprintf(c->error, sizeof(c->error), "status %d%s", status,
+			*boundary ? "" : ", not multipart");
+		goto out;
+	}
+
+	while (!stop) {
+		long length = -1;
+		double stamp = 0, t;
+		unsigned char soi[2] = { 0, 0 };
+
+		/* blank lines, then the delimiter */
+		do {
+			if (reader_line(r, line, sizeof(line)) < 0)
+				goto closed;
+		} while (!*line);
+		if (strcmp(line, boundary) != 0) {
+			snprintf(c->error, sizeof(c->error), "bad delimiter '%.64s'",
+				line);
+			goto out;
+		}
+		while (reader_line(r, line, sizeof(line)) == 0 && *line) {
+			if (strncasecmp(line, "Content-Length:", 15) == 0)
+				length = atol(line + 15);
+			else if (strncasecmp(line, "X-Timestamp:", 12) == 0)
+				stamp = atof(line + 12);
+		}
+		if (length < 0) {
+			snprintf(c->error, sizeof(c->error), "part without length");
+			goto out;
+		}
+		if (reader_skip(r, length, soi, sizeof(soi)) < 0)
+			goto closed;
+
+		t = now_mono();
+		if (soi[0] != 0xff || soi[1] != 0xd8)
+			c->bad_frames++;
+		if (c->frames++) {
+			double ival = t - c->last;
+			double delta = ival - c->ival_mean;
+
+			c->ivals++;
+			c->ival_mean += delta / c->ivals;
+			c->ival_m2 += delta * (ival - c->ival_mean);
+		} else {
+			c->first = t;
+		}
+		c->last = t;
+		c->bytes += length;
+		if (stamp > 0)
+			c->latency[c->latencies++ % BENCH_SAMPLES] = now_real() - stamp;
+	}
+	goto out;
+
+closed:
+	if (!stop)
+		snprintf(c->error, sizeof(c->error), "connection closed");
+out:
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r);
+	return NULL;
+}
+
+static void *
+poll_client(void *data)
+{
+	struct client *c = (struct client *) data;
+	struct reader *r = calloc(1, sizeof(*r));
+
+	while (!stop) {
+		const char *path = (c->requests % 2) ? static_path : json_path;
+		double t = now_mono();
+		int status;
+
+		c->fd = r->fd = bench_connect(0);
+		if (r->fd < 0 || bench_request(r->fd, path) < 0) {
+			c->failures++;
+		} else {
+			r->pos = r->len = 0;
+			status = read_response(r, NULL, 0);
+			/* the server closes once the body is sent */
+			while (status == 200 && reader_fill(r) == 0)
+				;
+			if (status == 200)
+				c->response[c->requests % BENCH_SAMPLES] = now_mono() - t;
+			else
+				c->failures++;
+		}
+		if (r->fd >= 0)
+			close(r->fd);
+		c->fd = -1;
+		c->requests++;
+		usleep(poll_interval * 1000);
+	}
+	free(r);
+	return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* percentile of n samples (sorted in place) */
+static double
+percentile(double *samples, unsigned long n, int percent)
+{
+	if (!n)
+		return 0;
+	qsort(samples, n, sizeof(double), cmp_double);
+	return samples[(n - 1) * percent / 100];
+}
+
+/* utime + stime of a process in clock ticks */
+static unsigned long long
+process_ticks(int pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long utime, stime;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if (!(fp = fopen(path, "r")))
+		return 0;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	/* the command name may contain spaces: fields resume after ')' */
+	if (!p || !(p = strrchr(buf, ')')) ||
+	    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+	           &utime, &stime) != 2)
+		return 0;
+	return utime + stime;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-a addr] [-p port] [-n streams] "
+		"[-m pollers] [-s slow] [-r KB/s] [-i ms] [-j path] [-f path] "
+		"[-d seconds] [-P pid] [stream path ...]\n", name);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo hints;
+	struct client *clients;
+	const char *default_path[] = { "/bench30" };
+	const char **paths = default_path;
+	int npaths = 1, nclients, opt, i, err;
+	unsigned long long ticks = 0;
+	double start, elapsed, *lat;
+	unsigned long total_frames = 0, total_lat = 0, total_requests = 0;
+	unsigned long total_failures = 0, total_responses = 0;
+	unsigned long long total_bytes = 0;
+	double *responses;
+
+	while ((opt = getopt(argc, argv, "a:p:n:m:s:r:i:j:f:d:P:")) != -1) {
+		switch (opt) {
+		case 'a': address = optarg; break;
+		case 'p': port = optarg; break;
+		case 'n': streams = atoi(optarg); break;
+		case 'm': pollers = atoi(optarg); break;
+		case 's': slow_clients = atoi(optarg); break;
+		case 'r': slow_rate = atoi(optarg); break;
+		case 'i': poll_interval = atoi(optarg); break;
+		case 'j': json_path = optarg; break;
+		case 'f': static_path = optarg; break;
+		case 'd': duration = atoi(optarg); break;
+		case 'P': server_pid = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind < argc) {
+		paths = (const char **) &argv[optind];
+		npaths = argc - optind;
+	}
+	if (streams < 0 || pollers < 0 || duration <= 0 || slow_rate <= 0)
+		usage(argv[0]);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if ((err = getaddrinfo(address, port, &hints, &server)) != 0) {
+		fprintf(stderr, "%s:%s: %s\n", address, port, gai_strerror(err));
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	nclients = streams + pollers;
+	clients = calloc(nclients, sizeof(*clients));
+	if (server_pid)
+		ticks = process_ticks(server_pid);
+	start = now_mono();
+	for (i = 0; i < nclients; i++) {
+		struct client *c = &clients[i];
+
+		c->id = i;
+		c->fd = -1;
+		c->stream = (i < streams);
+		c->slow = (i < slow_clients);
+		c->path = paths[i % npaths];
+		if (pthread_create(&c->thread, NULL,
+		                   c->stream ? stream_client : poll_client, c) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	/* progress once a second */
+	for (i = 0; i < duration; i++) {
+		unsigned long frames = 0;
+		unsigned long long bytes = 0;
+		int j;
+
+		sleep(1);
+		for (j = 0; j < streams; j++) {
+			frames += clients[j].frames;
+			bytes += clients[j].bytes;
+		}
+		fprintf(stderr, "%3ds: %lu frames, %.1f MB\r", i + 1, frames,
+			bytes / 1e6);
+	}
+	fprintf(stderr, "\n");
+
+	/* wake the threads blocked in read */
+	stop = 1;
+	elapsed = now_mono() - start;
+	for (i = 0; i < nclients; i++) {
+		if (clients[i].fd >= 0)
+			shutdown(clients[i].fd, SHUT_RDWR);
+	}
+	for (i = 0; i < nclients; i++)
+		pthread_join(clients[i].thread, NULL);
+
+	lat = calloc((size_t) streams * BENCH_SAMPLES + 1, sizeof(double));
+	printf("%-4s %-16s %-4s %8s %7s %9s %9s %9s %9s  %s\n", "id", "path",
+		"slow", "frames", "fps", "kbps", "jitter", "lat p50", "lat p99",
+		"error");
+	for (i = 0; i < streams; i++) {
+		struct client *c = &clients[i];
+		double span = (c->frames > 1) ? c->last - c->first : 0;
+		unsigned long n = (c->latencies < BENCH_SAMPLES) ? c->latencies :
+			BENCH_SAMPLES;
+
+		memcpy(lat + total_lat, c->latency, n * sizeof(double));
+		total_lat += n;
+		printf("%-4d %-16.16s %-4s %8lu %7.1f %9.0f %7.1fms %7.1fms "
+			"%7.1fms  %s\n", c->id, c->path, c->slow ? "yes" : "",
+			c->frames, span ? (c->frames - 1) / span : 0,
+			c->bytes * 8 / elapsed / 1000,
+			c->ivals > 1 ? sqrt(c->ival_m2 / (c->ivals - 1)) * 1e3 : 0,
+			percentile(c->latency, n, 50) * 1e3,
+			percentile(c->latency, n, 99) * 1e3,
+			c->bad_frames ? "corrupt frames" : c->error);
+		total_frames += c->frames;
+		total_bytes += c->bytes;
+	}
+
+	responses = calloc((size_t) pollers * BENCH_SAMPLES + 1, sizeof(double));
+	for (i = streams; i < nclients; i++) {
+		struct client *c = &clients[i];
+		unsigned long n = (c->requests < BENCH_SAMPLES) ? c->requests :
+			BENCH_SAMPLES, j;
+
+		for (j = 0; j < n; j++) {
+			if (c->response[j] > 0)
+				responses[total_responses++] = c->response[j];
+		}
+		total_requests += c->requests;
+		total_failures += c->failures;
+	}
+
+	printf("\nstreams: %d (%d slow), %.1f frames/s, %.1f Mbit/s",
+		streams, slow_clients < streams ? slow_clients : streams,
+		total_frames / elapsed, total_bytes * 8 / elapsed / 1e6);
+	if (total_lat)
+		printf(", latency p50 %.1fms p99 %.1fms",
+			percentile(lat, total_lat, 50) * 1e3,
+			percentile(lat, total_lat, 99) * 1e3);
+	printf("\npollers: %d, %.1f requests/s, %lu failed", pollers,
+		total_requests / elapsed, total_failures);
+	if (total_responses)
+		printf(", response p50 %.1fms p99 %.1fms",
+			percentile(responses, total_responses, 50) * 1e3,
+			percentile(responses, total_responses, 99) * 1e3);
+	printf("\n");
+	if (server_pid) {
+		unsigned long long used = process_ticks(server_pid) - ticks;
+
+		printf("server: pid %d, %.1f%% cpu\n", server_pid,
+			used * 100.0 / sysconf(_SC_CLK_TCK) / elapsed);
+	}
+
+	free(lat);
+	free(responses);
+	free(clients);
+	freeaddrinfo(server);
+	return 0;
+}
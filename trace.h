@@ -0,0 +1,78 @@
+/* gst-httpd 
+ * Copyright (C) 2012 Tim Harvey <harvey.tim at gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/*
+ * static tracepoints (USDT, provider gst_httpd)
+ *   - built in when systemtap's <sys/sdt.h> is found (see Makefile): each
+ *     probe is a single nop plus an ELF note that perf, bpftrace and
+ *     systemtap attach to at run time, ie
+ *       bpftrace -e 'usdt:./gst-httpd:gst_httpd:send_end { ... }'
+ *       perf probe -x gst-httpd sdt_gst_httpd:frame
+ *   - otherwise the probes compile to nothing and their arguments are not
+ *     evaluated
+ *   - arguments are plain values already at hand: no calls or formatting
+ *     on the hot path when nobody is tracing
+ *
+ * probes and arguments:
+ *   request       fd, method, path, query        request line parsed
+ *   request_done  fd, path, usec                 handler returned
+ *   media_find    path, media, media path        mapping lookup result
+ *   frame         media path, size, timestamp    appsink buffer arrived
+ *   send_start    fd, media path, size           frame write to a client
+ *   send_end      fd, media path, result         (result < 0 on error)
+ *   state         media path, old, new           GstHTTPMediaState change
+ *   client_close  fd, peer ip, port              connection released
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define TRACE_REQUEST(fd, method, path, query) \
+	DTRACE_PROBE4(gst_httpd, request, fd, method, path, query)
+#define TRACE_REQUEST_DONE(fd, path, usec) \
+	DTRACE_PROBE3(gst_httpd, request_done, fd, path, usec)
+#define TRACE_MEDIA_FIND(path, media, media_path) \
+	DTRACE_PROBE3(gst_httpd, media_find, path, media, media_path)
+#define TRACE_FRAME(media_path, size, ts) \
+	DTRACE_PROBE3(gst_httpd, frame, media_path, size, ts)
+#define TRACE_SEND_START(fd, media_path, size) \
+	DTRACE_PROBE3(gst_httpd, send_start, fd, media_path, size)
+#define TRACE_SEND_END(fd, media_path, ret) \
+	DTRACE_PROBE3(gst_httpd, send_end, fd, media_path, ret)
+#define TRACE_STATE(media_path, old, new) \
+	DTRACE_PROBE3(gst_httpd, state, media_path, old, new)
+#define TRACE_CLIENT_CLOSE(fd, ip, port) \
+	DTRACE_PROBE3(gst_httpd, client_close, fd, ip, port)
+
+#else
+
+#define TRACE_REQUEST(fd, method, path, query)      do { } while (0)
+#define TRACE_REQUEST_DONE(fd, path, usec)          do { } while (0)
+#define TRACE_MEDIA_FIND(path, media, media_path)   do { } while (0)
+#define TRACE_FRAME(media_path, size, ts)           do { } while (0)
+#define TRACE_SEND_START(fd, media_path, size)      do { } while (0)
+#define TRACE_SEND_END(fd, media_path, ret)         do { } while (0)
+#define TRACE_STATE(media_path, old, new)           do { } while (0)
+#define TRACE_CLIENT_CLOSE(fd, ip, port)            do { } while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* _TRACE_H_ */